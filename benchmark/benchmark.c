@@ -0,0 +1,660 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include "vm.h"
+#pragma comment(lib,"mvm64.lib")
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib,"psapi.lib")
+#else
+#include <unistd.h>
+#endif
+
+// counts down from n, popped off of the stack
+U8 countdowncode[] = {
+    POP, // pop into register
+    8, // register R
+    SUB | VALB_FLAG | SMALL_FLAG, // loop: subtract 8-bit value from register
+    8, // register R
+    1, // 8-bit value
+    JZR | VALA_FLAG | SMALL_FLAG, // jump if R is zero
+    11, // past the following JMP
+    JMP | VALA_FLAG, // jump back to loop
+    0xFB, // 64bit -5
+    0xFF,
+    0xFF,
+    0xFF,
+    0xFF,
+    0xFF,
+    0xFF,
+    0xFF,
+    RET // return
+};
+
+// mixes arithmetic and logic n times, with n popped off of the stack
+U8 arithcode[] = {
+    POP, // pop into register
+    8, // register R
+    ADD, // loop: add register to register
+    0, // register A
+    8, // register R
+    MUL | VALB_FLAG | SMALL_FLAG, // multiply register by 8-bit value
+    0, // register A
+    3, // 8-bit value
+    XOR, // xor register with register
+    0, // register A
+    1, // register B
+    AND | VALB_FLAG | SMALL_FLAG, // and register with 8-bit value
+    0, // register A
+    0xFF, // 8-bit value
+    OR, // or register with register
+    1, // register B
+    0, // register A
+    SUB | VALB_FLAG | SMALL_FLAG, // subtract 8-bit value from register
+    8, // register R
+    1, // 8-bit value
+    JZR | VALA_FLAG | SMALL_FLAG, // jump if R is zero
+    11, // past the following JMP
+    JMP | VALA_FLAG, // jump back to loop
+    0xEC, // 64bit -20
+    0xFF,
+    0xFF,
+    0xFF,
+    0xFF,
+    0xFF,
+    0xFF,
+    0xFF,
+    MOV, // move register to register
+    8, // dest register R
+    1, // source register B
+    RET // return
+};
+
+// pushes and pops n times, with n popped off of the stack
+U8 stackcode[] = {
+    POP, // pop into register
+    8, // register R
+    PUSH, // loop: push register
+    8, // register R
+    PUSH | VALA_FLAG | SMALL_FLAG, // push 8-bit value
+    7, // 8-bit value
+    POP, // pop into register
+    0, // register A
+    POP, // pop into register
+    1, // register B
+    ADD, // add register to register
+    2, // register C
+    0, // register A
+    SUB | VALB_FLAG | SMALL_FLAG, // subtract 8-bit value from register
+    8, // register R
+    1, // 8-bit value
+    JZR | VALA_FLAG | SMALL_FLAG, // jump if R is zero
+    11, // past the following JMP
+    JMP | VALA_FLAG, // jump back to loop
+    0xF0, // 64bit -16
+    0xFF,
+    0xFF,
+    0xFF,
+    0xFF,
+    0xFF,
+    0xFF,
+    0xFF,
+    MOV, // move register to register
+    8, // dest register R
+    2, // source register C
+    RET // return
+};
+
+typedef struct
+{
+    const char* name;
+    const U8* code;
+    size_t code_size;
+    U64 arg; // pushed before each run
+    U64 runs;
+} WORKLOAD;
+
+typedef struct
+{
+    const char* name;
+    U64 (*engine)(const MVM64_IMAGE*, MVM64_REGISTERS*, INT64*); // NULL for execute()
+    int fused; // run on the image decoded with IMAGE_FUSE and verified
+} ENGINE;
+
+MVM64_JIT* jit; // translation of the current workload, NULL if unsupported
+
+// runs the translation of the current workload, which was made from image
+U64 jit_engine(const MVM64_IMAGE* image, MVM64_REGISTERS* context, INT64* return_value)
+{
+    (void)image;
+
+    return execute_jit(jit, context, return_value);
+}
+
+// runs an image's code in a sandbox with unlimited fuel, skipping static checks if it is verified
+U64 sandboxed_engine(const MVM64_IMAGE* image, MVM64_REGISTERS* context, INT64* return_value)
+{
+    MVM64_SANDBOX sandbox = { 0 };
+    sandbox.fuel = U64_MAX;
+
+    return execute_image_sandboxed(image, context, &sandbox, return_value);
+}
+
+#define SLICE_INSTRUCTIONS 64
+
+// runs an image's code in short slices, as a host interleaving many contexts would
+U64 slice_engine(const MVM64_IMAGE* image, MVM64_REGISTERS* context, INT64* return_value)
+{
+    U64 bytes_executed = 0;
+
+    context->s.I.u = (U64)image->code;
+
+    while (execute_slice(context, SLICE_INSTRUCTIONS, &bytes_executed, return_value) == MVM64_YIELDED);
+
+    return bytes_executed;
+}
+
+ENGINE engines[] = {
+    { "execute", NULL, 0 },
+    { "execute_slice", slice_engine, 0 },
+    { "execute_sandboxed", sandboxed_engine, 0 },
+    { "execute_sandboxed+verify", sandboxed_engine, 1 },
+    { "execute_image", execute_image, 0 },
+    { "execute_threaded", execute_threaded, 0 },
+    { "execute_image+fuse", execute_image, 1 },
+    { "execute_threaded+fuse", execute_threaded, 1 },
+    { "execute_jit", jit_engine, 0 }
+};
+
+#define NUM_ENGINES (sizeof(engines) / sizeof(ENGINE))
+
+U8 buffer[1024];
+
+double now()
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// prepares a context for another run, clearing general purpose registers and the stack
+void reset(MVM64_REGISTERS* context, U64 arg)
+{
+    INT64 value;
+    value.u = arg;
+
+    for (size_t s = 0; s <= 8; s++)
+        context->a[s].u = 0;
+
+    context->s.S.u = context->s.Z.u;
+    push(value, context);
+}
+
+// counts the instructions retired by a single run, by stepping through it
+U64 count_instructions(const WORKLOAD* workload, MVM64_REGISTERS* context)
+{
+    U64 count = 0;
+
+    reset(context, workload->arg);
+    context->s.I.u = (U64)workload->code;
+
+    while (1)
+    {
+        U64 bytes = step(context);
+
+        count++;
+
+        if (bytes == 0 || bytes == U64_MAX)
+            return count;
+    }
+}
+
+// counts the dispatches a decoded-image engine makes in a single run, by stepping through it
+// each superinstruction dispatched covers the instructions that follow it in sequence
+U64 count_dispatches(const WORKLOAD* workload, const MVM64_IMAGE* image, MVM64_REGISTERS* context)
+{
+    U64 dispatches = 0, covered = 0, expected = 0;
+
+    reset(context, workload->arg);
+    context->s.I.u = (U64)workload->code;
+
+    while (1)
+    {
+        U64 index = image->index[context->s.I.u - (U64)workload->code];
+
+        if (covered && index == expected)
+        {
+            covered--;
+        }
+        else
+        {
+            dispatches++;
+            covered = image->instructions[index].fused - 1;
+        }
+
+        expected = index + 1;
+
+        U64 bytes = step(context);
+
+        if (bytes == 0 || bytes == U64_MAX)
+            return dispatches;
+    }
+}
+
+void run_workload(const WORKLOAD* workload)
+{
+    MVM64_REGISTERS* context = create_context();
+    MVM64_IMAGE* image = create_image(workload->code, workload->code_size, 0);
+    MVM64_IMAGE* fused_image = create_image(workload->code, workload->code_size, IMAGE_FUSE);
+    INT64 expected;
+
+    assert(context && image && fused_image);
+
+    if (verify_image(fused_image, NULL) != MVM64_OK)
+        printf("%s: failed verification\n", workload->name);
+
+    U64 instructions = count_instructions(workload, context);
+    U64 dispatches = count_dispatches(workload, fused_image, context);
+
+    printf("%s: %llu instructions x %llu runs\n", workload->name, instructions, workload->runs);
+    printf("  superinstructions: %llu dispatches, %llu saved (%.1f%%)\n", dispatches,
+        instructions - dispatches, 100.0 * (double)(instructions - dispatches) / (double)instructions);
+
+    jit = create_jit(image);
+
+    for (size_t e = 0; e < NUM_ENGINES; e++)
+    {
+        INT64 retnval;
+
+        if (engines[e].engine == jit_engine && !jit)
+        {
+            printf("  %-26s unsupported on this host\n", engines[e].name);
+            continue;
+        }
+
+        double start = now();
+
+        for (U64 r = 0; r < workload->runs; r++)
+        {
+            reset(context, workload->arg);
+
+            if (engines[e].engine)
+                engines[e].engine(engines[e].fused ? fused_image : image, context, &retnval);
+            else
+                execute(workload->code, context, &retnval);
+        }
+
+        double elapsed = now() - start;
+
+        if (e == 0)
+            expected = retnval;
+
+        printf("  %-26s %10.2f M instructions/s%s\n", engines[e].name,
+            (double)(instructions * workload->runs) / elapsed / 1e6,
+            retnval.u == expected.u ? "" : " (MISMATCH)");
+    }
+
+    free_jit(jit);
+    free_image(fused_image);
+    free_image(image);
+    free_context(context);
+}
+
+#define SCALING_THREADS 1024
+#define SCALING_ARG 16000 // countdown from, about 48000 instructions per VM thread
+
+// runs many independent VM threads on schedulers with 1 to 2x the processors, doubling each time
+void run_scaling()
+{
+    MVM64_THREAD* threads = malloc(SCALING_THREADS * sizeof(MVM64_THREAD));
+    size_t processors = count_processors();
+    double base = 0.0;
+
+    assert(threads);
+
+    for (size_t s = 0; s < SCALING_THREADS; s++)
+    {
+        threads[s].context = create_context();
+        assert(threads[s].context);
+    }
+
+    WORKLOAD countdown = { "countdown", countdowncode, sizeof(countdowncode), SCALING_ARG, 1 };
+    U64 instructions = count_instructions(&countdown, threads[0].context) * SCALING_THREADS;
+
+    printf("scheduler: %d VM threads x %llu instructions, %llu processors\n", SCALING_THREADS,
+        instructions / SCALING_THREADS, (U64)processors);
+
+    for (size_t workers = 1; workers <= processors * 2; workers *= 2)
+    {
+        MVM64_SCHEDULER* scheduler = create_scheduler(workers, 1000);
+        U64 failures = 0;
+
+        assert(scheduler);
+
+        for (size_t s = 0; s < SCALING_THREADS; s++)
+        {
+            reset(threads[s].context, SCALING_ARG);
+            init_thread(&threads[s], threads[s].context, countdowncode);
+        }
+
+        double start = now();
+
+        schedule_threads(scheduler, threads, SCALING_THREADS);
+        wait_scheduler(scheduler);
+
+        double elapsed = now() - start;
+
+        free_scheduler(scheduler);
+
+        for (size_t s = 0; s < SCALING_THREADS; s++)
+            failures += threads[s].status != MVM64_OK;
+
+        double rate = (double)instructions / elapsed / 1e6;
+
+        if (workers == 1)
+            base = rate;
+
+        printf("  %3llu workers %10.2f M instructions/s, %.2fx%s\n", (U64)workers, rate, rate / base,
+            failures ? " (FAILED)" : "");
+    }
+
+    for (size_t s = 0; s < SCALING_THREADS; s++)
+        free_context(threads[s].context);
+
+    free(threads);
+}
+
+#define BATCH_RUNS 1000000
+
+// runs a workload over many arguments, with a context created and freed for every run, then taken
+// from and returned to a pool, and then as batches on 1 to 2x the processors in threads
+void run_batches(const WORKLOAD* workload)
+{
+    MVM64_BATCH_INPUT* inputs = calloc(BATCH_RUNS, sizeof(MVM64_BATCH_INPUT));
+    INT64* args = malloc(BATCH_RUNS * sizeof(INT64));
+    INT64* values = malloc(BATCH_RUNS * sizeof(INT64));
+    MVM64_IMAGE* image = create_image(workload->code, workload->code_size, IMAGE_FUSE);
+    size_t processors = count_processors();
+    INT64 retnval;
+
+    assert(inputs && args && values && image);
+
+    for (size_t s = 0; s < BATCH_RUNS; s++)
+    {
+        args[s].u = 1 + s % workload->arg;
+        inputs[s].stack = &args[s];
+        inputs[s].stack_size = 1;
+    }
+
+    printf("batch: %s over %d arguments\n", workload->name, BATCH_RUNS);
+
+    double start = now();
+
+    for (size_t s = 0; s < BATCH_RUNS; s++)
+    {
+        MVM64_REGISTERS* context = create_context();
+        push(args[s], context);
+        execute(workload->code, context, &retnval);
+        free_context(context);
+    }
+
+    double elapsed = now() - start;
+
+    printf("  %-26s %10.2f M runs/s\n", "context per run", BATCH_RUNS / elapsed / 1e6);
+
+    MVM64_CONTEXT_POOL* pool = create_context_pool(1);
+    assert(pool);
+
+    start = now();
+
+    for (size_t s = 0; s < BATCH_RUNS; s++)
+    {
+        MVM64_REGISTERS* context = acquire_context(pool);
+        push(args[s], context);
+        execute(workload->code, context, &retnval);
+        release_context(pool, context);
+    }
+
+    elapsed = now() - start;
+
+    free_context_pool(pool);
+
+    printf("  %-26s %10.2f M runs/s\n", "pooled context per run", BATCH_RUNS / elapsed / 1e6);
+
+    for (size_t threads = 1; threads <= processors * 2; threads *= 2)
+    {
+        start = now();
+        U64 failures = execute_batch(image, inputs, BATCH_RUNS, values, threads);
+        elapsed = now() - start;
+
+        printf("  execute_batch %3llu threads %10.2f M runs/s%s\n", (U64)threads,
+            BATCH_RUNS / elapsed / 1e6, failures ? " (FAILED)" : "");
+    }
+
+    free_image(image);
+    free(values);
+    free(args);
+    free(inputs);
+}
+
+#define FORK_RUNS 10000
+#define FORK_SETUP_RUNS 200 // setting up is far slower than forking
+#define FORK_MEMORY 0x1000000
+#define FORK_SETUP 0x400000 // bytes of memory written by the setup
+
+// stores to one guest address, dirtying a single page of memory
+U8 forktailcode[] = {
+    STORE | VALA_FLAG | VALB_FLAG | SMALL_FLAG, 0x40, 0x2A, // store 0x40, 0x2A
+    RET
+};
+
+// sets up a context with memory, filling part of it, then runs forktailcode
+// returns the context, with its memory attached
+MVM64_REGISTERS* run_fork_setup(const U8* setup)
+{
+    MVM64_REGISTERS* context = create_context();
+    MVM64_MEMORY* memory = create_memory(FORK_MEMORY);
+    INT64 retnval;
+
+    assert(context && memory);
+
+    attach_memory(context, memory);
+    write_memory(memory, 0, setup, FORK_SETUP);
+    execute(forktailcode, context, &retnval);
+
+    return context;
+}
+
+// runs a short tail after a setup that fills memory, with the setup repeated for every run, then
+// with every run forked from a snapshot of the set up context
+void run_forks()
+{
+    U8* setup = malloc(FORK_SETUP);
+    INT64 retnval;
+
+    assert(setup);
+
+    memset(setup, 0x5A, FORK_SETUP);
+
+    printf("fork: runs after writing %d KiB of %d KiB memory\n", FORK_SETUP / 1024, FORK_MEMORY / 1024);
+
+    double start = now();
+
+    for (size_t s = 0; s < FORK_SETUP_RUNS; s++)
+    {
+        MVM64_REGISTERS* context = run_fork_setup(setup);
+        MVM64_MEMORY* memory = CONTEXT_INFO(context)->memory;
+
+        free_context(context);
+        free_memory(memory);
+    }
+
+    double elapsed = now() - start;
+
+    printf("  %-26s %10.2f K runs/s\n", "setup per run", FORK_SETUP_RUNS / elapsed / 1e3);
+
+    MVM64_REGISTERS* source = run_fork_setup(setup);
+    MVM64_MEMORY* memory = CONTEXT_INFO(source)->memory;
+    U64 failures = 0;
+
+    start = now();
+
+    MVM64_SNAPSHOT* snapshot = snapshot_context(source);
+    assert(snapshot);
+
+    for (size_t s = 0; s < FORK_RUNS; s++)
+    {
+        MVM64_REGISTERS* context = fork_context(snapshot);
+
+        if (!context)
+        {
+            failures++;
+            continue;
+        }
+
+        execute(forktailcode, context, &retnval);
+        free_context(context);
+    }
+
+    elapsed = now() - start;
+
+    printf("  %-26s %10.2f K runs/s%s\n", "fork per run", FORK_RUNS / elapsed / 1e3,
+        failures ? " (FAILED)" : "");
+
+    free_snapshot(snapshot);
+    free_context(source);
+    free_memory(memory);
+    free(setup);
+}
+
+// returns bytes of memory resident for the process, or 0 if unknown
+U64 resident_bytes()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return 0;
+
+    return counters.WorkingSetSize;
+#else
+    U64 size, resident = 0;
+    FILE* statm = fopen("/proc/self/statm", "r");
+
+    if (!statm)
+        return 0;
+
+    if (fscanf(statm, "%llu %llu", &size, &resident) != 2)
+        resident = 0;
+
+    fclose(statm);
+
+    return resident * sysconf(_SC_PAGESIZE);
+#endif
+}
+
+#define IDLE_VMS 1000000
+
+// creates many VMs sharing one program, each with an argument pushed and left waiting to run, and
+// reports the memory each costs
+void run_footprint()
+{
+    MVM64_VM** vms = malloc(IDLE_VMS * sizeof(MVM64_VM*));
+    MVM64_PROGRAM* program = create_program(countdowncode, sizeof(countdowncode));
+    U64 footprint = 0, failures = 0;
+
+    assert(vms && program);
+
+    U64 before = resident_bytes();
+
+    for (size_t s = 0; s < IDLE_VMS; s++)
+    {
+        INT64 arg;
+        arg.u = 1 + s % 100;
+
+        vms[s] = create_vm(program);
+        assert(vms[s]);
+
+        push_vm(vms[s], arg);
+        footprint += vm_footprint(vms[s]);
+    }
+
+    U64 after = resident_bytes();
+
+    // wake a sample to check that idle VMs still run
+    for (size_t s = 0; s < IDLE_VMS; s += IDLE_VMS / 1000)
+    {
+        U64 bytes_executed = 0;
+        INT64 retnval;
+
+        if (run_vm(vms[s], U64_MAX, &bytes_executed, &retnval) != MVM64_OK)
+            failures++;
+    }
+
+    printf("footprint: %d idle VMs sharing a program\n", IDLE_VMS);
+    printf("  %-26s %10llu bytes/VM%s\n", "MVM64_VM and stack", footprint / IDLE_VMS,
+        failures ? " (FAILED)" : "");
+
+    if (before && after)
+        printf("  %-26s %10llu bytes/VM\n", "resident", (after - before) / IDLE_VMS);
+
+    for (size_t s = 0; s < IDLE_VMS; s++)
+        free_vm(vms[s]);
+
+    release_program(program);
+    free(vms);
+}
+
+int main(int argc, char* argv[])
+{
+    WORKLOAD workloads[] = {
+        { "countdown", countdowncode, sizeof(countdowncode), 10000000, 1 },
+        { "arith", arithcode, sizeof(arithcode), 5000000, 1 },
+        { "stack", stackcode, sizeof(stackcode), 5000000, 1 },
+        { "fibonacci", NULL, 0, 90, 200000 }
+    };
+
+    size_t num_workloads = sizeof(workloads) / sizeof(WORKLOAD);
+
+    if (argc < 2)
+    {
+        printf("Benchmark: No fibonacci binary given, skipping it\n");
+        num_workloads--;
+    }
+    else
+    {
+        FILE* bin;
+        fopen_s(&bin, argv[1], "rb");
+
+        if (!bin)
+        {
+            printf("Couldn't open %s.", argv[1]);
+            return -1;
+        }
+
+        workloads[num_workloads - 1].code = buffer;
+        workloads[num_workloads - 1].code_size = fread(buffer, sizeof(U8), sizeof(buffer), bin);
+
+        fclose(bin);
+    }
+
+    for (size_t s = 0; s < num_workloads; s++)
+        run_workload(&workloads[s]);
+
+    // the last workload is fibonacci if it was loaded
+    if (num_workloads == sizeof(workloads) / sizeof(WORKLOAD))
+        run_batches(&workloads[num_workloads - 1]);
+
+    run_scaling();
+
+    run_forks();
+
+    run_footprint();
+
+    return 0;
+}
@@ -0,0 +1,131 @@
+#include <stdlib.h>
+#include <malloc.h>
+#include "vm.h"
+#include "platform.h"
+
+// runs one decoded image over many inputs, each host thread reusing a single context for all the
+// runs it takes, so a run costs no allocation
+// runs are claimed in chunks from a shared counter, so threads that draw short runs take more
+
+#define BATCH_CHUNK 64 // runs claimed at a time
+
+typedef struct
+{
+	const MVM64_IMAGE* image;
+	const MVM64_BATCH_INPUT* inputs;
+	size_t num_inputs;
+	INT64* return_values;
+
+	HOST_LOCK lock; // guards the fields below
+	size_t next_input;
+	U64 failures;
+} BATCH;
+
+// sets a context to the state of an input, with its stack values pushed in order
+// returns 0 if they don't fit on the stack
+static int load_input(MVM64_REGISTERS* context, const MVM64_BATCH_INPUT* input)
+{
+	if (input->stack_size > CONTEXT_INFO(context)->stack_size)
+		return 0;
+
+	reset_context(context);
+
+	INT64 stack = context->s.Z;
+
+	*context = input->registers;
+	context->s.S = stack;
+	context->s.Z = stack;
+
+	for (size_t s = 0; s < input->stack_size; s++)
+		push(input->stack[s], context);
+
+	return 1;
+}
+
+static void run_batch(BATCH* batch)
+{
+	MVM64_REGISTERS* context = create_context();
+	U64 failures = 0;
+
+	while (1)
+	{
+		lock_acquire(&batch->lock);
+
+		// a thread that couldn't allocate a context fails the runs it takes
+		size_t first = batch->next_input;
+		size_t last = first + BATCH_CHUNK < batch->num_inputs ? first + BATCH_CHUNK : batch->num_inputs;
+		batch->next_input = last;
+
+		lock_release(&batch->lock);
+
+		if (first == last)
+			break;
+
+		for (size_t s = first; s < last; s++)
+		{
+			if (!context || !load_input(context, &batch->inputs[s]) ||
+				!execute_threaded(batch->image, context, &batch->return_values[s]))
+			{
+				batch->return_values[s].u = 0;
+				failures++;
+			}
+		}
+	}
+
+	lock_acquire(&batch->lock);
+	batch->failures += failures;
+	lock_release(&batch->lock);
+
+	free_context(context);
+}
+
+HOST_THREAD_ENTRY(batch_thread, run_batch, BATCH)
+
+// executes an image once for each input, storing the return value of each run in the matching
+// element of return_values
+// runs are spread over num_threads host threads, counting the calling thread, or one per
+// processor if 0
+// returns number of runs that failed, whose return values are 0
+U64 execute_batch(const MVM64_IMAGE* image, const MVM64_BATCH_INPUT* inputs, size_t num_inputs,
+	INT64* return_values, size_t num_threads)
+{
+	BATCH batch;
+	HOST_THREAD* threads = NULL;
+	size_t started = 0;
+
+	batch.image = image;
+	batch.inputs = inputs;
+	batch.num_inputs = num_inputs;
+	batch.return_values = return_values;
+	batch.next_input = 0;
+	batch.failures = 0;
+
+	if (num_threads == 0)
+		num_threads = count_processors();
+
+	// no more threads than there are chunks to go round
+	if (num_threads > (num_inputs + BATCH_CHUNK - 1) / BATCH_CHUNK)
+		num_threads = (num_inputs + BATCH_CHUNK - 1) / BATCH_CHUNK;
+
+	lock_init(&batch.lock);
+
+	if (num_threads > 1)
+		threads = malloc((num_threads - 1) * sizeof(HOST_THREAD));
+
+	// if threads can't be started, the calling thread takes their share
+	for (; threads && started < num_threads - 1; started++)
+	{
+		if (!thread_start(&threads[started], batch_thread, &batch))
+			break;
+	}
+
+	run_batch(&batch);
+
+	for (size_t s = 0; s < started; s++)
+		thread_join(threads[s]);
+
+	free(threads);
+	lock_free(&batch.lock);
+
+	return batch.failures;
+}
@@ -0,0 +1,381 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vm.h"
+#include "pages.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// checkpoints, for suspending a context to a file or stream and resuming it in another process
+// a checkpoint is laid out as
+// [CHECKPOINT_HEADER][stack values, from the bottom][zeros][guest memory image]
+// in the host's byte order, which is little endian on every host the VM runs on
+// the memory image starts at a multiple of CHECKPOINT_ALIGN from the start of the checkpoint, so
+// a checkpoint read from the start of a file has its memory mapped copy-on-write rather than read,
+// and pages of it are only read in as they're touched
+// pages of memory that are all zero are skipped over rather than written where the stream can
+// seek, leaving holes in the file
+
+#define CHECKPOINT_MAGIC "MVM64CKP"
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_ALIGN 0x10000 // covers the page size, and the allocation granularity of Windows
+
+// I is a guest address in memory rather than an offset into the code
+#define CHECKPOINT_CODE_IN_MEMORY (1<<0)
+
+// 64-bit file positions
+#ifdef _WIN32
+#define file_tell _ftelli64
+#define file_seek _fseeki64
+#else
+#define file_tell ftello
+#define file_seek fseeko
+#endif
+
+typedef struct
+{
+	char magic[8]; // CHECKPOINT_MAGIC
+	U32 version; // CHECKPOINT_VERSION
+	U32 header_size; // in bytes, later versions may extend the header
+	U64 code_hash; // of the code the context runs, see hash_code()
+	U64 code_size; // in bytes
+	U64 flags; // CHECKPOINT_* flags
+	MVM64_REGISTERS registers; // I as an offset into the code, S and Z as offsets from the stack base
+	U64 stack_size; // of the context, in INT64
+	U64 context_flags; // CONTEXT_GUARDED and CONTEXT_GROW of the context
+	U64 depth; // number of stack values following the header
+	U64 memory_size; // in bytes, or 0 if the context has no memory
+	U64 memory_offset; // from the start of the checkpoint, a multiple of CHECKPOINT_ALIGN
+} CHECKPOINT_HEADER;
+
+// 64-bit FNV-1a hash of code, which a checkpoint may only be resumed on
+static U64 hash_code(const void* code, size_t code_size)
+{
+	U64 hash = 0xCBF29CE484222325;
+
+	for (size_t s = 0; s < code_size; s++)
+	{
+		hash ^= ((const U8*)code)[s];
+		hash *= 0x100000001B3;
+	}
+
+	return hash;
+}
+
+// writes size zero bytes, seeking over them if the stream allows
+// returns 0 on failure
+static int write_zeros(FILE* file, U64 size)
+{
+	static const U8 zeros[MEMORY_PAGE];
+
+	if (file_seek(file, (I64)size, SEEK_CUR) == 0)
+		return 1;
+
+	while (size)
+	{
+		size_t chunk = size < sizeof(zeros) ? (size_t)size : sizeof(zeros);
+
+		if (fwrite(zeros, 1, chunk, file) != chunk)
+			return 0;
+
+		size -= chunk;
+	}
+
+	return 1;
+}
+
+// reads and discards size bytes
+// returns 0 if the stream ends first
+static int skip_bytes(FILE* file, U64 size)
+{
+	U8 buffer[MEMORY_PAGE];
+
+	while (size)
+	{
+		size_t chunk = size < sizeof(buffer) ? (size_t)size : sizeof(buffer);
+
+		if (fread(buffer, 1, chunk, file) != chunk)
+			return 0;
+
+		size -= chunk;
+	}
+
+	return 1;
+}
+
+// writes a checkpoint of a context running code at the current position of file
+// I must be within the code, or within the context's guest memory
+// registers other than S, Z and I are written as they are, so any that hold host addresses
+// aren't valid once resumed
+// returns 0 on failure
+int write_checkpoint(FILE* file, const MVM64_REGISTERS* context, const void* code, size_t code_size)
+{
+	const MVM64_CONTEXT_INFO* info = CONTEXT_INFO(context);
+	const MVM64_MEMORY* memory = info->memory;
+	CHECKPOINT_HEADER header;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+	header.version = CHECKPOINT_VERSION;
+	header.header_size = sizeof(header);
+	header.code_hash = hash_code(code, code_size);
+	header.code_size = code_size;
+	header.registers = *context;
+	header.stack_size = info->stack_size;
+	header.context_flags = info->flags & (CONTEXT_GUARDED | CONTEXT_GROW);
+	header.depth = (context->s.S.u - info->stack_base) / sizeof(INT64);
+
+	if (context->s.S.u < info->stack_base || header.depth > info->stack_size)
+		return 0;
+
+	header.registers.s.S.u = header.depth * sizeof(INT64);
+	header.registers.s.Z.u = 0;
+
+	if (context->s.I.u - (U64)code < code_size)
+		header.registers.s.I.u -= (U64)code;
+	else if (memory && context->s.I.u - (U64)memory->base < memory->size)
+	{
+		header.registers.s.I.u -= (U64)memory->base;
+		header.flags |= CHECKPOINT_CODE_IN_MEMORY;
+	}
+	else
+		return 0;
+
+	U64 written = sizeof(header) + header.depth * sizeof(INT64);
+
+	if (memory)
+	{
+		header.memory_size = memory->size;
+		header.memory_offset = (written + CHECKPOINT_ALIGN - 1) / CHECKPOINT_ALIGN * CHECKPOINT_ALIGN;
+	}
+
+	if (fwrite(&header, sizeof(header), 1, file) != 1)
+		return 0;
+
+	if (header.depth &&
+		fwrite((void*)(info->stack_base + sizeof(INT64)), sizeof(INT64), (size_t)header.depth, file) != header.depth)
+		return 0;
+
+	if (!memory)
+		return fflush(file) == 0;
+
+	if (!write_zeros(file, header.memory_offset - written))
+		return 0;
+
+	// the last page is always written, so a file ends after the memory even if it's zero
+	for (U64 offset = 0; offset < memory->mapping_size; offset += MEMORY_PAGE)
+	{
+		size_t size = (size_t)(memory->mapping_size - offset < MEMORY_PAGE ? memory->mapping_size - offset : MEMORY_PAGE);
+
+		if (offset + size < memory->mapping_size && zero_page(memory->base + offset, size))
+		{
+			if (!write_zeros(file, size))
+				return 0;
+		}
+		else if (fwrite(memory->base + offset, 1, size, file) != size)
+			return 0;
+	}
+
+	return fflush(file) == 0;
+}
+
+// maps memory_size bytes of guest memory at offset in file copy-on-write
+// returns NULL if the file can't be mapped, such as when it's a pipe
+static MVM64_MEMORY* map_checkpoint_memory(FILE* file, U64 offset, U64 memory_size)
+{
+	U64 mapping_size = memory_size + MEMORY_SLACK;
+	MVM64_MEMORY* memory = calloc(1, sizeof(MVM64_MEMORY));
+
+	if (!memory)
+		return NULL;
+
+#ifdef _WIN32
+	HANDLE handle = (HANDLE)_get_osfhandle(_fileno(file));
+	LARGE_INTEGER file_size;
+
+	if (handle == INVALID_HANDLE_VALUE || GetFileType(handle) != FILE_TYPE_DISK ||
+		!GetFileSizeEx(handle, &file_size) || (U64)file_size.QuadPart < offset + mapping_size)
+	{
+		free(memory);
+		return NULL;
+	}
+
+	HANDLE section = CreateFileMapping(handle, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+
+	if (section)
+	{
+		memory->base = MapViewOfFile(section, FILE_MAP_COPY, (DWORD)(offset >> 32), (DWORD)offset,
+			(SIZE_T)mapping_size);
+
+		// the view keeps the section open
+		CloseHandle(section);
+	}
+#else
+	struct stat status;
+
+	if (fstat(fileno(file), &status) || !S_ISREG(status.st_mode) ||
+		(U64)status.st_size < offset + mapping_size || offset % (U64)sysconf(_SC_PAGESIZE))
+	{
+		free(memory);
+		return NULL;
+	}
+
+	memory->base = mmap(NULL, (size_t)mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(file),
+		(off_t)offset);
+
+	if (memory->base == MAP_FAILED)
+		memory->base = NULL;
+#endif
+
+	if (!memory->base)
+	{
+		free(memory);
+		return NULL;
+	}
+
+	memory->size = memory_size;
+	memory->mask = memory_size - 1;
+	memory->mapping_size = mapping_size;
+	memory->flags = MEMORY_VIEW;
+
+	return memory;
+}
+
+// reads guest memory of memory_size bytes from the stream, copying only pages that aren't zero
+// returns NULL on failure
+static MVM64_MEMORY* read_checkpoint_memory(FILE* file, U64 memory_size)
+{
+	MVM64_MEMORY* memory = create_memory(memory_size);
+	U8 page[MEMORY_PAGE];
+
+	if (!memory || memory->size != memory_size)
+	{
+		free_memory(memory);
+		return NULL;
+	}
+
+	for (U64 offset = 0; offset < memory->mapping_size; offset += MEMORY_PAGE)
+	{
+		size_t size = (size_t)(memory->mapping_size - offset < MEMORY_PAGE ? memory->mapping_size - offset : MEMORY_PAGE);
+
+		if (fread(page, 1, size, file) != size)
+		{
+			free_memory(memory);
+			return NULL;
+		}
+
+		if (!zero_page(page, size))
+			memcpy(memory->base + offset, page, size);
+	}
+
+	return memory;
+}
+
+typedef struct
+{
+	MVM64_REGISTERS* context;
+	const INT64* values;
+	U64 depth;
+} STACK_LOAD;
+
+// pushes the stack of a checkpoint, under call_guarded() so a growing stack commits its pages
+static void load_stack(void* argument)
+{
+	STACK_LOAD* load = argument;
+
+	memcpy((void*)(load->context->s.Z.u + sizeof(INT64)), load->values, (size_t)load->depth * sizeof(INT64));
+	load->context->s.S.u += load->depth * sizeof(INT64);
+}
+
+// reads a checkpoint from the current position of file into a new context, with I moved into
+// code, which must be the code the checkpoint was written on
+// guest memory is mapped from the file where it can be, so the file must not change while the
+// context lives, and is owned by the context
+// the file is left positioned after the checkpoint
+// returns NULL on failure, or if the checkpoint is for other code or a later version
+MVM64_REGISTERS* read_checkpoint(FILE* file, const void* code, size_t code_size)
+{
+	CHECKPOINT_HEADER header;
+	I64 start = file_tell(file);
+
+	if (fread(&header, sizeof(header), 1, file) != 1 ||
+		memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) ||
+		header.version != CHECKPOINT_VERSION || header.header_size < sizeof(header) ||
+		!skip_bytes(file, header.header_size - sizeof(header)))
+		return NULL;
+
+	U64 read = header.header_size + header.depth * sizeof(INT64);
+
+	if (header.code_size != code_size || header.code_hash != hash_code(code, code_size) ||
+		header.depth > header.stack_size || header.stack_size > (U64)-1 / sizeof(INT64) / 2 ||
+		(header.memory_size & (header.memory_size - 1)) || header.memory_size > (U64)-1 / 2 ||
+		(header.memory_size && header.memory_size < MEMORY_MIN_SIZE) ||
+		(header.memory_size && (header.memory_offset < read || header.memory_offset % CHECKPOINT_ALIGN)) ||
+		(header.flags & CHECKPOINT_CODE_IN_MEMORY ? header.registers.s.I.u >= header.memory_size :
+			header.registers.s.I.u >= code_size))
+		return NULL;
+
+	MVM64_REGISTERS* context = create_context_stack((size_t)header.stack_size, header.context_flags);
+	INT64* values = malloc(header.depth ? (size_t)header.depth * sizeof(INT64) : 1);
+	MVM64_MEMORY* memory = NULL;
+	STACK_LOAD load;
+
+	if (!context || !values ||
+		fread(values, sizeof(INT64), (size_t)header.depth, file) != header.depth)
+		goto fail;
+
+	*context = header.registers;
+	context->s.S.u = CONTEXT_INFO(context)->stack_base;
+	context->s.Z.u = CONTEXT_INFO(context)->stack_base;
+
+	load.context = context;
+	load.values = values;
+	load.depth = header.depth;
+
+	if (call_guarded(context, load_stack, &load) != MVM64_OK)
+		goto fail;
+
+	if (header.memory_size)
+	{
+		U64 end = header.memory_offset + header.memory_size + MEMORY_SLACK;
+
+		if (start >= 0)
+			memory = map_checkpoint_memory(file, (U64)start + header.memory_offset, header.memory_size);
+
+		if (memory)
+		{
+			if (file_seek(file, start + (I64)end, SEEK_SET))
+				goto fail;
+		}
+		else if (!skip_bytes(file, header.memory_offset - read) ||
+			!(memory = read_checkpoint_memory(file, header.memory_size)))
+			goto fail;
+
+		attach_memory(context, memory);
+		CONTEXT_INFO(context)->flags |= CONTEXT_OWN_MEMORY;
+	}
+
+	if (header.flags & CHECKPOINT_CODE_IN_MEMORY)
+		context->s.I.u += (U64)memory->base;
+	else
+		context->s.I.u += (U64)code;
+
+	free(values);
+
+	return context;
+
+fail:
+	// memory is only attached once nothing else can fail
+	free(values);
+	free_context(context);
+	free_memory(memory);
+
+	return NULL;
+}
@@ -0,0 +1,544 @@
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <assert.h>
+#include "vm.h"
+
+// decodes an operand of the extended form at *pos into a register index or value, advancing
+// *pos past it
+// returns 0 if the operand is truncated or an invalid register
+static int decode_operand(const U8* code, size_t code_size, U8 form, U64* pos, U8* reg, INT64* val)
+{
+	if (*pos + FORM_SIZES[form] > code_size)
+		return 0;
+
+	const U8* operand = code + *pos;
+
+	*pos += FORM_SIZES[form];
+
+	if (form == FORM_REGISTER)
+	{
+		if (*operand >= NUM_REGISTERS)
+			return 0;
+
+		*reg = *operand;
+		return 1;
+	}
+
+	switch (form)
+	{
+	case FORM_U8:
+		val->u = *operand;
+		break;
+
+	case FORM_I8:
+		val->i = (I8)*operand;
+		break;
+
+	case FORM_U16:
+		val->u = *(const U16*)operand;
+		break;
+
+	case FORM_I16:
+		val->i = *(const I16*)operand;
+		break;
+
+	case FORM_U32:
+		val->u = *(const U32*)operand;
+		break;
+
+	case FORM_I32:
+		val->i = *(const I32*)operand;
+		break;
+
+	default:
+		memcpy(val, operand, sizeof(INT64));
+		break;
+	}
+
+	return 1;
+}
+
+// decodes the instruction at offset using the same rules as exec_instruction
+// returns 0 if the instruction is truncated or otherwise cannot be executed
+static int decode_instruction(const U8* code, size_t code_size, U64 offset, MVM64_DECODED* d)
+{
+	U8 ins = code[offset];
+	size_t num_ops = operand_count(INSTRUCTION_BASE(ins));
+	U64 pos = offset + sizeof(ins);
+
+	d->op = INSTRUCTION_BASE(ins);
+	d->handler = d->op;
+	d->fused = 1;
+	d->flags = 0;
+	d->reg_a = NUM_REGISTERS;
+	d->reg_b = NUM_REGISTERS;
+	d->size = sizeof(ins);
+	d->val_a.u = 0;
+	d->val_b.u = 0;
+	d->offset = offset;
+	d->next = U64_MAX;
+	d->target = U64_MAX;
+
+	if (d->op == RET)
+		return 1;
+
+	if (d->op >= NUM_INSTRUCTIONS)
+		return 0;
+
+	if (INSTRUCTION_EXTENDED(ins) && num_ops > 0)
+	{
+		if (pos + sizeof(U8) > code_size || (code[pos] & FORM_RESERVED) ||
+			(num_ops < 2 && FORM_B(code[pos]) != FORM_REGISTER))
+			return 0;
+
+		U8 form = code[pos];
+
+		pos += sizeof(form);
+
+		// LADR of an inline value narrower than 64-bit has no meaningful address
+		if (d->op == LADR && FORM_B(form) != FORM_REGISTER && FORM_B(form) != FORM_64)
+			return 0;
+
+		if (!decode_operand(code, code_size, FORM_A(form), &pos, &d->reg_a, &d->val_a))
+			return 0;
+
+		if (num_ops > 1 && !decode_operand(code, code_size, FORM_B(form), &pos, &d->reg_b, &d->val_b))
+			return 0;
+
+		// LADR of a 64-bit value loads the address of the value within the code
+		if (d->op == LADR && FORM_B(form) == FORM_64)
+			d->val_b.u = (U64)(code + pos - sizeof(INT64));
+	}
+	else
+	{
+		if (INSTRUCTION_VALA(ins))
+		{
+			if (INSTRUCTION_SMALL(ins))
+			{
+				if (pos + sizeof(U8) > code_size)
+					return 0;
+
+				// 8-bit jump displacements are signed (see exec_instruction())
+				if (d->op == JMP || d->op == JZR)
+					d->val_a.i = (I8)code[pos];
+				else
+					d->val_a.u = code[pos];
+
+				pos += sizeof(U8);
+			}
+			else
+			{
+				if (pos + sizeof(INT64) > code_size)
+					return 0;
+
+				memcpy(&d->val_a, code + pos, sizeof(INT64));
+				pos += sizeof(INT64);
+			}
+		}
+		else if (num_ops > 0)
+		{
+			if (pos + sizeof(U8) > code_size || code[pos] >= NUM_REGISTERS)
+				return 0;
+
+			d->reg_a = code[pos];
+			pos += sizeof(U8);
+		}
+
+		if (INSTRUCTION_VALB(ins))
+		{
+			if (INSTRUCTION_SMALL(ins))
+			{
+				// LADR of an inline 8-bit value has no meaningful address
+				if (pos + sizeof(U8) > code_size || d->op == LADR)
+					return 0;
+
+				d->val_b.u = code[pos];
+				pos += sizeof(U8);
+			}
+			else
+			{
+				if (pos + sizeof(INT64) > code_size)
+					return 0;
+
+				// LADR of a 64-bit value loads the address of the value within the code
+				if (d->op == LADR)
+					d->val_b.u = (U64)(code + pos);
+				else
+					memcpy(&d->val_b, code + pos, sizeof(INT64));
+
+				pos += sizeof(INT64);
+			}
+		}
+		else if (num_ops > 1)
+		{
+			if (pos + sizeof(U8) > code_size || code[pos] >= NUM_REGISTERS)
+				return 0;
+
+			d->reg_b = code[pos];
+			pos += sizeof(U8);
+		}
+	}
+
+	d->size = (U8)(pos - offset);
+
+	// loads may read I through its address
+	if (d->reg_a == REGISTER_I || d->reg_b == REGISTER_I || d->op == DREF || d->op == LOADB)
+		d->flags |= DECODED_SYNC_I;
+
+	if (d->reg_a == REGISTER_I && writes_operand_a(d->op))
+		d->flags |= DECODED_WRITES_I;
+
+	return 1;
+}
+
+// adds an offset to the decode worklist if it is within the code and not yet seen
+static __inline void enqueue_offset(U64 offset, size_t code_size, U8* seen,
+	U64* worklist, size_t* worklist_size)
+{
+	if (offset >= code_size || seen[offset])
+		return;
+
+	seen[offset] = 1;
+	worklist[(*worklist_size)++] = offset;
+}
+
+// decodes every instruction reachable from the worklist, adding successors as they are found
+// returns nonzero if control flow depends on run-time values (register jumps or writes to I)
+static int trace_code(const U8* code, size_t code_size, U8* seen, U64* worklist,
+	size_t* worklist_size)
+{
+	int dynamic = 0;
+
+	while (*worklist_size)
+	{
+		MVM64_DECODED d;
+		U64 offset = worklist[--(*worklist_size)];
+
+		if (!decode_instruction(code, code_size, offset, &d) || d.op == RET)
+			continue;
+
+		if (d.flags & DECODED_WRITES_I)
+			dynamic = 1;
+
+		if (d.op == JMP || d.op == JZR)
+		{
+			if (d.reg_a < NUM_REGISTERS)
+				dynamic = 1;
+			else
+				enqueue_offset(offset + d.val_a.u, code_size, seen, worklist, worklist_size);
+
+			if (d.op == JMP)
+				continue;
+		}
+
+		enqueue_offset(offset + d.size, code_size, seen, worklist, worklist_size);
+	}
+
+	return dynamic;
+}
+
+// returns nonzero if instruction i falls through to instruction i + 1 and both can be run by a
+// single handler: neither may need I synchronised, and both must be valid
+static __inline int can_fuse(const MVM64_IMAGE* image, U64 i)
+{
+	const MVM64_DECODED* d = &image->instructions[i];
+
+	return i + 2 < image->num_instructions && d->next == i + 1 &&
+		d->op < NUM_INSTRUCTIONS && d[1].op < NUM_INSTRUCTIONS &&
+		!d->flags && !d[1].flags;
+}
+
+// returns nonzero if instruction i is a jump with a target known when decoded
+static __inline int is_static_jump(const MVM64_IMAGE* image, U64 i, U8 op)
+{
+	return image->instructions[i].op == op && image->instructions[i].reg_a == NUM_REGISTERS;
+}
+
+// replaces the handlers of common instruction sequences with superinstructions
+// each sequence stays decoded in full, so jumping into the middle of one still runs correctly
+static void fuse_instructions(MVM64_IMAGE* image)
+{
+	for (U64 i = 0; i + 1 < image->num_instructions; i++)
+	{
+		MVM64_DECODED* d = &image->instructions[i];
+		U64 jzr = i;
+
+		if (d->op == MOV && d->reg_a < NUM_REGISTERS && can_fuse(image, i) &&
+			d[1].op == XOR && d[1].reg_a == d->reg_a && can_fuse(image, i + 1) &&
+			is_static_jump(image, i + 2, JZR))
+		{
+			d->handler = FUSED_MOV_XOR_JZR;
+			jzr = i + 2;
+		}
+		else if ((d->op == SUB || d->op == XOR) && d->reg_a < NUM_REGISTERS &&
+			can_fuse(image, i) && is_static_jump(image, i + 1, JZR))
+		{
+			d->handler = d->op == SUB ? FUSED_SUB_JZR : FUSED_XOR_JZR;
+			jzr = i + 1;
+		}
+		else if (!is_static_jump(image, i, JZR))
+		{
+			continue;
+		}
+
+		d->fused = (U8)(jzr - i + 1);
+
+		// a following JMP becomes the not-taken path of the branch
+		if (can_fuse(image, jzr) && is_static_jump(image, jzr + 1, JMP))
+		{
+			switch (d->handler)
+			{
+			case JZR:
+				d->handler = FUSED_JZR_JMP;
+				break;
+			case FUSED_SUB_JZR:
+				d->handler = FUSED_SUB_JZR_JMP;
+				break;
+			case FUSED_XOR_JZR:
+				d->handler = FUSED_XOR_JZR_JMP;
+				break;
+			case FUSED_MOV_XOR_JZR:
+				d->handler = FUSED_MOV_XOR_JZR_JMP;
+				break;
+			}
+
+			d->fused++;
+		}
+	}
+}
+
+// decodes a code image into fixed-width instructions, forming superinstructions if flags has
+// IMAGE_FUSE
+// code must remain valid and unmodified for the lifetime of the image
+// returns NULL on allocation failure
+MVM64_IMAGE* create_image(const void* code, size_t code_size, U64 flags)
+{
+	if (code == NULL)
+		return NULL;
+
+	const U8* bytes = (const U8*)code;
+	MVM64_IMAGE* image = calloc(1, sizeof(MVM64_IMAGE));
+	U8* seen = calloc(code_size + 1, sizeof(U8));
+	U64* worklist = malloc((code_size + 1) * sizeof(U64));
+
+	if (!image || !seen || !worklist)
+		goto FAIL;
+
+	image->code = bytes;
+	image->code_size = code_size;
+	image->index = malloc((code_size + 1) * sizeof(U64));
+
+	if (!image->index)
+		goto FAIL;
+
+	// find instruction boundaries by following control flow from the entry point
+	size_t worklist_size = 0;
+	enqueue_offset(0, code_size, seen, worklist, &worklist_size);
+
+	if (trace_code(bytes, code_size, seen, worklist, &worklist_size))
+	{
+		// jump targets are only known at run time, so also decode every boundary
+		// found by a linear sweep of the code
+		MVM64_DECODED d;
+
+		for (U64 offset = 0; offset < code_size; offset += d.size)
+		{
+			enqueue_offset(offset, code_size, seen, worklist, &worklist_size);
+
+			if (!decode_instruction(bytes, code_size, offset, &d))
+				break;
+		}
+
+		trace_code(bytes, code_size, seen, worklist, &worklist_size);
+	}
+
+	// assign instruction indices in code order
+	size_t count = 0;
+
+	for (U64 offset = 0; offset <= code_size; offset++)
+		image->index[offset] = seen[offset] ? count++ : U64_MAX;
+
+	image->num_instructions = count + 1;
+	image->instructions = malloc(image->num_instructions * sizeof(MVM64_DECODED));
+
+	if (!image->instructions)
+		goto FAIL;
+
+	MVM64_DECODED* sentinel = &image->instructions[count];
+	memset(sentinel, 0, sizeof(MVM64_DECODED));
+	sentinel->op = DECODED_INVALID;
+	sentinel->handler = DECODED_INVALID;
+	sentinel->fused = 1;
+	sentinel->reg_a = NUM_REGISTERS;
+	sentinel->reg_b = NUM_REGISTERS;
+	sentinel->offset = code_size;
+	sentinel->next = count;
+	sentinel->target = count;
+
+	for (U64 offset = 0; offset < code_size; offset++)
+	{
+		if (image->index[offset] == U64_MAX)
+			continue;
+
+		MVM64_DECODED* d = &image->instructions[image->index[offset]];
+
+		if (!decode_instruction(bytes, code_size, offset, d))
+		{
+			d->op = DECODED_INVALID;
+			d->handler = DECODED_INVALID;
+		}
+
+		d->next = count;
+		d->target = count;
+
+		if (offset + d->size < code_size && image->index[offset + d->size] != U64_MAX)
+			d->next = image->index[offset + d->size];
+
+		if ((d->op == JMP || d->op == JZR) && d->reg_a == NUM_REGISTERS)
+		{
+			U64 target = offset + d->val_a.u;
+
+			if (target < code_size && image->index[target] != U64_MAX)
+				d->target = image->index[target];
+		}
+	}
+
+	if (flags & IMAGE_FUSE)
+		fuse_instructions(image);
+
+	free(seen);
+	free(worklist);
+
+	return image;
+
+FAIL:
+	free(seen);
+	free(worklist);
+	free_image(image);
+
+	return NULL;
+}
+
+void free_image(MVM64_IMAGE* image)
+{
+	if (image == NULL)
+		return;
+
+	free(image->instructions);
+	free(image->index);
+	free(image);
+}
+
+// checks once that the code can run without the static checks of sandboxed execution
+// every instruction reachable from the entry point must decode by the rules of exec_instruction,
+// every jump must land on the start of an instruction that no other instruction overlaps, DREF
+// and LADR may not have 8-bit operands, and no path may run past the end of the code without
+// reaching RET
+// jumps by register and writes to I can't be followed ahead of time, so are rejected
+// sets IMAGE_VERIFIED on success, otherwise returns the error and sets *error_offset to the
+// offset of the instruction at fault if it is not NULL
+MVM64_STATUS verify_image(MVM64_IMAGE* image, U64* error_offset)
+{
+	U64 count = image->num_instructions - 1;
+
+	image->flags &= ~IMAGE_VERIFIED;
+
+	if (count == 0)
+	{
+		if (error_offset)
+			*error_offset = 0;
+
+		return MVM64_ERROR_CODE_BOUNDS;
+	}
+
+	for (U64 i = 0; i < count; i++)
+	{
+		const MVM64_DECODED* d = &image->instructions[i];
+		MVM64_STATUS status = check_instruction(image->code, image->code_size, d->offset);
+
+		// DREF and LADR values must be 64-bit
+		if (status == MVM64_OK && (d->op == DREF || d->op == LADR) && d->reg_b == NUM_REGISTERS &&
+			(INSTRUCTION_EXTENDED(image->code[d->offset]) ?
+			FORM_B(image->code[d->offset + 1]) != FORM_64 : INSTRUCTION_SMALL(image->code[d->offset])))
+			status = MVM64_ERROR_INSTRUCTION;
+
+		// an instruction must not start within another
+		for (U64 offset = d->offset + 1; status == MVM64_OK && offset < d->offset + d->size; offset++)
+		{
+			if (image->index[offset] != U64_MAX)
+				status = MVM64_ERROR_CODE_BOUNDS;
+		}
+
+		if (status == MVM64_OK && (d->flags & DECODED_WRITES_I))
+			status = MVM64_ERROR_CODE_BOUNDS;
+
+		if (status == MVM64_OK && (d->op == JMP || d->op == JZR) &&
+			(d->reg_a < NUM_REGISTERS || d->target == count))
+			status = MVM64_ERROR_CODE_BOUNDS;
+
+		if (status == MVM64_OK && d->op != JMP && d->op != RET && d->next == count)
+			status = MVM64_ERROR_CODE_BOUNDS;
+
+		if (status != MVM64_OK)
+		{
+			if (error_offset)
+				*error_offset = d->offset;
+
+			return status;
+		}
+	}
+
+	image->flags |= IMAGE_VERIFIED;
+
+	return MVM64_OK;
+}
+
+// runs the code of an image within the limits of sandbox, as execute_sandboxed()
+// the static checks are skipped if the image has been verified
+U64 execute_image_sandboxed(const MVM64_IMAGE* image, MVM64_REGISTERS* context,
+	MVM64_SANDBOX* sandbox, INT64* return_value)
+{
+	U64 flags = sandbox->flags;
+
+	if (image->flags & IMAGE_VERIFIED)
+		sandbox->flags |= SANDBOX_VERIFIED;
+
+	U64 bytes_executed = execute_sandboxed(image->code, image->code_size, context, sandbox, return_value);
+
+	sandbox->flags = flags;
+
+	return bytes_executed;
+}
+
+// finds the decoded instruction at a code offset, or the sentinel if there is none
+static __inline const MVM64_DECODED* lookup_instruction(const MVM64_IMAGE* image, U64 offset)
+{
+	if (offset >= image->code_size || image->index[offset] == U64_MAX)
+		return &image->instructions[image->num_instructions - 1];
+
+	return &image->instructions[image->index[offset]];
+}
+
+// decoded-image engines, sharing one body in engine.inc
+// labels-as-values are a GCC/Clang extension, other compilers fall back to switch dispatch
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(MVM64_NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO 1
+#else
+#define COMPUTED_GOTO 0
+#endif
+
+// executes a decoded image, producing the same results as execute() on the same code
+// returns number of bytes executed, or 0 on error
+#define ENGINE_NAME execute_image
+#define ENGINE_THREADED 0
+#include "engine.inc"
+#undef ENGINE_NAME
+#undef ENGINE_THREADED
+
+// as execute_image(), but each handler dispatches directly to the next (threaded code)
+#define ENGINE_NAME execute_threaded
+#define ENGINE_THREADED COMPUTED_GOTO
+#include "engine.inc"
+#undef ENGINE_NAME
+#undef ENGINE_THREADED
@@ -0,0 +1,814 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <malloc.h>
+#include "vm.h"
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define JIT_SUPPORTED 1
+#else
+#define JIT_SUPPORTED 0
+#endif
+
+#if JIT_SUPPORTED
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+// x86-64 general purpose registers
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RSP 4
+#define RBP 5
+#define RSI 6
+#define RDI 7
+#define R8  8
+#define R9  9
+#define R10 10
+#define R11 11
+#define R12 12
+#define R13 13
+#define R14 14
+#define R15 15
+
+#define CONTEXT_REG RDI // holds the MVM64_REGISTERS* for the duration of a run
+#define BYTES_REG RBP // holds the number of bytes executed
+#define IN_MEMORY 0xFF // MVM64 register is kept in the context rather than a host register
+
+// host register for each MVM64 register
+// A-H, R and S live in host registers, while Z, I and L are accessed through the context
+static const U8 HOST_REGISTERS[NUM_REGISTERS] = {
+	R8, // A
+	R9, // B
+	R10, // C
+	R11, // D
+	R12, // E
+	R13, // F
+	R14, // G
+	RBX, // H
+	RSI, // R
+	R15, // S
+	IN_MEMORY, // Z
+	IN_MEMORY, // I
+	IN_MEMORY // L
+};
+
+#define HOST_R RSI
+#define HOST_S R15
+
+// ModRM /digit values for the 0x81 immediate group
+#define GROUP_ADD 0
+#define GROUP_OR  1
+#define GROUP_AND 4
+#define GROUP_SUB 5
+#define GROUP_XOR 6
+
+typedef struct
+{
+	U8* data;
+	size_t size;
+	size_t capacity;
+	int failed;
+} JIT_BUFFER;
+
+// a rel32 field to be patched with the address of a decoded instruction
+typedef struct
+{
+	size_t position; // offset of the rel32 field within the buffer
+	U64 target; // index of the target instruction
+} JIT_FIXUP;
+
+static void emit_u8(JIT_BUFFER* buf, U8 u8)
+{
+	if (buf->size == buf->capacity)
+	{
+		size_t capacity = buf->capacity ? buf->capacity * 2 : 4096;
+		U8* data = realloc(buf->data, capacity);
+
+		if (data == NULL)
+		{
+			buf->failed = 1;
+			return;
+		}
+
+		buf->data = data;
+		buf->capacity = capacity;
+	}
+
+	buf->data[buf->size++] = u8;
+}
+
+static void emit_u32(JIT_BUFFER* buf, U64 u32)
+{
+	for (size_t s = 0; s < 4; s++)
+		emit_u8(buf, (U8)(u32 >> (s * 8)));
+}
+
+static void emit_u64(JIT_BUFFER* buf, U64 u64)
+{
+	for (size_t s = 0; s < 8; s++)
+		emit_u8(buf, (U8)(u64 >> (s * 8)));
+}
+
+// emits a REX prefix with W set, extending the ModRM reg and rm fields as needed
+static void emit_rex(JIT_BUFFER* buf, U8 reg, U8 rm)
+{
+	emit_u8(buf, 0x48 | ((reg >> 3) << 2) | (rm >> 3));
+}
+
+// emits a register-direct ModRM byte
+static void emit_modrm(JIT_BUFFER* buf, U8 reg, U8 rm)
+{
+	emit_u8(buf, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// op r/m64, r64 (add, or, and, sub, xor, cmp, mov)
+static void emit_op_rr(JIT_BUFFER* buf, U8 opcode, U8 dst, U8 src)
+{
+	emit_rex(buf, src, dst);
+	emit_u8(buf, opcode);
+	emit_modrm(buf, src, dst);
+}
+
+// op r/m64, imm32 (sign-extended)
+static void emit_op_ri(JIT_BUFFER* buf, U8 group, U8 dst, U64 imm)
+{
+	emit_rex(buf, 0, dst);
+	emit_u8(buf, 0x81);
+	emit_modrm(buf, group, dst);
+	emit_u32(buf, imm);
+}
+
+static int fits_i32(I64 value)
+{
+	return value >= -0x80000000LL && value <= 0x7FFFFFFFLL;
+}
+
+// mov r64, imm
+static void emit_mov_ri(JIT_BUFFER* buf, U8 dst, U64 imm)
+{
+	if (fits_i32((I64)imm))
+	{
+		emit_rex(buf, 0, dst);
+		emit_u8(buf, 0xC7);
+		emit_modrm(buf, 0, dst);
+		emit_u32(buf, imm);
+	}
+	else
+	{
+		emit_rex(buf, 0, dst);
+		emit_u8(buf, 0xB8 | (dst & 7));
+		emit_u64(buf, imm);
+	}
+}
+
+// mov r64, [context + register] or mov [context + register], r64
+static void emit_context_access(JIT_BUFFER* buf, U8 opcode, U8 reg, size_t index)
+{
+	emit_rex(buf, reg, CONTEXT_REG);
+	emit_u8(buf, opcode);
+	emit_u8(buf, 0x40 | ((reg & 7) << 3) | (CONTEXT_REG & 7)); // [rdi + disp8]
+	emit_u8(buf, (U8)(index * sizeof(INT64)));
+}
+
+static void emit_load_context(JIT_BUFFER* buf, U8 dst, size_t index)
+{
+	emit_context_access(buf, 0x8B, dst, index);
+}
+
+static void emit_store_context(JIT_BUFFER* buf, size_t index, U8 src)
+{
+	emit_context_access(buf, 0x89, src, index);
+}
+
+// stores a constant to an MVM64 register kept in the context
+static void emit_store_context_imm(JIT_BUFFER* buf, size_t index, U64 imm)
+{
+	emit_mov_ri(buf, RAX, imm);
+	emit_store_context(buf, index, RAX);
+}
+
+// emits a rel32 jump or conditional jump (0x0F 0x8x) to an instruction, recording a fixup
+static void emit_jump(JIT_BUFFER* buf, U8 condition, U64 target, JIT_FIXUP* fixups, size_t* num_fixups)
+{
+	if (condition)
+	{
+		emit_u8(buf, 0x0F);
+		emit_u8(buf, condition);
+	}
+	else
+	{
+		emit_u8(buf, 0xE9);
+	}
+
+	fixups[*num_fixups].position = buf->size;
+	fixups[*num_fixups].target = target;
+	(*num_fixups)++;
+
+	emit_u32(buf, 0);
+}
+
+// emits a rel32 jump to a position within the buffer that is already known
+static void emit_jump_to(JIT_BUFFER* buf, U8 condition, size_t position)
+{
+	if (condition)
+	{
+		emit_u8(buf, 0x0F);
+		emit_u8(buf, condition);
+	}
+	else
+	{
+		emit_u8(buf, 0xE9);
+	}
+
+	emit_u32(buf, (U64)(position - (buf->size + 4)));
+}
+
+#define JCC_JE  0x84
+#define JCC_JNE 0x85
+#define JCC_JAE 0x83
+
+// offset of the guest memory pointer from the start of a context
+#define CONTEXT_MEMORY_OFFSET (sizeof(MVM64_REGISTERS) + offsetof(MVM64_CONTEXT_INFO, memory))
+
+// loads the context's guest memory into RAX, and emits a jump over what follows if it has none
+// returns position of the jump's rel8, to be set by emit_land_rel8()
+static size_t emit_memory_test(JIT_BUFFER* buf)
+{
+	emit_rex(buf, RAX, CONTEXT_REG); // mov rax, [rdi + disp32]
+	emit_u8(buf, 0x8B);
+	emit_u8(buf, 0x80 | ((RAX & 7) << 3) | (CONTEXT_REG & 7));
+	emit_u32(buf, CONTEXT_MEMORY_OFFSET);
+	emit_op_rr(buf, 0x85, RAX, RAX); // test rax, rax
+	emit_u8(buf, 0x74); // jz rel8
+	emit_u8(buf, 0);
+
+	return buf->size - 1;
+}
+
+// sets the rel8 at position to jump to the end of the buffer
+static void emit_land_rel8(JIT_BUFFER* buf, size_t position)
+{
+	if (!buf->failed)
+		buf->data[position] = (U8)(buf->size - (position + 1));
+}
+
+// op rdx, [rax + disp8], for a field of the MVM64_MEMORY in RAX
+static void emit_memory_field(JIT_BUFFER* buf, U8 opcode, size_t offset)
+{
+	emit_u8(buf, 0x48);
+	emit_u8(buf, opcode);
+	emit_u8(buf, 0x40 | ((RDX & 7) << 3) | (RAX & 7));
+	emit_u8(buf, (U8)offset);
+}
+
+// turns the address in RDX into a host address if the context has guest memory, using RAX
+static void emit_translate(JIT_BUFFER* buf)
+{
+	size_t host = emit_memory_test(buf);
+
+	emit_memory_field(buf, 0x23, offsetof(MVM64_MEMORY, mask)); // and rdx, mask
+	emit_memory_field(buf, 0x03, offsetof(MVM64_MEMORY, base)); // add rdx, base
+	emit_land_rel8(buf, host);
+}
+
+// writes every host-mapped MVM64 register back to the context
+static void emit_spill(JIT_BUFFER* buf)
+{
+	for (size_t s = 0; s < NUM_REGISTERS; s++)
+	{
+		if (HOST_REGISTERS[s] != IN_MEMORY)
+			emit_store_context(buf, s, HOST_REGISTERS[s]);
+	}
+}
+
+// gets a host register holding the value of an MVM64 register, loading it into scratch if needed
+static U8 emit_register(JIT_BUFFER* buf, U8 reg, U8 scratch)
+{
+	if (HOST_REGISTERS[reg] == IN_MEMORY)
+	{
+		emit_load_context(buf, scratch, reg);
+		return scratch;
+	}
+
+	return HOST_REGISTERS[reg];
+}
+
+// gets a host register holding the value of operand B, loading it into RCX if needed
+static U8 emit_operand_b(JIT_BUFFER* buf, const MVM64_DECODED* d)
+{
+	if (d->reg_b == NUM_REGISTERS)
+	{
+		emit_mov_ri(buf, RCX, d->val_b.u);
+		return RCX;
+	}
+
+	return emit_register(buf, d->reg_b, RCX);
+}
+
+// gets a host register holding operand A, loading it into RAX if needed
+// a value operand A is loaded into RAX so that writes to it are discarded
+static U8 emit_operand_a(JIT_BUFFER* buf, const MVM64_DECODED* d)
+{
+	if (d->reg_a == NUM_REGISTERS)
+	{
+		emit_mov_ri(buf, RAX, d->val_a.u);
+		return RAX;
+	}
+
+	return emit_register(buf, d->reg_a, RAX);
+}
+
+// writes RAX back to operand A if A is kept in the context
+static void emit_writeback_a(JIT_BUFFER* buf, const MVM64_DECODED* d)
+{
+	if (d->reg_a < NUM_REGISTERS && HOST_REGISTERS[d->reg_a] == IN_MEMORY)
+		emit_store_context(buf, d->reg_a, RAX);
+}
+
+// emits an arithmetic or logic instruction of the form A = A op B
+static void emit_arithmetic(JIT_BUFFER* buf, const MVM64_DECODED* d)
+{
+	static const U8 opcodes[] = { 0x01, 0x29, 0, 0, 0x21, 0x09, 0x31 }; // ADD-XOR, op r/m64, r64
+	static const U8 groups[] = { GROUP_ADD, GROUP_SUB, 0, 0, GROUP_AND, GROUP_OR, GROUP_XOR };
+
+	U8 dst = emit_operand_a(buf, d);
+
+	if (d->op == DIV)
+	{
+		U8 src = emit_operand_b(buf, d);
+
+		emit_op_rr(buf, 0x89, RAX, dst); // mov rax, A
+		emit_u8(buf, 0x48); // cqo
+		emit_u8(buf, 0x99);
+		emit_rex(buf, 0, src); // idiv src
+		emit_u8(buf, 0xF7);
+		emit_modrm(buf, 7, src);
+		emit_op_rr(buf, 0x89, dst, RAX);
+	}
+	else if (d->op == MUL)
+	{
+		if (d->reg_b == NUM_REGISTERS && fits_i32(d->val_b.i))
+		{
+			emit_rex(buf, dst, dst); // imul dst, dst, imm32
+			emit_u8(buf, 0x69);
+			emit_modrm(buf, dst, dst);
+			emit_u32(buf, d->val_b.u);
+		}
+		else
+		{
+			U8 src = emit_operand_b(buf, d);
+
+			emit_rex(buf, dst, src); // imul dst, src
+			emit_u8(buf, 0x0F);
+			emit_u8(buf, 0xAF);
+			emit_modrm(buf, dst, src);
+		}
+	}
+	else if (d->reg_b == NUM_REGISTERS && fits_i32(d->val_b.i))
+	{
+		emit_op_ri(buf, groups[d->op], dst, d->val_b.u);
+	}
+	else
+	{
+		emit_op_rr(buf, opcodes[d->op], dst, emit_operand_b(buf, d));
+	}
+
+	emit_writeback_a(buf, d);
+}
+
+// translates a single decoded instruction
+static void emit_instruction(JIT_BUFFER* buf, const MVM64_IMAGE* image, const MVM64_DECODED* d,
+	U64 index, size_t dispatch, size_t fail, JIT_FIXUP* fixups, size_t* num_fixups)
+{
+	U64 code = (U64)image->code;
+
+	if (d->op >= NUM_INSTRUCTIONS)
+	{
+		emit_store_context_imm(buf, REGISTER_I, code + d->offset);
+		emit_jump_to(buf, 0, fail);
+		return;
+	}
+
+	if (d->op == RET)
+	{
+		emit_store_context_imm(buf, REGISTER_I, code + d->offset);
+		emit_op_ri(buf, GROUP_ADD, BYTES_REG, sizeof(U8));
+		return;
+	}
+
+	emit_op_ri(buf, GROUP_ADD, BYTES_REG, d->size);
+
+	if (d->flags & DECODED_SYNC_I)
+		emit_store_context_imm(buf, REGISTER_I, code + d->offset);
+
+	switch (d->op)
+	{
+	case ADD:
+	case SUB:
+	case MUL:
+	case DIV:
+	case AND:
+	case OR:
+	case XOR:
+		emit_arithmetic(buf, d);
+		break;
+
+	case MOV:
+	{
+		U8 dst = emit_operand_a(buf, d);
+
+		if (d->reg_b == NUM_REGISTERS)
+			emit_mov_ri(buf, dst, d->val_b.u);
+		else
+			emit_op_rr(buf, 0x89, dst, emit_operand_b(buf, d));
+
+		emit_writeback_a(buf, d);
+		break;
+	}
+
+	case COMP:
+	{
+		U8 src = emit_operand_b(buf, d);
+		U8 dst = emit_operand_a(buf, d);
+
+		emit_op_rr(buf, 0x89, dst, src);
+		emit_rex(buf, 0, dst); // not dst
+		emit_u8(buf, 0xF7);
+		emit_modrm(buf, 2, dst);
+		emit_writeback_a(buf, d);
+		break;
+	}
+
+	case DREF:
+	case LOADB:
+	{
+		// the address may refer to the context, so it must be up to date
+		emit_spill(buf);
+
+		U8 src = emit_operand_b(buf, d);
+		emit_op_rr(buf, 0x89, RDX, src);
+		emit_translate(buf);
+
+		if (d->op == LOADB)
+		{
+			emit_u8(buf, 0x0F); // movzx edx, byte [rdx]
+			emit_u8(buf, 0xB6);
+			emit_u8(buf, 0x12);
+		}
+		else
+		{
+			emit_u8(buf, 0x48); // mov rdx, [rdx]
+			emit_u8(buf, 0x8B);
+			emit_u8(buf, 0x12);
+		}
+
+		U8 dst = emit_operand_a(buf, d);
+		emit_op_rr(buf, 0x89, dst, RDX);
+		emit_writeback_a(buf, d);
+		break;
+	}
+
+	case STORE:
+	case STOREB:
+	{
+		// a store to the registers or code through their host addresses isn't seen
+		emit_op_rr(buf, 0x89, RDX, emit_operand_a(buf, d));
+		emit_translate(buf);
+
+		U8 src = emit_operand_b(buf, d);
+
+		if (d->op == STORE)
+			emit_rex(buf, src, RDX); // mov [rdx], src
+		else
+			emit_u8(buf, 0x40 | ((src >> 3) << 2)); // mov [rdx], src8, with REX for sil
+
+		emit_u8(buf, d->op == STORE ? 0x89 : 0x88);
+		emit_u8(buf, ((src & 7) << 3) | (RDX & 7));
+		break;
+	}
+
+	case LADR:
+	{
+		if (d->reg_b == NUM_REGISTERS)
+		{
+			// address of the value within the code, resolved when decoded
+			emit_mov_ri(buf, RDX, d->val_b.u);
+		}
+		else
+		{
+			emit_rex(buf, RDX, CONTEXT_REG); // lea rdx, [rdi + disp8]
+			emit_u8(buf, 0x8D);
+			emit_u8(buf, 0x40 | ((RDX & 7) << 3) | (CONTEXT_REG & 7));
+			emit_u8(buf, (U8)(d->reg_b * sizeof(INT64)));
+		}
+
+		// with guest memory, the address must be within it and is made relative to it
+		size_t host = emit_memory_test(buf);
+		emit_memory_field(buf, 0x2B, offsetof(MVM64_MEMORY, base)); // sub rdx, base
+		emit_memory_field(buf, 0x3B, offsetof(MVM64_MEMORY, size)); // cmp rdx, size
+		emit_u8(buf, 0x72); // jb rel8
+		emit_u8(buf, 0);
+
+		size_t inside = buf->size - 1;
+		emit_store_context_imm(buf, REGISTER_I, code + d->offset);
+		emit_jump_to(buf, 0, fail);
+		emit_land_rel8(buf, inside);
+		emit_land_rel8(buf, host);
+
+		U8 dst = emit_operand_a(buf, d);
+		emit_op_rr(buf, 0x89, dst, RDX);
+		emit_writeback_a(buf, d);
+		break;
+	}
+
+	case PUSH:
+	{
+		emit_op_ri(buf, GROUP_ADD, HOST_S, sizeof(INT64));
+
+		U8 src = emit_operand_a(buf, d);
+		emit_rex(buf, src, HOST_S); // mov [r15], src
+		emit_u8(buf, 0x89);
+		emit_u8(buf, ((src & 7) << 3) | (HOST_S & 7));
+		break;
+	}
+
+	case POP:
+	{
+		emit_u8(buf, 0x49); // mov rdx, [r15]
+		emit_u8(buf, 0x8B);
+		emit_u8(buf, 0x17);
+
+		// A is written before S is decremented, matching exec_instruction for POP S
+		U8 dst = emit_operand_a(buf, d);
+		emit_op_rr(buf, 0x89, dst, RDX);
+		emit_writeback_a(buf, d);
+		emit_op_ri(buf, GROUP_SUB, HOST_S, sizeof(INT64));
+		break;
+	}
+
+	case JMP:
+	case JZR:
+		if (d->op == JZR)
+		{
+			emit_op_rr(buf, 0x85, HOST_R, HOST_R); // test rsi, rsi
+			emit_jump(buf, JCC_JNE, d->next, fixups, num_fixups);
+		}
+
+		if (d->reg_a == NUM_REGISTERS)
+		{
+			emit_jump(buf, 0, d->target, fixups, num_fixups);
+		}
+		else
+		{
+			U8 src = emit_register(buf, d->reg_a, RCX);
+
+			emit_mov_ri(buf, RAX, d->offset);
+			emit_op_rr(buf, 0x01, RAX, src);
+			emit_jump_to(buf, 0, dispatch); // continue at the code offset in RAX
+		}
+
+		return;
+	}
+
+	if (d->flags & DECODED_WRITES_I)
+	{
+		// continue from wherever I now points, as exec_instruction does
+		emit_load_context(buf, RAX, REGISTER_I);
+		emit_mov_ri(buf, RCX, code - d->size);
+		emit_op_rr(buf, 0x29, RAX, RCX);
+		emit_jump_to(buf, 0, dispatch); // continue at the code offset in RAX
+	}
+	else if (d->next != index + 1)
+	{
+		emit_jump(buf, 0, d->next, fixups, num_fixups);
+	}
+}
+
+// allocates executable memory holding a copy of the generated code
+static void* map_executable(const U8* data, size_t size)
+{
+#ifdef _WIN32
+	void* mem = VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	DWORD old;
+
+	if (mem == NULL)
+		return NULL;
+
+	memcpy(mem, data, size);
+
+	if (!VirtualProtect(mem, size, PAGE_EXECUTE_READ, &old))
+	{
+		VirtualFree(mem, 0, MEM_RELEASE);
+		return NULL;
+	}
+
+	return mem;
+#else
+	void* mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (mem == MAP_FAILED)
+		return NULL;
+
+	memcpy(mem, data, size);
+
+	if (mprotect(mem, size, PROT_READ | PROT_EXEC))
+	{
+		munmap(mem, size);
+		return NULL;
+	}
+
+	return mem;
+#endif
+}
+
+static void unmap_executable(void* mem, size_t size)
+{
+#ifdef _WIN32
+	VirtualFree(mem, 0, MEM_RELEASE);
+#else
+	munmap(mem, size);
+#endif
+}
+
+#endif
+
+// translates a decoded image into native x86-64 code
+// the image must outlive the returned translation
+// returns NULL if the host is not x86-64 or on failure
+MVM64_JIT* create_jit(const MVM64_IMAGE* image)
+{
+#if JIT_SUPPORTED
+	if (image == NULL)
+		return NULL;
+
+	MVM64_JIT* jit = calloc(1, sizeof(MVM64_JIT));
+	JIT_FIXUP* fixups = malloc((image->num_instructions * 2 + 3) * sizeof(JIT_FIXUP));
+	size_t* positions = malloc(image->num_instructions * sizeof(size_t));
+	JIT_BUFFER buf = { 0 };
+	size_t num_fixups = 0;
+
+	if (!jit || !fixups || !positions)
+		goto FAIL;
+
+	jit->image = image;
+	jit->targets = malloc(image->num_instructions * sizeof(void*));
+
+	if (!jit->targets)
+		goto FAIL;
+
+	// prologue: save callee-saved registers and load the MVM64 registers from the context
+	static const U8 saved[] = {
+#ifdef _WIN32
+		RSI, RDI,
+#endif
+		RBX, RBP, R12, R13, R14, R15
+	};
+
+	for (size_t s = 0; s < sizeof(saved); s++)
+	{
+		if (saved[s] >= R8)
+			emit_u8(&buf, 0x41);
+
+		emit_u8(&buf, 0x50 | (saved[s] & 7)); // push
+	}
+
+#ifdef _WIN32
+	emit_op_rr(&buf, 0x89, CONTEXT_REG, RCX);
+#endif
+
+	for (size_t s = 0; s < NUM_REGISTERS; s++)
+	{
+		if (HOST_REGISTERS[s] != IN_MEMORY)
+			emit_load_context(&buf, HOST_REGISTERS[s], s);
+	}
+
+	emit_op_rr(&buf, 0x31, BYTES_REG, BYTES_REG);
+	emit_store_context_imm(&buf, REGISTER_I, (U64)image->code);
+	emit_jump(&buf, 0, 0, fixups, &num_fixups);
+
+	// exit: store the MVM64 registers and return the number of bytes executed
+	size_t exit_position = buf.size;
+	emit_spill(&buf);
+	emit_op_rr(&buf, 0x89, RAX, BYTES_REG);
+
+	for (size_t s = sizeof(saved); s > 0; s--)
+	{
+		if (saved[s - 1] >= R8)
+			emit_u8(&buf, 0x41);
+
+		emit_u8(&buf, 0x58 | (saved[s - 1] & 7)); // pop
+	}
+
+	emit_u8(&buf, 0xC3);
+
+	// failure: execution has left the decoded instructions
+	size_t fail = buf.size;
+	emit_op_rr(&buf, 0x31, BYTES_REG, BYTES_REG);
+	emit_jump_to(&buf, 0, exit_position);
+
+	// dispatch: jump to the instruction at the code offset in RAX, or to the sentinel
+	size_t dispatch = buf.size;
+	size_t sentinel = image->num_instructions - 1;
+	emit_mov_ri(&buf, RCX, image->code_size);
+	emit_op_rr(&buf, 0x39, RAX, RCX); // cmp rax, rcx
+	emit_jump(&buf, JCC_JAE, sentinel, fixups, &num_fixups);
+	emit_mov_ri(&buf, RCX, (U64)image->index);
+	emit_u8(&buf, 0x48); // mov rax, [rcx + rax * 8]
+	emit_u8(&buf, 0x8B);
+	emit_u8(&buf, 0x04);
+	emit_u8(&buf, 0xC1);
+	emit_u8(&buf, 0x48); // cmp rax, -1
+	emit_u8(&buf, 0x83);
+	emit_u8(&buf, 0xF8);
+	emit_u8(&buf, 0xFF);
+	emit_jump(&buf, JCC_JE, sentinel, fixups, &num_fixups);
+	emit_mov_ri(&buf, RCX, (U64)jit->targets);
+	emit_u8(&buf, 0xFF); // jmp [rcx + rax * 8]
+	emit_u8(&buf, 0x24);
+	emit_u8(&buf, 0xC1);
+
+	for (U64 s = 0; s < image->num_instructions; s++)
+	{
+		positions[s] = buf.size;
+		emit_instruction(&buf, image, &image->instructions[s], s, dispatch, fail,
+			fixups, &num_fixups);
+
+		if (image->instructions[s].op == RET)
+			emit_jump_to(&buf, 0, exit_position);
+	}
+
+	if (buf.failed)
+		goto FAIL;
+
+	for (size_t s = 0; s < num_fixups; s++)
+	{
+		U64 rel = positions[fixups[s].target] - (fixups[s].position + 4);
+		memcpy(buf.data + fixups[s].position, &rel, 4);
+	}
+
+	jit->code = map_executable(buf.data, buf.size);
+	jit->code_size = buf.size;
+
+	if (!jit->code)
+		goto FAIL;
+
+	for (U64 s = 0; s < image->num_instructions; s++)
+		jit->targets[s] = (U8*)jit->code + positions[s];
+
+	jit->entry = (U64 (*)(MVM64_REGISTERS*))jit->code;
+
+	free(buf.data);
+	free(fixups);
+	free(positions);
+
+	return jit;
+
+FAIL:
+	free(buf.data);
+	free(fixups);
+	free(positions);
+
+	if (jit)
+	{
+		free(jit->targets);
+		free(jit);
+	}
+
+	return NULL;
+#else
+	return NULL;
+#endif
+}
+
+void free_jit(MVM64_JIT* jit)
+{
+	if (jit == NULL)
+		return;
+
+#if JIT_SUPPORTED
+	unmap_executable(jit->code, jit->code_size);
+#endif
+
+	free(jit->targets);
+	free(jit);
+}
+
+// executes translated code, producing the same results as execute_image() on the same image
+// returns number of bytes executed, or 0 on error
+U64 execute_jit(const MVM64_JIT* jit, MVM64_REGISTERS* context, INT64* return_value)
+{
+	U64 bytes_executed = jit->entry(context);
+
+	if (bytes_executed)
+		*return_value = context->s.R;
+	else
+		return_value->u = 0;
+
+	return bytes_executed;
+}
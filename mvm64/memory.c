@@ -0,0 +1,109 @@
+#include <stdlib.h>
+#include <string.h>
+#include "vm.h"
+#include "pages.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+// guest linear memory, so that code on a context with memory attached addresses its own flat
+// address space rather than the host's
+// a memory is a single mapping of a power of 2 bytes, so translating a guest address is a mask
+// and an add, and no guest address can reach outside of it
+// pages are only backed once touched, so a large, sparsely used memory stays small
+
+// creates a zeroed memory of at least size bytes, rounded up to a power of 2
+// returns NULL on failure
+MVM64_MEMORY* create_memory(U64 size)
+{
+	U64 rounded = MEMORY_MIN_SIZE;
+
+	while (rounded < size && rounded <= U64_MAX / 4)
+		rounded *= 2;
+
+	if (rounded < size || rounded + MEMORY_SLACK > (size_t)-1)
+		return NULL;
+
+	MVM64_MEMORY* memory = calloc(1, sizeof(MVM64_MEMORY));
+
+	if (!memory)
+		return NULL;
+
+	memory->size = rounded;
+	memory->mask = rounded - 1;
+	memory->mapping_size = rounded + MEMORY_SLACK;
+
+#ifdef _WIN32
+	memory->base = VirtualAlloc(NULL, (size_t)memory->mapping_size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+	memory->base = mmap(NULL, (size_t)memory->mapping_size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	if (memory->base == MAP_FAILED)
+		memory->base = NULL;
+#endif
+
+	if (!memory->base)
+	{
+		free(memory);
+		return NULL;
+	}
+
+	return memory;
+}
+
+// frees a memory, which must no longer be attached to any context
+void free_memory(MVM64_MEMORY* memory)
+{
+	if (memory == NULL)
+		return;
+
+#ifdef _WIN32
+	if (memory->flags & MEMORY_VIEW)
+		UnmapViewOfFile(memory->base);
+	else
+		VirtualFree(memory->base, 0, MEM_RELEASE);
+#else
+	munmap(memory->base, (size_t)memory->mapping_size);
+#endif
+
+	free(memory);
+}
+
+// makes DREF, LADR, STORE, LOADB and STOREB on context address memory, or host memory if NULL
+// LADR then loads the guest address of its operand, so it only succeeds on the inline operands
+// of code that is itself run from the memory
+// any number of contexts may share a memory
+// a memory the context owned is left for the caller to free
+void attach_memory(MVM64_REGISTERS* context, MVM64_MEMORY* memory)
+{
+	CONTEXT_INFO(context)->memory = memory;
+	CONTEXT_INFO(context)->flags &= ~(U64)CONTEXT_OWN_MEMORY;
+}
+
+// copies size bytes of data into memory at address, such as code to run from it
+// returns 0 if they don't fit below the end of the memory
+int write_memory(MVM64_MEMORY* memory, U64 address, const void* data, size_t size)
+{
+	if (address > memory->size || memory->size - address < size)
+		return 0;
+
+	memcpy(memory->base + address, data, size);
+
+	return 1;
+}
+
+// copies size bytes at address out of memory into data
+// returns 0 if they aren't all below the end of the memory
+int read_memory(const MVM64_MEMORY* memory, U64 address, void* data, size_t size)
+{
+	if (address > memory->size || memory->size - address < size)
+		return 0;
+
+	memcpy(data, memory->base + address, size);
+
+	return 1;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+// internals of guest memory shared by memory.c, snapshot.c and checkpoint.c
+// guest memory is copied page by page into snapshots and checkpoints, skipping pages that are all
+// zero
+
+#define MEMORY_PAGE 4096 // unit guest memory is copied in, and zero pages skipped in
+#define MEMORY_MIN_SIZE 4096 // smallest memory create_memory() makes, in bytes
+
+// returns nonzero if size bytes at page, which need not be aligned, are all zero
+static __inline int zero_page(const U8* page, size_t size)
+{
+	return page[0] == 0 && memcmp(page, page + 1, size - 1) == 0;
+}
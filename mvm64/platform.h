@@ -0,0 +1,87 @@
+#pragma once
+
+// host threads and locks for the parts of the library that use them
+#ifdef _WIN32
+#include <windows.h>
+
+typedef HANDLE HOST_THREAD;
+typedef CRITICAL_SECTION HOST_LOCK;
+typedef CONDITION_VARIABLE HOST_CONDITION;
+
+#define lock_init(l) InitializeCriticalSection(l)
+#define lock_free(l) DeleteCriticalSection(l)
+#define lock_acquire(l) EnterCriticalSection(l)
+#define lock_release(l) LeaveCriticalSection(l)
+#define condition_init(c) InitializeConditionVariable(c)
+#define condition_free(c)
+#define condition_wait(c, l) SleepConditionVariableCS(c, l, INFINITE)
+#define condition_broadcast(c) WakeAllConditionVariable(c)
+
+// defines a host thread entry point name that calls function with its parameter as a type*
+#define HOST_THREAD_ENTRY(name, function, type) \
+	static DWORD WINAPI name(LPVOID param) \
+	{ \
+		function((type*)param); \
+		return 0; \
+	}
+
+#define thread_start(t, entry, param) ((*(t) = CreateThread(NULL, 0, entry, param, 0, NULL)) != NULL)
+#define thread_join(t) (WaitForSingleObject(t, INFINITE), CloseHandle(t))
+
+// atomically adjust a volatile I64, returning the new value
+#define atomic_increment(p) InterlockedIncrement64((volatile LONG64*)(p))
+#define atomic_decrement(p) InterlockedDecrement64((volatile LONG64*)(p))
+#define atomic_add(p, v) InterlockedAdd64((volatile LONG64*)(p), (LONG64)(v))
+
+// read a volatile I64 or pointer with acquire, and write one with release ordering
+#define atomic_read(p) ReadAcquire64((volatile LONG64*)(p))
+#define atomic_write(p, v) WriteRelease64((volatile LONG64*)(p), (LONG64)(v))
+#define atomic_read_pointer(p) ReadPointerAcquire((PVOID volatile*)(p))
+#define atomic_write_pointer(p, v) WritePointerRelease((PVOID volatile*)(p), (PVOID)(v))
+
+// replaces a volatile I64 with desired if it holds expected, returning nonzero if it did
+#define atomic_compare_swap(p, expected, desired) \
+	(InterlockedCompareExchange64((volatile LONG64*)(p), (LONG64)(desired), (LONG64)(expected)) == \
+		(LONG64)(expected))
+
+#define THREAD_LOCAL __declspec(thread)
+#else
+#include <pthread.h>
+#include <unistd.h>
+
+typedef pthread_t HOST_THREAD;
+typedef pthread_mutex_t HOST_LOCK;
+typedef pthread_cond_t HOST_CONDITION;
+
+#define lock_init(l) pthread_mutex_init(l, NULL)
+#define lock_free(l) pthread_mutex_destroy(l)
+#define lock_acquire(l) pthread_mutex_lock(l)
+#define lock_release(l) pthread_mutex_unlock(l)
+#define condition_init(c) pthread_cond_init(c, NULL)
+#define condition_free(c) pthread_cond_destroy(c)
+#define condition_wait(c, l) pthread_cond_wait(c, l)
+#define condition_broadcast(c) pthread_cond_broadcast(c)
+
+#define HOST_THREAD_ENTRY(name, function, type) \
+	static void* name(void* param) \
+	{ \
+		function((type*)param); \
+		return NULL; \
+	}
+
+#define thread_start(t, entry, param) (pthread_create(t, NULL, entry, param) == 0)
+#define thread_join(t) pthread_join(t, NULL)
+
+#define atomic_increment(p) __atomic_add_fetch(p, 1, __ATOMIC_RELAXED)
+#define atomic_decrement(p) __atomic_sub_fetch(p, 1, __ATOMIC_ACQ_REL)
+#define atomic_add(p, v) __atomic_add_fetch(p, v, __ATOMIC_ACQ_REL)
+
+#define atomic_read(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define atomic_write(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define atomic_read_pointer(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define atomic_write_pointer(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+#define atomic_compare_swap(p, expected, desired) __sync_bool_compare_and_swap(p, expected, desired)
+
+#define THREAD_LOCAL __thread
+#endif
@@ -0,0 +1,498 @@
+#ifdef __linux__
+#define _GNU_SOURCE // SIGEV_THREAD_ID
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vm.h"
+#include "platform.h"
+
+#ifndef _WIN32
+#include <signal.h>
+#include <time.h>
+#include <sys/time.h>
+#endif
+
+#ifdef __linux__
+#include <sys/syscall.h>
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+#endif
+
+// a sampling profiler, which counts how often I is found at each offset into some code, either
+// every so many instructions or on a profiling timer signal
+// reports attribute the counts to source lines with a line table written by the assembler, which
+// is text of the form
+// MVM64 LINES 1
+// SOURCE <file name>
+// SYMBOL <code offset> <name>
+// LINE <code offset> <line>
+// with a LINE for every line that generates code, and offsets and lines in decimal
+
+#define LINE_TABLE_HEADER "MVM64 LINES 1"
+#define LINE_TABLE_TEXT 512 // longest line of a line table, in bytes
+
+// creates a profile of samples taken over code, with no samples yet
+// returns NULL on allocation failure
+MVM64_PROFILE* create_profile(const void* code, size_t code_size)
+{
+	MVM64_PROFILE* profile = calloc(1, sizeof(MVM64_PROFILE));
+
+	if (!profile)
+		return NULL;
+
+	profile->hits = calloc(code_size ? code_size : 1, sizeof(U64));
+
+	if (!profile->hits)
+	{
+		free(profile);
+		return NULL;
+	}
+
+	profile->code = code;
+	profile->code_size = code_size;
+
+	return profile;
+}
+
+void free_profile(MVM64_PROFILE* profile)
+{
+	if (profile == NULL)
+		return;
+
+	free(profile->hits);
+	free(profile);
+}
+
+// counts a sample of I at address
+void profile_sample(MVM64_PROFILE* profile, U64 address)
+{
+	U64 offset = address - (U64)profile->code;
+
+	profile->samples++;
+
+	if (offset < profile->code_size)
+		profile->hits[offset]++;
+	else
+		profile->outside++;
+}
+
+// executes from I until RET, sampling I every interval instructions
+// returns number of bytes executed, or 0 on error
+U64 execute_profiled(MVM64_REGISTERS* context, MVM64_PROFILE* profile, U64 interval, INT64* return_value)
+{
+	U64 bytes_executed = 0;
+
+	if (interval == 0)
+		return 0;
+
+	while (1)
+	{
+		MVM64_STATUS status = execute_slice(context, interval, &bytes_executed, return_value);
+
+		if (status != MVM64_YIELDED)
+			return status == MVM64_OK ? bytes_executed : 0;
+
+		profile_sample(profile, context->s.I.u);
+	}
+}
+
+#ifndef _WIN32
+// the profile and context of an execute_profiled_timer() in progress on this thread
+typedef struct
+{
+	MVM64_PROFILE* profile;
+	const volatile MVM64_REGISTERS* context;
+} PROFILE_TARGET;
+
+static THREAD_LOCAL PROFILE_TARGET* volatile profile_target;
+static struct sigaction previous_prof;
+static pthread_once_t profile_handler_installed = PTHREAD_ONCE_INIT;
+
+static void profile_handler(int signal, siginfo_t* info, void* ucontext)
+{
+	PROFILE_TARGET* target = profile_target;
+
+	if (target)
+		profile_sample(target->profile, target->context->s.I.u);
+	else if (previous_prof.sa_flags & SA_SIGINFO)
+		previous_prof.sa_sigaction(signal, info, ucontext);
+	else if (previous_prof.sa_handler != SIG_DFL && previous_prof.sa_handler != SIG_IGN)
+		previous_prof.sa_handler(signal);
+}
+
+// the handler stays installed, so a signal still in flight once the timer is stopped is ignored
+// rather than ending the process
+static void install_profile_handler()
+{
+	struct sigaction action;
+
+	memset(&action, 0, sizeof(action));
+	action.sa_sigaction = profile_handler;
+	action.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&action.sa_mask);
+
+	sigaction(SIGPROF, &action, &previous_prof);
+}
+
+#ifdef __linux__
+typedef timer_t PROFILE_TIMER;
+#else
+typedef int PROFILE_TIMER;
+#endif
+
+// starts a timer raising SIGPROF every period microseconds of CPU time
+// on Linux it times and signals only this thread, so any number of threads may profile by timer
+// at once, but elsewhere it is for the whole process, so only one thread may at a time
+// returns 0 on failure
+static int start_profile_timer(PROFILE_TIMER* timer, U64 period)
+{
+#ifdef __linux__
+	struct sigevent event;
+	struct itimerspec interval;
+
+	memset(&event, 0, sizeof(event));
+	event.sigev_notify = SIGEV_THREAD_ID;
+	event.sigev_signo = SIGPROF;
+	event.sigev_notify_thread_id = (pid_t)syscall(SYS_gettid);
+
+	if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, timer))
+		return 0;
+
+	interval.it_interval.tv_sec = (time_t)(period / 1000000);
+	interval.it_interval.tv_nsec = (long)(period % 1000000 * 1000);
+	interval.it_value = interval.it_interval;
+
+	if (timer_settime(*timer, 0, &interval, NULL))
+	{
+		timer_delete(*timer);
+		return 0;
+	}
+
+	return 1;
+#else
+	struct itimerval interval;
+
+	interval.it_interval.tv_sec = (time_t)(period / 1000000);
+	interval.it_interval.tv_usec = (suseconds_t)(period % 1000000);
+	interval.it_value = interval.it_interval;
+	*timer = 0;
+
+	return !setitimer(ITIMER_PROF, &interval, NULL);
+#endif
+}
+
+static void stop_profile_timer(PROFILE_TIMER* timer)
+{
+#ifdef __linux__
+	timer_delete(*timer);
+#else
+	struct itimerval interval;
+
+	memset(&interval, 0, sizeof(interval));
+	setitimer(ITIMER_PROF, &interval, NULL);
+#endif
+}
+#endif
+
+// executes from I until RET with the instruction at a time engine, sampling I on a profiling
+// timer signal every period microseconds of this thread's CPU time (see start_profile_timer())
+// returns number of bytes executed, or 0 on error, or if there's no profiling timer signal, as on
+// Windows
+U64 execute_profiled_timer(MVM64_REGISTERS* context, MVM64_PROFILE* profile, U64 period,
+	INT64* return_value)
+{
+#ifdef _WIN32
+	return_value->u = 0;
+	return 0;
+#else
+	PROFILE_TARGET target = { profile, context };
+	PROFILE_TIMER timer;
+
+	if (period == 0)
+	{
+		return_value->u = 0;
+		return 0;
+	}
+
+	pthread_once(&profile_handler_installed, install_profile_handler);
+
+	profile_target = &target;
+
+	if (!start_profile_timer(&timer, period))
+	{
+		profile_target = NULL;
+		return_value->u = 0;
+		return 0;
+	}
+
+	U64 bytes_executed = execute_resume(context, return_value);
+
+	stop_profile_timer(&timer);
+	profile_target = NULL;
+
+	return bytes_executed;
+#endif
+}
+
+static int compare_lines(const void* a, const void* b)
+{
+	U64 offset_a = ((const MVM64_LINE*)a)->offset, offset_b = ((const MVM64_LINE*)b)->offset;
+
+	return offset_a < offset_b ? -1 : offset_a > offset_b;
+}
+
+static int compare_symbols(const void* a, const void* b)
+{
+	U64 offset_a = ((const MVM64_LINE_SYMBOL*)a)->offset, offset_b = ((const MVM64_LINE_SYMBOL*)b)->offset;
+
+	return offset_a < offset_b ? -1 : offset_a > offset_b;
+}
+
+// adds an element to an array, doubling it as it fills
+// returns 0 on allocation failure
+static int append(void** array, size_t* count, size_t* capacity, size_t size, const void* element)
+{
+	if (*count == *capacity)
+	{
+		size_t grown = *capacity ? *capacity * 2 : 64;
+		void* resized = realloc(*array, grown * size);
+
+		if (!resized)
+			return 0;
+
+		*array = resized;
+		*capacity = grown;
+	}
+
+	memcpy((U8*)*array + *count * size, element, size);
+	(*count)++;
+
+	return 1;
+}
+
+// reads a line table written by the assembler
+// returns NULL if it isn't a line table, or on allocation failure
+MVM64_LINE_TABLE* read_line_table(FILE* file)
+{
+	MVM64_LINE_TABLE* table = calloc(1, sizeof(MVM64_LINE_TABLE));
+	size_t lines_capacity = 0, symbols_capacity = 0;
+	char text[LINE_TABLE_TEXT];
+
+	if (!table)
+		return NULL;
+
+	if (!fgets(text, sizeof(text), file) || strncmp(text, LINE_TABLE_HEADER, strlen(LINE_TABLE_HEADER)))
+		goto fail;
+
+	while (fgets(text, sizeof(text), file))
+	{
+		MVM64_LINE line;
+		MVM64_LINE_SYMBOL symbol;
+
+		text[strcspn(text, "\r\n")] = 0;
+
+		if (!strncmp(text, "SOURCE ", 7))
+			snprintf(table->source, sizeof(table->source), "%.*s", (int)sizeof(table->source) - 1, text + 7);
+		else if (sscanf(text, "LINE %llu %llu", &line.offset, &line.line) == 2)
+		{
+			if (!append((void**)&table->lines, &table->num_lines, &lines_capacity, sizeof(line), &line))
+				goto fail;
+		}
+		else if (sscanf(text, "SYMBOL %llu", &symbol.offset) == 1)
+		{
+			const char* name = strchr(text + 7, ' ');
+
+			snprintf(symbol.name, sizeof(symbol.name), "%s", name ? name + 1 : "");
+
+			if (!append((void**)&table->symbols, &table->num_symbols, &symbols_capacity, sizeof(symbol), &symbol))
+				goto fail;
+		}
+	}
+
+	qsort(table->lines, table->num_lines, sizeof(MVM64_LINE), compare_lines);
+	qsort(table->symbols, table->num_symbols, sizeof(MVM64_LINE_SYMBOL), compare_symbols);
+
+	return table;
+
+fail:
+	free_line_table(table);
+
+	return NULL;
+}
+
+void free_line_table(MVM64_LINE_TABLE* table)
+{
+	if (table == NULL)
+		return;
+
+	free(table->lines);
+	free(table->symbols);
+	free(table);
+}
+
+// returns index of the last of count elements of size bytes, sorted by a leading U64 offset,
+// that starts at or before offset, or count if none do
+static size_t find_offset(const void* array, size_t count, size_t size, U64 offset)
+{
+	size_t low = 0, high = count;
+
+	while (low < high)
+	{
+		size_t middle = low + (high - low) / 2;
+
+		if (*(const U64*)((const U8*)array + middle * size) <= offset)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	return low ? low - 1 : count;
+}
+
+// a span of code profiled as one, a line or a single offset without a line table
+typedef struct
+{
+	U64 offset;
+	U64 line; // 0 without a line table
+	U64 hits;
+} PROFILE_SPAN;
+
+static int compare_spans(const void* a, const void* b)
+{
+	U64 hits_a = ((const PROFILE_SPAN*)a)->hits, hits_b = ((const PROFILE_SPAN*)b)->hits;
+
+	U64 offset_a = ((const PROFILE_SPAN*)a)->offset, offset_b = ((const PROFILE_SPAN*)b)->offset;
+
+	// most hits first, then in code order
+	if (hits_a != hits_b)
+		return hits_a > hits_b ? -1 : 1;
+
+	return offset_a < offset_b ? -1 : offset_a > offset_b;
+}
+
+// totals the hits of a profile by line, or by offset without a line table, leaving out spans
+// with none
+// returns array of spans, with their number in *num_spans, or NULL on allocation failure
+static PROFILE_SPAN* profile_spans(const MVM64_PROFILE* profile, const MVM64_LINE_TABLE* table,
+	size_t* num_spans)
+{
+	PROFILE_SPAN* spans = malloc((table ? table->num_lines + 1 : profile->code_size + 1) * sizeof(PROFILE_SPAN));
+	size_t count = 0;
+
+	if (!spans)
+		return NULL;
+
+	for (size_t s = 0; s < profile->code_size; s++)
+	{
+		if (!profile->hits[s])
+			continue;
+
+		U64 offset = s, line = 0;
+
+		if (table)
+		{
+			size_t index = find_offset(table->lines, table->num_lines, sizeof(MVM64_LINE), s);
+
+			// code before the first line counts as line 0
+			offset = index < table->num_lines ? table->lines[index].offset : 0;
+			line = index < table->num_lines ? table->lines[index].line : 0;
+		}
+
+		if (count && spans[count - 1].offset == offset && spans[count - 1].line == line)
+			spans[count - 1].hits += profile->hits[s];
+		else
+		{
+			spans[count].offset = offset;
+			spans[count].line = line;
+			spans[count].hits = profile->hits[s];
+			count++;
+		}
+	}
+
+	*num_spans = count;
+
+	return spans;
+}
+
+// returns name of the symbol code at offset falls under, or NULL if none
+static const char* span_symbol(const MVM64_LINE_TABLE* table, U64 offset)
+{
+	size_t index = find_offset(table->symbols, table->num_symbols, sizeof(MVM64_LINE_SYMBOL), offset);
+
+	return index < table->num_symbols ? table->symbols[index].name : NULL;
+}
+
+// writes a flat report of a profile, hottest first, by source line if table isn't NULL
+// returns 0 on allocation failure
+int write_profile_report(FILE* file, const MVM64_PROFILE* profile, const MVM64_LINE_TABLE* table)
+{
+	size_t num_spans;
+	PROFILE_SPAN* spans = profile_spans(profile, table, &num_spans);
+
+	if (!spans)
+		return 0;
+
+	qsort(spans, num_spans, sizeof(PROFILE_SPAN), compare_spans);
+
+	fprintf(file, "%llu samples, %llu outside the code\n", profile->samples, profile->outside);
+	fprintf(file, "%12s %7s  %s\n", "samples", "%", "location");
+
+	for (size_t s = 0; s < num_spans; s++)
+	{
+		double percent = 100.0 * spans[s].hits / (profile->samples ? profile->samples : 1);
+
+		if (!table)
+		{
+			fprintf(file, "%12llu %6.2f%%  offset 0x%llx\n", spans[s].hits, percent, spans[s].offset);
+			continue;
+		}
+
+		const char* symbol = span_symbol(table, spans[s].offset);
+
+		fprintf(file, "%12llu %6.2f%%  %s:%llu%s%s%s\n", spans[s].hits, percent, table->source,
+			spans[s].line, symbol ? " (" : "", symbol ? symbol : "", symbol ? ")" : "");
+	}
+
+	free(spans);
+
+	return 1;
+}
+
+// writes a profile as folded stacks, one line of frames separated by ';' and a count per line of
+// source, for flame graph tools
+// frames are the source file, the symbol the line falls under and the line, or the offset
+// without a line table
+// returns 0 on allocation failure
+int write_folded_stacks(FILE* file, const MVM64_PROFILE* profile, const MVM64_LINE_TABLE* table)
+{
+	size_t num_spans;
+	PROFILE_SPAN* spans = profile_spans(profile, table, &num_spans);
+
+	if (!spans)
+		return 0;
+
+	for (size_t s = 0; s < num_spans; s++)
+	{
+		if (!table)
+		{
+			fprintf(file, "code;0x%llx %llu\n", spans[s].offset, spans[s].hits);
+			continue;
+		}
+
+		const char* symbol = span_symbol(table, spans[s].offset);
+
+		fprintf(file, "%s;%s;%s:%llu %llu\n", table->source, symbol ? symbol : "?", table->source,
+			spans[s].line, spans[s].hits);
+	}
+
+	if (profile->outside)
+		fprintf(file, "outside %llu\n", profile->outside);
+
+	free(spans);
+
+	return 1;
+}
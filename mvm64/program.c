@@ -0,0 +1,131 @@
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include "vm.h"
+#include "platform.h"
+
+// programs and lightweight VMs, for keeping very many mostly idle VMs resident
+// a program is immutable once created, so any number of VMs on any threads may share it
+// a VM is its registers, a reference to its program and a stack that is only allocated on the
+// first push, then doubled as it fills
+
+#define VM_STACK_INITIAL 4 // in INT64
+
+// copies code into a program, which starts with one reference
+// returns NULL on allocation failure
+MVM64_PROGRAM* create_program(const void* code, size_t code_size)
+{
+	MVM64_PROGRAM* program = calloc(1, sizeof(MVM64_PROGRAM));
+
+	if (!program)
+		return NULL;
+
+	program->code = malloc(code_size ? code_size : 1);
+
+	if (!program->code)
+	{
+		free(program);
+		return NULL;
+	}
+
+	memcpy(program->code, code, code_size);
+	program->code_size = code_size;
+	program->references = 1;
+
+	return program;
+}
+
+// adds a reference to a program
+// returns program
+MVM64_PROGRAM* retain_program(MVM64_PROGRAM* program)
+{
+	atomic_increment(&program->references);
+
+	return program;
+}
+
+// removes a reference to a program, freeing it when none remain
+void release_program(MVM64_PROGRAM* program)
+{
+	if (program == NULL || atomic_decrement(&program->references))
+		return;
+
+	free(program->code);
+	free(program);
+}
+
+// creates a VM at the start of a program, adding a reference to it
+// returns NULL on allocation failure
+MVM64_VM* create_vm(MVM64_PROGRAM* program)
+{
+	MVM64_VM* vm = calloc(1, sizeof(MVM64_VM));
+
+	if (!vm)
+		return NULL;
+
+	vm->program = retain_program(program);
+	vm->registers.s.I.u = (U64)program->code;
+
+	return vm;
+}
+
+void free_vm(MVM64_VM* vm)
+{
+	if (vm == NULL)
+		return;
+
+	if (vm->info.stack_size)
+		free((void*)(vm->info.stack_base + sizeof(INT64)));
+
+	release_program(vm->program);
+	free(vm);
+}
+
+// doubles the stack of a VM, up to STACK_SIZE, moving S and Z with it
+// returns 0 if the stack is at its limit or can't be reallocated
+int grow_vm_stack(MVM64_VM* vm)
+{
+	MVM64_REGISTERS* context = &vm->registers;
+	U64 size = vm->info.stack_size ? vm->info.stack_size * 2 : VM_STACK_INITIAL;
+	void* stack = vm->info.stack_size ? (void*)(vm->info.stack_base + sizeof(INT64)) : NULL;
+	U64 depth = vm->info.stack_size ? context->s.S.u - vm->info.stack_base : 0;
+
+	if (vm->info.stack_size >= STACK_SIZE)
+		return 0;
+
+	if (size > STACK_SIZE)
+		size = STACK_SIZE;
+
+	stack = realloc(stack, size * sizeof(INT64));
+
+	if (!stack)
+		return 0;
+
+	vm->info.stack_base = (U64)stack - sizeof(INT64);
+	vm->info.stack_size = size;
+	context->s.Z.u = vm->info.stack_base;
+	context->s.S.u = vm->info.stack_base + depth;
+
+	return 1;
+}
+
+// pushes a value onto the stack of a VM, growing it if needed
+// returns 0 if the stack is full
+int push_vm(MVM64_VM* vm, INT64 value)
+{
+	MVM64_REGISTERS* context = &vm->registers;
+
+	if (context->s.S.u - context->s.Z.u >= vm->info.stack_size * sizeof(INT64) &&
+		!grow_vm_stack(vm))
+		return 0;
+
+	push(value, context);
+
+	return 1;
+}
+
+// returns number of bytes of memory used by a VM itself, not counting its shared program
+size_t vm_footprint(const MVM64_VM* vm)
+{
+	return sizeof(MVM64_VM) + vm->info.stack_size * sizeof(INT64);
+}
@@ -0,0 +1,457 @@
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include "vm.h"
+#include "platform.h"
+
+// runs many VM threads on a pool of host worker threads
+// each worker owns a run queue of VM threads, runs the one at its head for a slice of
+// instructions and requeues it at the tail if it yielded, so the VM threads on a worker share it
+// round-robin
+// scheduled VM threads wait in the scheduler until workers with empty queues take their share
+// a worker that finds none left steals up to half of another worker's queue from the head
+// only its owner adds to a queue, and VM threads are taken from its head with a compare and swap,
+// so workers only take the scheduler's lock to pick up scheduled VM threads, to sleep, or to signal
+// that the last pending one finished
+
+#define QUEUE_INITIAL_SIZE 64 // in VM threads, must be a power of 2 and at least STEAL_BATCH
+#define STEAL_BATCH 64 // most VM threads taken in one steal
+
+// the slots of a run queue, followed by capacity VM thread pointers
+// slots a queue outgrows are kept until the scheduler is freed, as thieves may still be reading them
+typedef struct RUN_ARRAY
+{
+	struct RUN_ARRAY* previous; // slots this replaced, or NULL
+	size_t capacity; // power of 2
+} RUN_ARRAY;
+
+#define ARRAY_THREADS(array) ((MVM64_THREAD**)((RUN_ARRAY*)(array) + 1))
+
+// a ring buffer of runnable VM threads, owned by one worker
+// the VM threads are at indices top to bottom - 1, wrapped to the capacity
+typedef struct
+{
+	volatile U64 top; // index of the VM thread that runs next, advanced by whoever takes it
+	volatile U64 bottom; // index past the last VM thread, advanced only by the owner
+	RUN_ARRAY* volatile array;
+} RUN_QUEUE;
+
+typedef struct
+{
+	RUN_QUEUE queue;
+	MVM64_SCHEDULER* scheduler;
+	HOST_THREAD thread;
+	size_t index;
+	U8 padding[64]; // keeps the next worker's queue off the cache line this one's is on
+} WORKER;
+
+struct MVM64_SCHEDULER
+{
+	WORKER* workers;
+	size_t num_workers;
+	U64 slice_instructions;
+
+	volatile U64 pending; // VM threads scheduled but not yet finished
+	volatile U64 generation; // incremented under lock whenever VM threads are scheduled
+	volatile U64 shutdown; // set under lock
+
+	HOST_LOCK lock; // guards the fields below, and waiting on the conditions
+	HOST_CONDITION work; // signalled when VM threads are scheduled, or on shutdown
+	HOST_CONDITION done; // signalled when the last pending VM thread finishes
+	MVM64_THREAD** incoming; // VM threads scheduled but not yet taken by a worker
+	size_t incoming_capacity;
+	size_t first_incoming; // index in incoming of the first not yet taken
+	volatile U64 num_incoming; // not yet taken, also read without lock
+};
+
+// returns number of logical processors on the host, at least 1
+size_t count_processors()
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+
+	return info.dwNumberOfProcessors ? info.dwNumberOfProcessors : 1;
+#else
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return count > 0 ? (size_t)count : 1;
+#endif
+}
+
+// adds a VM thread to the tail of the calling worker's own queue, which must have a free slot
+static void queue_push(RUN_QUEUE* queue, MVM64_THREAD* thread)
+{
+	RUN_ARRAY* array = queue->array;
+	U64 bottom = queue->bottom;
+
+	atomic_write_pointer(&ARRAY_THREADS(array)[bottom & (array->capacity - 1)], thread);
+	atomic_write(&queue->bottom, bottom + 1);
+}
+
+// makes room for count more VM threads in the calling worker's own queue, growing it if needed
+// returns number of free slots, fewer than count if growing failed
+static size_t queue_reserve(RUN_QUEUE* queue, size_t count)
+{
+	RUN_ARRAY* array = queue->array;
+	U64 top = atomic_read(&queue->top);
+	size_t size = (size_t)(queue->bottom - top);
+	size_t capacity = array->capacity;
+
+	if (capacity - size >= count)
+		return capacity - size;
+
+	while (capacity - size < count)
+		capacity *= 2;
+
+	RUN_ARRAY* grown = malloc(sizeof(RUN_ARRAY) + capacity * sizeof(MVM64_THREAD*));
+
+	if (!grown)
+		return array->capacity - size;
+
+	grown->previous = array;
+	grown->capacity = capacity;
+
+	// VM threads taken meanwhile are copied too, but are behind top so are never taken again
+	for (U64 s = top; s != queue->bottom; s++)
+		ARRAY_THREADS(grown)[s & (capacity - 1)] = ARRAY_THREADS(array)[s & (array->capacity - 1)];
+
+	atomic_write_pointer(&queue->array, grown);
+
+	return capacity - size;
+}
+
+// removes up to half of the VM threads in a queue from its head, at most max
+// the owner takes the VM thread it runs next with a max of 1, and others steal with larger ones
+// returns number of VM threads taken
+static size_t queue_take(RUN_QUEUE* queue, MVM64_THREAD** taken, size_t max)
+{
+	while (1)
+	{
+		// top is read first, so bottom is never behind it
+		U64 top = atomic_read(&queue->top);
+		U64 bottom = atomic_read(&queue->bottom);
+		RUN_ARRAY* array = atomic_read_pointer(&queue->array);
+		size_t count = (size_t)(bottom - top + 1) / 2;
+
+		if (count > max)
+			count = max;
+
+		if (!count)
+			return 0;
+
+		for (size_t s = 0; s < count; s++)
+			taken[s] = atomic_read_pointer(&ARRAY_THREADS(array)[(top + s) & (array->capacity - 1)]);
+
+		// the VM threads read are only valid if no one else has taken any since
+		if (atomic_compare_swap(&queue->top, top, top + count))
+			return count;
+	}
+}
+
+// moves a worker's share of the VM threads scheduled but not yet taken into its empty queue
+// returns the first of them, for the worker to run, or NULL if there were none
+static MVM64_THREAD* take_incoming(WORKER* worker)
+{
+	MVM64_SCHEDULER* scheduler = worker->scheduler;
+	size_t share = (size_t)(atomic_read(&scheduler->num_incoming) + scheduler->num_workers - 1) /
+		scheduler->num_workers;
+	size_t room = queue_reserve(&worker->queue, share);
+	MVM64_THREAD* thread = NULL;
+
+	lock_acquire(&scheduler->lock);
+
+	size_t count = share < room ? share : room;
+
+	if (count > scheduler->num_incoming)
+		count = (size_t)scheduler->num_incoming;
+
+	if (count)
+	{
+		MVM64_THREAD** incoming = scheduler->incoming + scheduler->first_incoming;
+
+		thread = incoming[0];
+
+		for (size_t s = 1; s < count; s++)
+			queue_push(&worker->queue, incoming[s]);
+
+		scheduler->first_incoming += count;
+		atomic_write(&scheduler->num_incoming, scheduler->num_incoming - count);
+	}
+
+	lock_release(&scheduler->lock);
+
+	return thread;
+}
+
+// finds a VM thread for a worker to run, from its own queue, from the VM threads scheduled but not yet
+// taken, or by stealing from the others
+// more than one is only taken into the worker's queue with room reserved for them all, so that none
+// of them, or the one it runs, ever has to be queued again with no free slot
+// returns NULL if there is none anywhere
+static MVM64_THREAD* find_work(WORKER* worker)
+{
+	MVM64_SCHEDULER* scheduler = worker->scheduler;
+	MVM64_THREAD* stolen[STEAL_BATCH];
+	MVM64_THREAD* thread;
+
+	if (queue_take(&worker->queue, &thread, 1))
+		return thread;
+
+	if (atomic_read(&scheduler->num_incoming) && (thread = take_incoming(worker)))
+		return thread;
+
+	size_t room = queue_reserve(&worker->queue, STEAL_BATCH);
+
+	for (size_t s = 1; s < scheduler->num_workers; s++)
+	{
+		WORKER* victim = &scheduler->workers[(worker->index + s) % scheduler->num_workers];
+		size_t count = queue_take(&victim->queue, stolen, room < STEAL_BATCH ? room : STEAL_BATCH);
+
+		if (!count)
+			continue;
+
+		// run the first, and keep the rest
+		for (size_t t = 1; t < count; t++)
+			queue_push(&worker->queue, stolen[t]);
+
+		return stolen[0];
+	}
+
+	return NULL;
+}
+
+static void run_worker(WORKER* worker)
+{
+	MVM64_SCHEDULER* scheduler = worker->scheduler;
+
+	while (1)
+	{
+		U64 generation = atomic_read(&scheduler->generation);
+
+		if (atomic_read(&scheduler->shutdown))
+			return;
+
+		MVM64_THREAD* thread = find_work(worker);
+
+		if (!thread)
+		{
+			// sleep until more VM threads are scheduled, unless some were while searching
+			lock_acquire(&scheduler->lock);
+
+			while (atomic_read(&scheduler->generation) == generation && !atomic_read(&scheduler->shutdown))
+				condition_wait(&scheduler->work, &scheduler->lock);
+
+			lock_release(&scheduler->lock);
+			continue;
+		}
+
+		thread->status = execute_slice(thread->context, scheduler->slice_instructions,
+			&thread->bytes_executed, &thread->return_value);
+
+		// the slot the VM thread was taken from, or reserved for it, is still free
+		if (thread->status == MVM64_YIELDED)
+		{
+			queue_push(&worker->queue, thread);
+			continue;
+		}
+
+		// the lock orders the signal after wait_scheduler() has checked pending
+		if (atomic_decrement(&scheduler->pending) == 0)
+		{
+			lock_acquire(&scheduler->lock);
+			condition_broadcast(&scheduler->done);
+			lock_release(&scheduler->lock);
+		}
+	}
+}
+
+HOST_THREAD_ENTRY(worker_thread, run_worker, WORKER)
+
+// starts num_workers host threads to run VM threads on, or one per processor if 0
+// VM threads run for slice_instructions at a time before the worker moves on to the next
+// returns NULL on failure
+MVM64_SCHEDULER* create_scheduler(size_t num_workers, U64 slice_instructions)
+{
+	if (num_workers == 0)
+		num_workers = count_processors();
+
+	if (slice_instructions == 0)
+		return NULL;
+
+	MVM64_SCHEDULER* scheduler = calloc(1, sizeof(MVM64_SCHEDULER));
+
+	if (!scheduler)
+		return NULL;
+
+	scheduler->workers = calloc(num_workers, sizeof(WORKER));
+
+	if (!scheduler->workers)
+	{
+		free(scheduler);
+		return NULL;
+	}
+
+	scheduler->slice_instructions = slice_instructions;
+
+	lock_init(&scheduler->lock);
+	condition_init(&scheduler->work);
+	condition_init(&scheduler->done);
+
+	scheduler->incoming_capacity = QUEUE_INITIAL_SIZE;
+	scheduler->incoming = malloc(QUEUE_INITIAL_SIZE * sizeof(MVM64_THREAD*));
+
+	if (!scheduler->incoming)
+	{
+		free_scheduler(scheduler);
+		return NULL;
+	}
+
+	// queues must all exist before any worker can steal from them
+	for (size_t s = 0; s < num_workers; s++)
+	{
+		WORKER* worker = &scheduler->workers[s];
+
+		worker->scheduler = scheduler;
+		worker->index = s;
+		worker->queue.array = malloc(sizeof(RUN_ARRAY) + QUEUE_INITIAL_SIZE * sizeof(MVM64_THREAD*));
+
+		scheduler->num_workers++;
+
+		if (!worker->queue.array)
+		{
+			free_scheduler(scheduler);
+			return NULL;
+		}
+
+		worker->queue.array->previous = NULL;
+		worker->queue.array->capacity = QUEUE_INITIAL_SIZE;
+	}
+
+	for (size_t s = 0; s < num_workers; s++)
+	{
+		WORKER* worker = &scheduler->workers[s];
+
+		if (!thread_start(&worker->thread, worker_thread, worker))
+		{
+			// stop the workers that did start, which free_scheduler() will then join
+			memset(&worker->thread, 0, sizeof(HOST_THREAD));
+			free_scheduler(scheduler);
+			return NULL;
+		}
+	}
+
+	return scheduler;
+}
+
+// stops the workers and frees the scheduler, leaving unfinished VM threads as they were after
+// their last slice
+void free_scheduler(MVM64_SCHEDULER* scheduler)
+{
+	if (scheduler == NULL)
+		return;
+
+	lock_acquire(&scheduler->lock);
+	atomic_write(&scheduler->shutdown, 1);
+	condition_broadcast(&scheduler->work);
+	lock_release(&scheduler->lock);
+
+	for (size_t s = 0; s < scheduler->num_workers; s++)
+	{
+		WORKER* worker = &scheduler->workers[s];
+
+		if (worker->thread)
+			thread_join(worker->thread);
+	}
+
+	// queues are only freed once no worker can be stealing from them
+	for (size_t s = 0; s < scheduler->num_workers; s++)
+	{
+		RUN_ARRAY* array = scheduler->workers[s].queue.array;
+
+		while (array)
+		{
+			RUN_ARRAY* previous = array->previous;
+
+			free(array);
+			array = previous;
+		}
+	}
+
+	condition_free(&scheduler->work);
+	condition_free(&scheduler->done);
+	lock_free(&scheduler->lock);
+
+	free(scheduler->incoming);
+	free(scheduler->workers);
+	free(scheduler);
+}
+
+// prepares a VM thread to run code on context
+void init_thread(MVM64_THREAD* thread, MVM64_REGISTERS* context, const void* code)
+{
+	thread->context = context;
+	thread->status = MVM64_YIELDED;
+	thread->bytes_executed = 0;
+	thread->return_value.u = 0;
+
+	context->s.I.u = (U64)code;
+}
+
+// queues VM threads to run until they finish, for the workers to share out
+// the VM threads must stay valid until wait_scheduler() returns
+// returns 0 on allocation failure, after which none of them are queued
+int schedule_threads(MVM64_SCHEDULER* scheduler, MVM64_THREAD* threads, size_t num_threads)
+{
+	lock_acquire(&scheduler->lock);
+
+	size_t count = (size_t)scheduler->num_incoming;
+
+	// move the VM threads not yet taken to the start, and grow if there's still no room after them
+	if (scheduler->first_incoming + count + num_threads > scheduler->incoming_capacity)
+	{
+		memmove(scheduler->incoming, scheduler->incoming + scheduler->first_incoming,
+			count * sizeof(MVM64_THREAD*));
+		scheduler->first_incoming = 0;
+
+		size_t capacity = scheduler->incoming_capacity;
+
+		while (capacity < count + num_threads)
+			capacity *= 2;
+
+		MVM64_THREAD** incoming = realloc(scheduler->incoming, capacity * sizeof(MVM64_THREAD*));
+
+		if (!incoming)
+		{
+			lock_release(&scheduler->lock);
+			return 0;
+		}
+
+		scheduler->incoming = incoming;
+		scheduler->incoming_capacity = capacity;
+	}
+
+	for (size_t s = 0; s < num_threads; s++)
+		scheduler->incoming[scheduler->first_incoming + count + s] = &threads[s];
+
+	// count the VM threads as pending before any worker can take them
+	atomic_add(&scheduler->pending, num_threads);
+	atomic_write(&scheduler->num_incoming, count + num_threads);
+	atomic_increment(&scheduler->generation);
+	condition_broadcast(&scheduler->work);
+
+	lock_release(&scheduler->lock);
+
+	return 1;
+}
+
+// waits until every scheduled VM thread has finished
+void wait_scheduler(MVM64_SCHEDULER* scheduler)
+{
+	lock_acquire(&scheduler->lock);
+
+	while (atomic_read(&scheduler->pending))
+		condition_wait(&scheduler->done, &scheduler->lock);
+
+	lock_release(&scheduler->lock);
+}
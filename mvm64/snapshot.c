@@ -0,0 +1,310 @@
+#ifdef __linux__
+#define _GNU_SOURCE // memfd_create
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vm.h"
+#include "pages.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+// snapshots of contexts, for running a long common prefix once and then forking any number of
+// contexts from the state it left
+// guest memory is copied once, when the snapshot is taken, into an unnamed shared backing that
+// leaves out pages that are all zero, and each fork maps the backing copy-on-write, so a fork
+// costs a mapping and then a page copy for each page it writes
+// the stack is copied, as it's small, up to the values actually pushed
+
+struct MVM64_SNAPSHOT
+{
+	MVM64_REGISTERS registers; // S and Z as offsets from the stack base, I as a guest address if in memory
+	int code_in_memory; // nonzero if I was within the memory
+	U64 stack_size; // of the context, in INT64
+	U64 flags; // CONTEXT_GUARDED and CONTEXT_GROW of the context
+	INT64* stack; // values pushed above Z, in order
+	U64 depth; // number of values pushed
+
+	U64 memory_size; // in bytes, or 0 if the context had no memory
+	U64 mapping_size; // of the memory, in bytes
+#ifdef _WIN32
+	HANDLE section;
+#else
+	int fd;
+#endif
+};
+
+#ifdef _WIN32
+// creates the backing of a snapshot, holding a copy of memory
+// returns 0 on failure
+static int create_backing(MVM64_SNAPSHOT* snapshot, const MVM64_MEMORY* memory)
+{
+	snapshot->section = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+		(DWORD)(memory->mapping_size >> 32), (DWORD)memory->mapping_size, NULL);
+
+	if (!snapshot->section)
+		return 0;
+
+	U8* view = MapViewOfFile(snapshot->section, FILE_MAP_WRITE, 0, 0, (SIZE_T)memory->mapping_size);
+
+	if (!view)
+	{
+		CloseHandle(snapshot->section);
+		snapshot->section = NULL;
+		return 0;
+	}
+
+	// pages of the section that are never written stay uncommitted
+	for (U64 offset = 0; offset < memory->mapping_size; offset += MEMORY_PAGE)
+	{
+		size_t size = (size_t)(memory->mapping_size - offset < MEMORY_PAGE ? memory->mapping_size - offset : MEMORY_PAGE);
+
+		if (!zero_page(memory->base + offset, size))
+			memcpy(view + offset, memory->base + offset, size);
+	}
+
+	UnmapViewOfFile(view);
+
+	return 1;
+}
+
+static void free_backing(MVM64_SNAPSHOT* snapshot)
+{
+	if (snapshot->section)
+		CloseHandle(snapshot->section);
+}
+
+// returns a copy-on-write mapping of the backing of a snapshot, or NULL on failure
+static U8* map_backing(const MVM64_SNAPSHOT* snapshot)
+{
+	return MapViewOfFile(snapshot->section, FILE_MAP_COPY, 0, 0, (SIZE_T)snapshot->mapping_size);
+}
+#else
+static int open_backing()
+{
+#ifdef __linux__
+	return memfd_create("mvm64-snapshot", MFD_CLOEXEC);
+#else
+	static volatile U64 counter;
+	char name[64];
+
+	snprintf(name, sizeof(name), "/mvm64-%ld-%llu", (long)getpid(),
+		(unsigned long long)__sync_add_and_fetch(&counter, 1));
+
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+
+	if (fd >= 0)
+		shm_unlink(name);
+
+	return fd;
+#endif
+}
+
+// creates the backing of a snapshot, holding a copy of memory
+// returns 0 on failure
+static int create_backing(MVM64_SNAPSHOT* snapshot, const MVM64_MEMORY* memory)
+{
+	snapshot->fd = open_backing();
+
+	if (snapshot->fd < 0)
+		return 0;
+
+	if (ftruncate(snapshot->fd, (off_t)memory->mapping_size))
+		goto fail;
+
+	// runs of pages that aren't all zero are written at once, and the rest left as holes
+	for (U64 offset = 0; offset < memory->mapping_size;)
+	{
+		U64 end = offset;
+
+		while (end < memory->mapping_size)
+		{
+			size_t size = (size_t)(memory->mapping_size - end < MEMORY_PAGE ? memory->mapping_size - end : MEMORY_PAGE);
+
+			if (zero_page(memory->base + end, size))
+				break;
+
+			end += size;
+		}
+
+		while (offset < end)
+		{
+			ssize_t written = pwrite(snapshot->fd, memory->base + offset, (size_t)(end - offset), (off_t)offset);
+
+			if (written <= 0)
+				goto fail;
+
+			offset += (U64)written;
+		}
+
+		offset += MEMORY_PAGE;
+	}
+
+	return 1;
+
+fail:
+	close(snapshot->fd);
+	snapshot->fd = -1;
+
+	return 0;
+}
+
+static void free_backing(MVM64_SNAPSHOT* snapshot)
+{
+	if (snapshot->fd >= 0)
+		close(snapshot->fd);
+}
+
+// returns a copy-on-write mapping of the backing of a snapshot, or NULL on failure
+static U8* map_backing(const MVM64_SNAPSHOT* snapshot)
+{
+	void* base = mmap(NULL, (size_t)snapshot->mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+		snapshot->fd, 0);
+
+	return base == MAP_FAILED ? NULL : base;
+}
+#endif
+
+// saves the registers, stack and guest memory of a context, which is left as it was
+// registers are saved as they are, apart from S, Z and an I within guest memory, so any that
+// hold host addresses of the stack or memory aren't valid on forks
+// returns NULL on failure, or if S isn't within the stack
+MVM64_SNAPSHOT* snapshot_context(const MVM64_REGISTERS* context)
+{
+	const MVM64_CONTEXT_INFO* info = CONTEXT_INFO(context);
+	U64 depth = (context->s.S.u - info->stack_base) / sizeof(INT64);
+
+	if (context->s.S.u < info->stack_base || depth > info->stack_size)
+		return NULL;
+
+	MVM64_SNAPSHOT* snapshot = calloc(1, sizeof(MVM64_SNAPSHOT));
+
+	if (!snapshot)
+		return NULL;
+
+#ifndef _WIN32
+	snapshot->fd = -1;
+#endif
+	snapshot->registers = *context;
+	snapshot->registers.s.S.u = depth * sizeof(INT64);
+	snapshot->registers.s.Z.u = 0;
+	snapshot->stack_size = info->stack_size;
+	snapshot->flags = info->flags & (CONTEXT_GUARDED | CONTEXT_GROW);
+	snapshot->depth = depth;
+	snapshot->stack = malloc(depth ? (size_t)depth * sizeof(INT64) : 1);
+
+	if (!snapshot->stack)
+	{
+		free(snapshot);
+		return NULL;
+	}
+
+	memcpy(snapshot->stack, (void*)(info->stack_base + sizeof(INT64)), (size_t)depth * sizeof(INT64));
+
+	if (info->memory)
+	{
+		snapshot->memory_size = info->memory->size;
+		snapshot->mapping_size = info->memory->mapping_size;
+
+		if (!create_backing(snapshot, info->memory))
+		{
+			free_snapshot(snapshot);
+			return NULL;
+		}
+
+		if (context->s.I.u - (U64)info->memory->base < info->memory->mapping_size)
+		{
+			snapshot->code_in_memory = 1;
+			snapshot->registers.s.I.u -= (U64)info->memory->base;
+		}
+	}
+
+	return snapshot;
+}
+
+// frees a snapshot, which contexts forked from it may outlive
+void free_snapshot(MVM64_SNAPSHOT* snapshot)
+{
+	if (snapshot == NULL)
+		return;
+
+	free_backing(snapshot);
+	free(snapshot->stack);
+	free(snapshot);
+}
+
+typedef struct
+{
+	MVM64_REGISTERS* context;
+	const MVM64_SNAPSHOT* snapshot;
+} STACK_COPY;
+
+// pushes the stack of a snapshot, under call_guarded() so a growing stack commits its pages
+static void copy_stack(void* argument)
+{
+	STACK_COPY* copy = argument;
+
+	memcpy((void*)(copy->context->s.Z.u + sizeof(INT64)), copy->snapshot->stack,
+		(size_t)copy->snapshot->depth * sizeof(INT64));
+	copy->context->s.S.u += copy->snapshot->depth * sizeof(INT64);
+}
+
+// creates a context in the state a snapshot was taken in, with a stack of the same size and kind
+// guest memory is a copy-on-write mapping of the snapshot's, owned and freed by the context, so
+// no page of it is copied until written
+// returns NULL on failure
+MVM64_REGISTERS* fork_context(const MVM64_SNAPSHOT* snapshot)
+{
+	MVM64_REGISTERS* context = create_context_stack((size_t)snapshot->stack_size, snapshot->flags);
+
+	if (!context)
+		return NULL;
+
+	MVM64_CONTEXT_INFO* info = CONTEXT_INFO(context);
+	STACK_COPY copy;
+
+	*context = snapshot->registers;
+	context->s.S.u = info->stack_base;
+	context->s.Z.u = info->stack_base;
+
+	copy.context = context;
+	copy.snapshot = snapshot;
+
+	if (call_guarded(context, copy_stack, &copy) != MVM64_OK)
+	{
+		free_context(context);
+		return NULL;
+	}
+
+	if (snapshot->memory_size)
+	{
+		MVM64_MEMORY* memory = calloc(1, sizeof(MVM64_MEMORY));
+
+		if (!memory || !(memory->base = map_backing(snapshot)))
+		{
+			free(memory);
+			free_context(context);
+			return NULL;
+		}
+
+		memory->size = snapshot->memory_size;
+		memory->mask = snapshot->memory_size - 1;
+		memory->mapping_size = snapshot->mapping_size;
+		memory->flags = MEMORY_VIEW;
+
+		attach_memory(context, memory);
+		info->flags |= CONTEXT_OWN_MEMORY;
+
+		if (snapshot->code_in_memory)
+			context->s.I.u += (U64)memory->base;
+	}
+
+	return context;
+}
@@ -0,0 +1,285 @@
+#include <stdlib.h>
+#include <string.h>
+#include "vm.h"
+#include "platform.h"
+
+#ifndef _WIN32
+#include <signal.h>
+#include <setjmp.h>
+#include <sys/mman.h>
+#endif
+
+// guarded stacks, for contexts that need more stack than STACK_SIZE without paying for a bounds
+// check on every PUSH and POP
+// a guarded context is mapped as
+// [registers, stack info and mapping][low guard page][stack pages][high guard page]
+// with Z one slot below the first stack page, so POP from an empty stack reads the low guard page
+// and PUSH onto a full one writes the high guard page
+// call_guarded() turns the fault into a stack error, or with CONTEXT_GROW, commits the stack pages
+// as they're first touched and carries on
+
+// the first page of a guarded context
+typedef struct
+{
+	MVM64_REGISTERS registers;
+	MVM64_CONTEXT_INFO info;
+	size_t mapping_size; // in bytes, including the guard pages
+	size_t committed; // bytes of the stack that are accessible, from its start
+} GUARDED_STACK;
+
+// a call_guarded() in progress on this thread
+typedef struct GUARD_FRAME
+{
+	GUARDED_STACK* stack;
+	struct GUARD_FRAME* previous;
+#ifndef _WIN32
+	sigjmp_buf env;
+#endif
+} GUARD_FRAME;
+
+static THREAD_LOCAL GUARD_FRAME* guard_frames;
+
+static size_t page_size()
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+
+	return info.dwPageSize;
+#else
+	return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+// makes bytes of stack from the start of the stack accessible
+// returns 0 on failure
+static int commit_stack(GUARDED_STACK* stack, size_t bytes)
+{
+	void* start = (void*)(stack->info.stack_base + sizeof(INT64));
+
+#ifdef _WIN32
+	if (!VirtualAlloc(start, bytes, MEM_COMMIT, PAGE_READWRITE))
+		return 0;
+#else
+	if (mprotect(start, bytes, PROT_READ | PROT_WRITE))
+		return 0;
+#endif
+
+	stack->committed = bytes;
+
+	return 1;
+}
+
+// handles a fault at address while running on a guarded stack
+// returns MVM64_OK if the fault was in a stack page that has now been committed, a stack error if
+// it was in a guard page, or NUM_STATUSES if it was outside the stack
+static MVM64_STATUS handle_fault(GUARDED_STACK* stack, U64 address)
+{
+	size_t page = page_size();
+	U64 start = stack->info.stack_base + sizeof(INT64);
+	U64 end = start + stack->info.stack_size * sizeof(INT64);
+
+	if (address < start - page || address >= end + page)
+		return NUM_STATUSES;
+
+	if (address < start)
+		return MVM64_ERROR_STACK_UNDERFLOW;
+
+	if (address >= end)
+		return MVM64_ERROR_STACK_OVERFLOW;
+
+	// the stack is committed contiguously, up to and including the faulting page
+	if ((stack->info.flags & CONTEXT_GROW) && address >= start + stack->committed &&
+		commit_stack(stack, (size_t)(address - start) / page * page + page))
+		return MVM64_OK;
+
+	return MVM64_ERROR_STACK_OVERFLOW;
+}
+
+// creates a context whose stack is mapped between guard pages (see create_context_stack)
+// returns NULL on failure
+MVM64_REGISTERS* create_guarded_context(size_t stack_size, U64 flags)
+{
+	size_t page = page_size();
+	size_t stack_bytes = (stack_size * sizeof(INT64) + page - 1) / page * page;
+	size_t mapping_size = page + page + stack_bytes + page;
+
+	if (sizeof(GUARDED_STACK) > page || stack_size > ((size_t)-1 - 3 * page) / sizeof(INT64))
+		return NULL;
+
+#ifdef _WIN32
+	GUARDED_STACK* stack = VirtualAlloc(NULL, mapping_size, MEM_RESERVE, PAGE_NOACCESS);
+
+	if (!stack)
+		return NULL;
+
+	if (!VirtualAlloc(stack, page, MEM_COMMIT, PAGE_READWRITE))
+	{
+		VirtualFree(stack, 0, MEM_RELEASE);
+		return NULL;
+	}
+#else
+	GUARDED_STACK* stack = mmap(NULL, mapping_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+		-1, 0);
+
+	if (stack == MAP_FAILED)
+		return NULL;
+
+	if (mprotect(stack, page, PROT_READ | PROT_WRITE))
+	{
+		munmap(stack, mapping_size);
+		return NULL;
+	}
+#endif
+
+	stack->info.stack_base = (U64)stack + page + page - sizeof(INT64);
+	stack->info.stack_size = stack_bytes / sizeof(INT64);
+	stack->info.flags = CONTEXT_GUARDED | (flags & CONTEXT_GROW);
+	stack->mapping_size = mapping_size;
+	stack->committed = 0;
+
+	if (!commit_stack(stack, flags & CONTEXT_GROW ? page : stack_bytes))
+	{
+		free_guarded_context(&stack->registers);
+		return NULL;
+	}
+
+	reset_context(&stack->registers);
+
+	return &stack->registers;
+}
+
+void free_guarded_context(MVM64_REGISTERS* context)
+{
+#ifdef _WIN32
+	VirtualFree(context, 0, MEM_RELEASE);
+#else
+	munmap(context, ((GUARDED_STACK*)context)->mapping_size);
+#endif
+}
+
+// returns nonzero if this thread is running a call_guarded() on context
+int guarding_context(const MVM64_REGISTERS* context)
+{
+	for (GUARD_FRAME* frame = guard_frames; frame; frame = frame->previous)
+	{
+		if (&frame->stack->registers == context)
+			return 1;
+	}
+
+	return 0;
+}
+
+#ifdef _WIN32
+static int guard_filter(EXCEPTION_POINTERS* exception, GUARDED_STACK* stack, MVM64_STATUS* status)
+{
+	if (exception->ExceptionRecord->ExceptionCode != EXCEPTION_ACCESS_VIOLATION)
+		return EXCEPTION_CONTINUE_SEARCH;
+
+	*status = handle_fault(stack, (U64)exception->ExceptionRecord->ExceptionInformation[1]);
+
+	if (*status == MVM64_OK)
+		return EXCEPTION_CONTINUE_EXECUTION;
+
+	return *status == NUM_STATUSES ? EXCEPTION_CONTINUE_SEARCH : EXCEPTION_EXECUTE_HANDLER;
+}
+#else
+static struct sigaction previous_segv;
+static struct sigaction previous_bus;
+static pthread_once_t handlers_installed = PTHREAD_ONCE_INIT;
+
+static void guard_handler(int signal, siginfo_t* info, void* ucontext)
+{
+	struct sigaction* previous = signal == SIGSEGV ? &previous_segv : &previous_bus;
+
+	for (GUARD_FRAME* frame = guard_frames; frame; frame = frame->previous)
+	{
+		MVM64_STATUS status = handle_fault(frame->stack, (U64)info->si_addr);
+
+		if (status == MVM64_OK)
+			return;
+
+		if (status != NUM_STATUSES)
+			siglongjmp(frame->env, status);
+	}
+
+	// not a guarded stack fault, so pass it on as if this handler weren't installed
+	if (previous->sa_flags & SA_SIGINFO)
+		previous->sa_sigaction(signal, info, ucontext);
+	else if (previous->sa_handler != SIG_DFL && previous->sa_handler != SIG_IGN)
+		previous->sa_handler(signal);
+	else
+		sigaction(signal, previous, NULL); // the faulting instruction runs again, and faults with it
+}
+
+static void install_handlers()
+{
+	struct sigaction action;
+
+	memset(&action, 0, sizeof(action));
+	action.sa_sigaction = guard_handler;
+	action.sa_flags = SA_SIGINFO | SA_NODEFER;
+	sigemptyset(&action.sa_mask);
+
+	sigaction(SIGSEGV, &action, &previous_segv);
+	sigaction(SIGBUS, &action, &previous_bus);
+}
+#endif
+
+// calls function(argument), turning a fault in the guard pages of context's stack into an error,
+// and growing the stack on a fault in its uncommitted pages if it has CONTEXT_GROW
+// function must not keep resources it would need to free, as it is abandoned at the fault
+// returns MVM64_OK if function returned, or the stack error that ended it
+MVM64_STATUS call_guarded(MVM64_REGISTERS* context, void (*function)(void*), void* argument)
+{
+	GUARD_FRAME frame;
+
+	if (!(CONTEXT_INFO(context)->flags & CONTEXT_GUARDED))
+	{
+		function(argument);
+		return MVM64_OK;
+	}
+
+	frame.stack = (GUARDED_STACK*)context;
+	frame.previous = guard_frames;
+
+#ifdef _WIN32
+	MVM64_STATUS status = MVM64_OK;
+
+	guard_frames = &frame;
+
+	__try
+	{
+		function(argument);
+	}
+	__except (guard_filter(GetExceptionInformation(), (GUARDED_STACK*)context, &status))
+	{
+	}
+#else
+	pthread_once(&handlers_installed, install_handlers);
+
+	// the signal mask isn't saved, which would cost a system call on every call
+	MVM64_STATUS status = (MVM64_STATUS)sigsetjmp(frame.env, 0);
+
+	if (status == MVM64_OK)
+	{
+		guard_frames = &frame;
+		function(argument);
+	}
+	else
+	{
+		// the handler runs with SA_NODEFER, but unblock the signals in case the handler was run
+		// through a wrapper that blocked them anyway
+		sigset_t signals;
+
+		sigemptyset(&signals);
+		sigaddset(&signals, SIGSEGV);
+		sigaddset(&signals, SIGBUS);
+		pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
+	}
+#endif
+
+	guard_frames = frame.previous;
+
+	return status;
+}
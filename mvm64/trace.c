@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vm.h"
+#include "platform.h"
+
+// binary execution traces, for seeing what a context did without a debugger
+// contexts with CONTEXT_TRACE set in their info (see set_context_trace()) record each instruction the instruction at a time
+// engines (execute(), execute_slice(), step() and execute_sandboxed()) run into the trace set on
+// the running thread, a fixed size ring that keeps the most recent records
+// each thread has its own ring, so recording takes no locks, and nothing is formatted until the
+// trace is written out and decoded offline (see mvm64trace)
+
+#define TRACE_MIN_CAPACITY 64
+
+static THREAD_LOCAL MVM64_TRACE* thread_trace;
+
+// creates a trace keeping the last capacity records, rounded up to a power of 2
+// returns NULL on failure
+MVM64_TRACE* create_trace(size_t capacity)
+{
+	size_t size = TRACE_MIN_CAPACITY;
+
+	while (size < capacity)
+	{
+		if (size > ((size_t)-1 >> 1) / sizeof(MVM64_TRACE_RECORD))
+			return NULL;
+
+		size <<= 1;
+	}
+
+	MVM64_TRACE* trace = calloc(1, sizeof(MVM64_TRACE));
+
+	if (!trace)
+		return NULL;
+
+	trace->records = calloc(size, sizeof(MVM64_TRACE_RECORD));
+
+	if (!trace->records)
+	{
+		free(trace);
+		return NULL;
+	}
+
+	trace->mask = size - 1;
+
+	return trace;
+}
+
+// frees a trace, which must not be set on any thread
+void free_trace(MVM64_TRACE* trace)
+{
+	if (trace == NULL)
+		return;
+
+	free(trace->records);
+	free(trace);
+}
+
+// sets the trace that contexts running on this thread record into, or NULL to record nothing
+// a trace must only be set on one thread at a time
+// returns the trace that was set before
+MVM64_TRACE* set_thread_trace(MVM64_TRACE* trace)
+{
+	MVM64_TRACE* previous = thread_trace;
+
+	thread_trace = trace;
+
+	return previous;
+}
+
+// turns recording of context's instructions into the trace of the thread running it on or off
+void set_context_trace(MVM64_REGISTERS* context, int enabled)
+{
+	if (enabled)
+		CONTEXT_INFO(context)->flags |= CONTEXT_TRACE;
+	else
+		CONTEXT_INFO(context)->flags &= ~(U64)CONTEXT_TRACE;
+}
+
+// records an instruction about to run on context into this thread's trace, if it has one
+// a and b are the decoded operands, either of which may be NULL
+void trace_instruction(const MVM64_REGISTERS* context, U8 instruction, const INT64* a, const INT64* b)
+{
+	MVM64_TRACE* trace = thread_trace;
+
+	if (!trace)
+		return;
+
+	MVM64_TRACE_RECORD* record = &trace->records[trace->next & trace->mask];
+
+	record->address = (context->s.I.u & 0x00FFFFFFFFFFFFFFull) | ((U64)instruction << 56);
+	record->a.u = a ? a->u : 0;
+	record->b.u = b ? b->u : 0;
+	record->r = context->s.R;
+	trace->next++;
+}
+
+// writes the records kept by a trace, oldest first, with addresses made relative to code_base
+// returns 0 on failure
+int write_trace(FILE* file, const MVM64_TRACE* trace, U64 code_base)
+{
+	MVM64_TRACE_HEADER header;
+	U64 capacity = trace->mask + 1;
+	U64 count = trace->next < capacity ? trace->next : capacity;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.version = TRACE_VERSION;
+	header.record_size = sizeof(MVM64_TRACE_RECORD);
+	header.code_base = code_base;
+	header.num_records = count;
+	header.dropped = trace->next - count;
+
+	if (fwrite(&header, sizeof(header), 1, file) != 1)
+		return 0;
+
+	for (U64 n = trace->next - count; n < trace->next; n++)
+	{
+		MVM64_TRACE_RECORD record = trace->records[n & trace->mask];
+
+		record.address = ((TRACE_ADDRESS(&record) - code_base) & 0x00FFFFFFFFFFFFFFull) |
+			(record.address & ~0x00FFFFFFFFFFFFFFull);
+
+		if (fwrite(&record, sizeof(record), 1, file) != 1)
+			return 0;
+	}
+
+	return 1;
+}
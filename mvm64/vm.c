@@ -1,12 +1,9 @@
 #include <stdlib.h>
+#include <string.h>
 #include <malloc.h>
 #include <assert.h>
 #include "vm.h"
 
-#ifdef _DEBUG
-#include <stdio.h> // debug output
-#endif
-
 const char* INSTRUCTIONS[NUM_INSTRUCTIONS] = {
 	"ADD",
 	"SUB",
@@ -23,17 +20,22 @@ const char* INSTRUCTIONS[NUM_INSTRUCTIONS] = {
 	"COMP",
 	"PUSH",
 	"POP",
-	"RET"
+	"RET",
+	"STORE",
+	"LOADB",
+	"STOREB"
 };
 
-// global variables for exec_instruction
-U8 ins;
-INT64* OP_A;
-INT64 OP_A_LOCAL;
-INT64* OP_B;
-INT64 OP_B_LOCAL;
-U8 OPA_SIZE;
-U8 OPB_SIZE;
+const U8 FORM_SIZES[NUM_FORMS] = {
+	sizeof(U8), // FORM_REGISTER
+	sizeof(U8),
+	sizeof(I8),
+	sizeof(U16),
+	sizeof(I16),
+	sizeof(U32),
+	sizeof(I32),
+	sizeof(INT64)
+};
 
 // gets number of operands for a command
 size_t operand_count(U8 command)
@@ -53,6 +55,9 @@ size_t operand_count(U8 command)
 	case DREF:
 	case LADR:
 	case COMP:
+	case STORE:
+	case LOADB:
+	case STOREB:
 		needed = 2;
 		break;
 
@@ -74,122 +79,349 @@ size_t operand_count(U8 command)
 	return needed;
 }
 
-__inline INT64* get_register(const INT8 code, MVM64_REGISTERS* context)
+// returns nonzero if the instruction stores a result in operand A
+int writes_operand_a(U8 command)
 {
-	assert(code.u < NUM_REGISTERS);
+	switch (command)
+	{
+	case ADD:
+	case SUB:
+	case MUL:
+	case DIV:
+	case AND:
+	case OR:
+	case XOR:
+	case MOV:
+	case DREF:
+	case LADR:
+	case COMP:
+	case POP:
+	case LOADB:
+		return 1;
+	}
 
-	return &(context->a[code.u]);
+	return 0;
 }
 
-// returns number of bytes executed, or U64_MAX if execution has ended
-// note - no pointer safety check
-__inline U64 exec_instruction(MVM64_REGISTERS* context)
+// bounds for sandboxed execution, fixed when it starts so that the code cannot move them
+typedef struct
 {
-	U64 bytes_executed;
-	ins = *(U8*)(context->s.I.u);
-	OPA_SIZE = 0, OPB_SIZE = 0;
+	MVM64_SANDBOX* sandbox;
+	U64 code;
+	U64 code_size;
+	U64 stack; // base of the stack, which Z may not be changed from
+	U64 stack_size; // in INT64
+	const MVM64_REGISTERS* context;
+} SANDBOX_BOUNDS;
+
+// checks an instruction in the extended form, as check_instruction() does
+static MVM64_STATUS check_extended(const U8* code, size_t code_size, U64 offset)
+{
+	U8 op = INSTRUCTION_BASE(code[offset]);
+	size_t num_ops = operand_count(op);
+	U64 pos = offset + sizeof(U8);
 
-#ifdef _DEBUG
-	printf("exec_instruction: starting from 0x%llx\n", context->s.I.u);
-#endif
+	if (op >= NUM_INSTRUCTIONS)
+		return MVM64_ERROR_INSTRUCTION;
 
-	if ((INSTRUCTION_BASE(ins)) == RET)
-	{
-#ifdef _DEBUG
-		printf(" - Returning...");
-#endif
+	if (pos >= code_size)
+		return MVM64_ERROR_CODE_BOUNDS;
 
-		return U64_MAX;
-	}
+	U8 form = code[pos];
 
-	size_t num_ops = operand_count(INSTRUCTION_BASE(ins));
+	pos += sizeof(form);
 
-#ifdef _DEBUG
-	printf("Instruction %s, %llu operands\n", INSTRUCTIONS[INSTRUCTION_BASE(ins)], num_ops);
-#endif
+	if ((form & FORM_RESERVED) || (num_ops < 2 && FORM_B(form) != FORM_REGISTER))
+		return MVM64_ERROR_INSTRUCTION;
 
-	if (INSTRUCTION_VALA(ins))
+	// LADR of an inline value narrower than 64-bit would be the address of a local copy
+	if (op == LADR && FORM_B(form) != FORM_REGISTER && FORM_B(form) != FORM_64)
+		return MVM64_ERROR_INSTRUCTION;
+
+	for (size_t s = 0; s < num_ops; s++)
 	{
-#ifdef _DEBUG
-		printf(" - Operand A is a value, pulling value from 0x%llx\n", context->s.I.u + sizeof(ins));
-#endif
+		U8 operand = s ? FORM_B(form) : FORM_A(form);
 
-		if (INSTRUCTION_SMALL(ins))
+		if (operand == FORM_REGISTER)
 		{
-			OP_A_LOCAL.u = *(U8*)(context->s.I.u + sizeof(ins));
-			OP_A = &OP_A_LOCAL;
-
-			OPA_SIZE = sizeof(U8);
-#ifdef _DEBUG
-			printf(" - Operand A: 0x%llx (8-bit)\n", OP_A->u);
-#endif
+			if (pos >= code_size)
+				return MVM64_ERROR_CODE_BOUNDS;
 
+			if (code[pos] >= NUM_REGISTERS || (s == 0 && code[pos] == REGISTER_Z && writes_operand_a(op)))
+				return MVM64_ERROR_INSTRUCTION;
 		}
-		else
-		{
-			OP_A = (INT64*)(context->s.I.u + sizeof(ins));
 
-			OPA_SIZE = sizeof(INT64);
-#ifdef _DEBUG
-			printf(" - Operand A: 0x%llx (64-bit)\n", OP_A->u);
-#endif
-		}
+		pos += FORM_SIZES[operand];
+	}
+
+	if (pos > code_size)
+		return MVM64_ERROR_CODE_BOUNDS;
+
+	return MVM64_OK;
+}
+
+// checks that the instruction at offset is within the code and has valid operands, using the
+// same decoding rules as exec_instruction
+MVM64_STATUS check_instruction(const void* code_ptr, size_t code_size, U64 offset)
+{
+	const U8* code = (const U8*)code_ptr;
+
+	if (offset >= code_size)
+		return MVM64_ERROR_CODE_BOUNDS;
+
+	U8 ins = code[offset];
+	U8 op = INSTRUCTION_BASE(ins);
+	size_t num_ops = operand_count(op);
+	U64 pos = offset + sizeof(ins);
+	U64 value_size = INSTRUCTION_SMALL(ins) ? sizeof(U8) : sizeof(INT64);
+
+	if (op == RET)
+		return MVM64_OK;
+
+	// the opcode bits can hold more instructions than are defined
+	if (op >= NUM_INSTRUCTIONS)
+		return MVM64_ERROR_INSTRUCTION;
+
+	if (INSTRUCTION_EXTENDED(ins) && num_ops > 0)
+		return check_extended(code, code_size, offset);
+
+	if (INSTRUCTION_VALA(ins))
+	{
+		pos += value_size;
 	}
 	else if (num_ops > 0)
 	{
-#ifdef _DEBUG
-		printf(" - Operand A: Register %u\n", *(U8*)((context->s.I.u) + sizeof(ins)));
-#endif
+		if (pos >= code_size)
+			return MVM64_ERROR_CODE_BOUNDS;
 
-		OP_A = get_register(*(INT8*)(context->s.I.u + sizeof(ins)), context);
+		if (code[pos] >= NUM_REGISTERS ||
+			(code[pos] == REGISTER_Z && writes_operand_a(op)))
+			return MVM64_ERROR_INSTRUCTION;
 
-		OPA_SIZE = sizeof(INT8);
+		pos += sizeof(U8);
 	}
 
 	if (INSTRUCTION_VALB(ins))
 	{
-#ifdef _DEBUG
-		printf(" - Operand B is a value, pulling value from 0x%llx\n", context->s.I.u + sizeof(ins) + OPA_SIZE);
-#endif
+		// LADR of an inline 8-bit value would be the address of a local copy
+		if (op == LADR && INSTRUCTION_SMALL(ins))
+			return MVM64_ERROR_INSTRUCTION;
 
-		if (INSTRUCTION_SMALL(ins))
-		{
-			OP_B_LOCAL.u = *(U8*)(context->s.I.u + sizeof(ins) + OPA_SIZE);
-			OP_B = &OP_B_LOCAL;
+		pos += value_size;
+	}
+	else if (num_ops > 1)
+	{
+		if (pos < code_size && code[pos] >= NUM_REGISTERS)
+			return MVM64_ERROR_INSTRUCTION;
+
+		pos += sizeof(U8);
+	}
+
+	if (pos > code_size)
+		return MVM64_ERROR_CODE_BOUNDS;
+
+	return MVM64_OK;
+}
+
+// returns nonzero if size bytes at address lie within the region at base
+static __inline int in_region(U64 address, U64 size, U64 base, U64 region_size)
+{
+	return address >= base && address - base <= region_size && region_size - (address - base) >= size;
+}
+
+// returns nonzero if sandboxed code may write size bytes at address, which must be on the stack
+static int check_store(const SANDBOX_BOUNDS* bounds, U64 address, U64 size)
+{
+	return in_region(address, size, bounds->stack + sizeof(INT64), bounds->stack_size * sizeof(INT64));
+}
+
+// returns nonzero if sandboxed code may read size bytes from address, which may also be in the
+// registers, the code or the data region
+static int check_data(const SANDBOX_BOUNDS* bounds, U64 address, U64 size)
+{
+	return in_region(address, size, (U64)bounds->context, sizeof(MVM64_REGISTERS)) ||
+		check_store(bounds, address, size) ||
+		in_region(address, size, bounds->code, bounds->code_size) ||
+		(bounds->sandbox->data &&
+			in_region(address, size, (U64)bounds->sandbox->data, bounds->sandbox->data_size));
+}
+
+__inline INT64* get_register(const INT8 code, MVM64_REGISTERS* context)
+{
+	assert(code.u < NUM_REGISTERS);
+
+	return &(context->a[code.u]);
+}
+
+// gets an operand of the extended form at address, extending a value narrower than 64-bit into
+// local
+static __inline INT64* get_operand(U8 form, U64 address, INT64* local, MVM64_REGISTERS* context)
+{
+	switch (form)
+	{
+	case FORM_REGISTER:
+		return get_register(*(INT8*)address, context);
+
+	case FORM_U8:
+		local->u = *(U8*)address;
+		return local;
+
+	case FORM_I8:
+		local->i = *(I8*)address;
+		return local;
 
-#ifdef _DEBUG
-			printf(" - Operand B: 0x%llx (8-bit)\n", OP_B->u);
+	case FORM_U16:
+		local->u = *(U16*)address;
+		return local;
+
+	case FORM_I16:
+		local->i = *(I16*)address;
+		return local;
+
+	case FORM_U32:
+		local->u = *(U32*)address;
+		return local;
+
+	case FORM_I32:
+		local->i = *(I32*)address;
+		return local;
+	}
+
+	return (INT64*)address;
+}
+
+// exec_instruction is inlined into each caller so that the sandbox checks are compiled out of
+// those that pass no bounds
+#ifdef _MSC_VER
+#define FORCE_INLINE __forceinline
+#else
+#define FORCE_INLINE __inline __attribute__((always_inline))
 #endif
 
-			OPB_SIZE = sizeof(U8);
-		}
-		else
-		{
-			OP_B = (INT64*)(context->s.I.u + sizeof(ins) + OPA_SIZE);
+// stops sandboxed execution with an error
+#define SANDBOX_FAIL(error) \
+	{ \
+		bounds->sandbox->status = (error); \
+		return 0; \
+	}
 
-#ifdef _DEBUG
-			printf(" - Operand B: 0x%llx (64-bit)\n", OP_B->u);
+// returns number of bytes executed, or U64_MAX if execution has ended
+// note - no pointer safety check unless bounds is given, which execute() and step() pass as
+// NULL so that the checks are compiled out of them
+// all decode state is local so that separate contexts may execute concurrently
+static FORCE_INLINE U64 exec_instruction(MVM64_REGISTERS* context, const SANDBOX_BOUNDS* bounds)
+{
+	if (bounds && !(bounds->sandbox->flags & SANDBOX_VERIFIED))
+	{
+		MVM64_STATUS status = check_instruction((const void*)bounds->code, bounds->code_size,
+			context->s.I.u - bounds->code);
+
+		if (status != MVM64_OK)
+			SANDBOX_FAIL(status);
+	}
+
+	U64 bytes_executed;
+	U8 ins = *(U8*)(context->s.I.u);
+	INT64* OP_A = NULL;
+	INT64 OP_A_LOCAL;
+	INT64* OP_B = NULL;
+	INT64 OP_B_LOCAL;
+	U8 OPA_SIZE = 0, OPB_SIZE = 0, FORM_SIZE = 0;
+
+#ifdef MVM64_WITH_STATS
+	MVM64_STATS* stats = CONTEXT_INFO(context)->stats;
+
+	if (stats && (INSTRUCTION_BASE(ins)) < NUM_INSTRUCTIONS)
+	{
+		stats->instructions[INSTRUCTION_BASE(ins)]++;
+		stats->flags[ins >> 5]++;
+	}
 #endif
 
-			OPB_SIZE = sizeof(U64);
+	if ((INSTRUCTION_BASE(ins)) == RET)
+	{
+		if (CONTEXT_INFO(context)->flags & CONTEXT_TRACE)
+			trace_instruction(context, ins, NULL, NULL);
+
+		return U64_MAX;
+	}
+
+	size_t num_ops = operand_count(INSTRUCTION_BASE(ins));
+
+	if (INSTRUCTION_EXTENDED(ins) && num_ops > 0)
+	{
+		U8 form = *(U8*)(context->s.I.u + sizeof(ins));
+		U64 operands = context->s.I.u + sizeof(ins) + sizeof(form);
+
+		FORM_SIZE = sizeof(form);
+
+		OP_A = get_operand(FORM_A(form), operands, &OP_A_LOCAL, context);
+		OPA_SIZE = FORM_SIZES[FORM_A(form)];
+
+		if (num_ops > 1)
+		{
+			OP_B = get_operand(FORM_B(form), operands + OPA_SIZE, &OP_B_LOCAL, context);
+			OPB_SIZE = FORM_SIZES[FORM_B(form)];
 		}
 	}
-	else if (num_ops > 1)
+	else
 	{
-#ifdef _DEBUG
-		printf(" - Operand B: Register %u\n", *(U8*)(context->s.I.u + sizeof(ins) + OPA_SIZE));
-#endif
+		if (INSTRUCTION_VALA(ins))
+		{
+			if (INSTRUCTION_SMALL(ins))
+			{
+				// 8-bit jump displacements are signed, so short jumps can go backwards
+				if ((INSTRUCTION_BASE(ins)) == JMP || (INSTRUCTION_BASE(ins)) == JZR)
+					OP_A_LOCAL.i = *(I8*)(context->s.I.u + sizeof(ins));
+				else
+					OP_A_LOCAL.u = *(U8*)(context->s.I.u + sizeof(ins));
+
+				OP_A = &OP_A_LOCAL;
+
+				OPA_SIZE = sizeof(U8);
+			}
+			else
+			{
+				OP_A = (INT64*)(context->s.I.u + sizeof(ins));
+
+				OPA_SIZE = sizeof(INT64);
+			}
+		}
+		else if (num_ops > 0)
+		{
+			OP_A = get_register(*(INT8*)(context->s.I.u + sizeof(ins)), context);
 
-		OP_B = get_register(*(INT8*)(context->s.I.u + sizeof(ins) + OPA_SIZE), context);
+			OPA_SIZE = sizeof(INT8);
+		}
+
+		if (INSTRUCTION_VALB(ins))
+		{
+			if (INSTRUCTION_SMALL(ins))
+			{
+				OP_B_LOCAL.u = *(U8*)(context->s.I.u + sizeof(ins) + OPA_SIZE);
+				OP_B = &OP_B_LOCAL;
+
+				OPB_SIZE = sizeof(U8);
+			}
+			else
+			{
+				OP_B = (INT64*)(context->s.I.u + sizeof(ins) + OPA_SIZE);
+
+				OPB_SIZE = sizeof(U64);
+			}
+		}
+		else if (num_ops > 1)
+		{
+			OP_B = get_register(*(INT8*)(context->s.I.u + sizeof(ins) + OPA_SIZE), context);
 
-		OPB_SIZE = sizeof(U8);
+			OPB_SIZE = sizeof(U8);
+		}
 	}
 
-	bytes_executed = sizeof(ins) + OPA_SIZE + OPB_SIZE;
+	bytes_executed = sizeof(ins) + FORM_SIZE + OPA_SIZE + OPB_SIZE;
 
-#ifdef _DEBUG
-	printf(" - Instruction: %u\n", INSTRUCTION_BASE(ins));
-#endif
+	if (CONTEXT_INFO(context)->flags & CONTEXT_TRACE)
+		trace_instruction(context, ins, OP_A, OP_B);
 
 	switch (INSTRUCTION_BASE(ins))
 	{
@@ -206,6 +438,9 @@ __inline U64 exec_instruction(MVM64_REGISTERS* context)
 		break;
 
 	case DIV:
+		if (bounds && (OP_B->i == 0 || (OP_B->i == -1 && OP_A->u == 0x8000000000000000)))
+			SANDBOX_FAIL(MVM64_ERROR_DIVIDE);
+
 		OP_A->i /= OP_B->i;
 		break;
 
@@ -230,6 +465,16 @@ __inline U64 exec_instruction(MVM64_REGISTERS* context)
 		return bytes_executed;
 
 	case JZR:
+#ifdef MVM64_WITH_STATS
+		if (stats)
+		{
+			if (!context->s.R.u)
+				stats->jzr_taken++;
+			else
+				stats->jzr_not_taken++;
+		}
+#endif
+
 		if (!context->s.R.u)
 		{
 			context->s.I.u += OP_A->i;
@@ -237,35 +482,113 @@ __inline U64 exec_instruction(MVM64_REGISTERS* context)
 		}
 		break;
 
+	// with guest memory, addresses can't reach outside of it, so the sandbox needn't check them
 	case DREF:
-		*OP_A = *(INT64*)(OP_B->u);
+	{
+		MVM64_MEMORY* memory = CONTEXT_INFO(context)->memory;
+
+		if (bounds && !memory && !check_data(bounds, OP_B->u, sizeof(INT64)))
+			SANDBOX_FAIL(MVM64_ERROR_DATA_BOUNDS);
+
+		*OP_A = *(INT64*)DATA_POINTER(memory, OP_B->u);
 		break;
+	}
 
 	case LADR:
-		OP_A->u = (U64)OP_B;
+	{
+		MVM64_MEMORY* memory = CONTEXT_INFO(context)->memory;
+
+		// registers and code outside of guest memory have no guest address
+		if (memory && (U64)OP_B - (U64)memory->base >= memory->size)
+		{
+			if (bounds)
+				SANDBOX_FAIL(MVM64_ERROR_DATA_BOUNDS);
+
+			return 0;
+		}
+
+		OP_A->u = memory ? (U64)OP_B - (U64)memory->base : (U64)OP_B;
 		break;
+	}
+
+	case STORE:
+	{
+		MVM64_MEMORY* memory = CONTEXT_INFO(context)->memory;
+
+		if (bounds && !memory && !check_store(bounds, OP_A->u, sizeof(INT64)))
+			SANDBOX_FAIL(MVM64_ERROR_DATA_BOUNDS);
+
+		*(INT64*)DATA_POINTER(memory, OP_A->u) = *OP_B;
+		break;
+	}
+
+	case LOADB:
+	{
+		MVM64_MEMORY* memory = CONTEXT_INFO(context)->memory;
+
+		if (bounds && !memory && !check_data(bounds, OP_B->u, sizeof(U8)))
+			SANDBOX_FAIL(MVM64_ERROR_DATA_BOUNDS);
+
+		OP_A->u = *DATA_POINTER(memory, OP_B->u);
+		break;
+	}
+
+	case STOREB:
+	{
+		MVM64_MEMORY* memory = CONTEXT_INFO(context)->memory;
+
+		if (bounds && !memory && !check_store(bounds, OP_A->u, sizeof(U8)))
+			SANDBOX_FAIL(MVM64_ERROR_DATA_BOUNDS);
+
+		*DATA_POINTER(memory, OP_A->u) = (U8)OP_B->u;
+		break;
+	}
 
 	case COMP:
 		OP_A->u = ~(OP_B->u);
 		break;
 
 	case PUSH:
-		// check for stack overflow
-		assert(((context->s.S.u - context->s.Z.u) / sizeof(INT64)) < STACK_SIZE);
+		// S may be written by the code, so sandboxed execution checks the slot pushed to
+		if (bounds && !in_region(context->s.S.u + sizeof(INT64), sizeof(INT64), bounds->stack + sizeof(INT64),
+			bounds->stack_size * sizeof(INT64)))
+			SANDBOX_FAIL(MVM64_ERROR_STACK_OVERFLOW);
+
+		// check for stack overflow, which the guard page catches on a guarded stack
+		assert((CONTEXT_INFO(context)->flags & CONTEXT_GUARDED) ||
+			((context->s.S.u - context->s.Z.u) / sizeof(INT64)) < CONTEXT_INFO(context)->stack_size);
 
 		context->s.S.u += sizeof(INT64);
 		*(INT64*)context->s.S.u = *OP_A;
+
+#ifdef MVM64_WITH_STATS
+		if (stats && (context->s.S.u - context->s.Z.u) / sizeof(INT64) > stats->stack_high_water)
+			stats->stack_high_water = (context->s.S.u - context->s.Z.u) / sizeof(INT64);
+#endif
 		break;
 
 	case POP:
+		if (bounds && !in_region(context->s.S.u, sizeof(INT64), bounds->stack + sizeof(INT64),
+			bounds->stack_size * sizeof(INT64)))
+			SANDBOX_FAIL(context->s.S.u == bounds->stack ? MVM64_ERROR_STACK_UNDERFLOW : MVM64_ERROR_STACK_OVERFLOW);
+
 		// check that there's something on the stack
-		assert(context->s.S.u - context->s.Z.u);
+		assert((CONTEXT_INFO(context)->flags & CONTEXT_GUARDED) || context->s.S.u - context->s.Z.u);
+
+#ifdef MVM64_WITH_STATS
+		// values pushed by the host count once they're popped
+		if (stats && (context->s.S.u - context->s.Z.u) / sizeof(INT64) > stats->stack_high_water)
+			stats->stack_high_water = (context->s.S.u - context->s.Z.u) / sizeof(INT64);
+#endif
 
 		*OP_A = *(INT64*)context->s.S.u;
 		context->s.S.u -= sizeof(INT64);
 		break;
 
 	default:
+		if (bounds)
+			SANDBOX_FAIL(MVM64_ERROR_INSTRUCTION);
+
 		return 0;
 	}
 
@@ -274,24 +597,254 @@ __inline U64 exec_instruction(MVM64_REGISTERS* context)
 	return bytes_executed;
 }
 
+#undef SANDBOX_FAIL
+
+// arguments and result of an execution run by call_guarded(), for contexts with guarded stacks
+typedef struct
+{
+	const void* code;
+	size_t code_size;
+	MVM64_REGISTERS* context;
+	MVM64_SANDBOX* sandbox;
+	U64 max_instructions;
+	U64* bytes_executed;
+	INT64* return_value;
+	U64 result;
+} GUARDED_EXECUTION;
+
+static void execute_guarded(GUARDED_EXECUTION* execution)
+{
+	execution->result = execute(execution->code, execution->context, execution->return_value);
+}
+
+static void execute_slice_guarded(GUARDED_EXECUTION* execution)
+{
+	execution->result = execute_slice(execution->context, execution->max_instructions,
+		execution->bytes_executed, execution->return_value);
+}
+
+static void execute_sandboxed_guarded(GUARDED_EXECUTION* execution)
+{
+	execution->result = execute_sandboxed(execution->code, execution->code_size, execution->context,
+		execution->sandbox, execution->return_value);
+}
+
+// a context with a guarded stack runs under call_guarded(), so that a fault in its guard pages
+// ends the run rather than the process
 U64 execute(const void* code, MVM64_REGISTERS* context, INT64* return_value)
 {
 	U64 bytes_executed = 0;
 
+	if ((CONTEXT_INFO(context)->flags & CONTEXT_GUARDED) && !guarding_context(context))
+	{
+		GUARDED_EXECUTION execution = { code, 0, context, NULL, 0, NULL, return_value, 0 };
+
+		if (call_guarded(context, (void (*)(void*))execute_guarded, &execution) != MVM64_OK)
+		{
+			return_value->u = 0;
+			return 0;
+		}
+
+		return execution.result;
+	}
+
 	context->s.I.u = (U64)code;
 
 	while (1)
 	{
-		U64 instruction_size = exec_instruction(context);
+		U64 instruction_size = exec_instruction(context, NULL);
+
+		if (instruction_size == 0)
+		{
+			return_value->u = 0;
+			return 0;
+		}
+
+		if (instruction_size == U64_MAX)
+		{
+			*return_value = context->s.R;
+			return bytes_executed + sizeof(U8);
+		}
+
+		bytes_executed += instruction_size;
+	}
+}
+
+// executes from I until RET, such as on a context read from a checkpoint
+// returns number of bytes executed, or 0 on error
+U64 execute_resume(MVM64_REGISTERS* context, INT64* return_value)
+{
+	return execute((const void*)context->s.I.u, context, return_value);
+}
+
+// executes the single instruction at I, for callers that drive execution themselves
+// returns number of bytes executed, U64_MAX if execution has ended, or 0 on error
+U64 step(MVM64_REGISTERS* context)
+{
+	return exec_instruction(context, NULL);
+}
+
+// executes up to max_instructions from I, so that long-running code can be interleaved with other
+// work on the same thread
+// I must hold the address of the code before the first slice, and is left at the next instruction,
+// so a later slice on the same context continues from there
+// adds the number of bytes executed to *bytes_executed, which over all slices of a run totals the
+// value execute() would return
+// returns MVM64_YIELDED if the slice ended before RET, MVM64_OK on RET with the return value set,
+// or MVM64_ERROR_INSTRUCTION on error, or a stack error if a guarded stack faults, when the bytes
+// executed in the slice aren't counted
+MVM64_STATUS execute_slice(MVM64_REGISTERS* context, U64 max_instructions, U64* bytes_executed,
+	INT64* return_value)
+{
+	U64 bytes = 0;
+
+	if ((CONTEXT_INFO(context)->flags & CONTEXT_GUARDED) && !guarding_context(context))
+	{
+		GUARDED_EXECUTION execution = { NULL, 0, context, NULL, max_instructions, bytes_executed,
+			return_value, 0 };
+		MVM64_STATUS status = call_guarded(context, (void (*)(void*))execute_slice_guarded, &execution);
+
+		if (status != MVM64_OK)
+		{
+			return_value->u = 0;
+			return status;
+		}
+
+		return (MVM64_STATUS)execution.result;
+	}
+
+	for (U64 s = 0; s < max_instructions; s++)
+	{
+		U64 instruction_size = exec_instruction(context, NULL);
 
 		if (instruction_size == 0)
 		{
+			*bytes_executed += bytes;
+			return_value->u = 0;
+			return MVM64_ERROR_INSTRUCTION;
+		}
+
+		if (instruction_size == U64_MAX)
+		{
+			*bytes_executed += bytes + sizeof(U8);
+			*return_value = context->s.R;
+			return MVM64_OK;
+		}
+
+		bytes += instruction_size;
+	}
+
+	*bytes_executed += bytes;
+
+	return MVM64_YIELDED;
+}
+
+// executes up to max_instructions of a VM from I, as execute_slice(), growing its stack as PUSH
+// needs it
+// returns as execute_slice(), or MVM64_ERROR_STACK_OVERFLOW/UNDERFLOW if PUSH finds the stack at
+// its limit or POP finds it empty, leaving I at that instruction
+MVM64_STATUS run_vm(MVM64_VM* vm, U64 max_instructions, U64* bytes_executed, INT64* return_value)
+{
+	MVM64_REGISTERS* context = &vm->registers;
+	MVM64_STATUS status = MVM64_YIELDED;
+	U64 bytes = 0;
+
+	for (U64 s = 0; s < max_instructions; s++)
+	{
+		U8 op = INSTRUCTION_BASE(*(U8*)context->s.I.u);
+		U64 depth = context->s.S.u - context->s.Z.u;
+
+		if (op == PUSH && depth >= vm->info.stack_size * sizeof(INT64) && !grow_vm_stack(vm))
+		{
+			status = MVM64_ERROR_STACK_OVERFLOW;
+			break;
+		}
+
+		if (op == POP && (!depth || !vm->info.stack_size))
+		{
+			status = MVM64_ERROR_STACK_UNDERFLOW;
+			break;
+		}
+
+		U64 instruction_size = exec_instruction(context, NULL);
+
+		if (instruction_size == 0)
+		{
+			status = MVM64_ERROR_INSTRUCTION;
+			break;
+		}
+
+		if (instruction_size == U64_MAX)
+		{
+			bytes += sizeof(U8);
+			*return_value = context->s.R;
+			status = MVM64_OK;
+			break;
+		}
+
+		bytes += instruction_size;
+	}
+
+	*bytes_executed += bytes;
+
+	if (status != MVM64_OK)
+		return_value->u = 0;
+
+	return status;
+}
+
+// executes untrusted code within the limits of sandbox, which records why execution stopped
+// the context's stack bounds the stack, and Z may not be written by the code
+// returns number of bytes executed, or 0 on error
+U64 execute_sandboxed(const void* code, size_t code_size, MVM64_REGISTERS* context,
+	MVM64_SANDBOX* sandbox, INT64* return_value)
+{
+	SANDBOX_BOUNDS bounds;
+	U64 bytes_executed = 0;
+
+	if ((CONTEXT_INFO(context)->flags & CONTEXT_GUARDED) && !guarding_context(context))
+	{
+		GUARDED_EXECUTION execution = { code, code_size, context, sandbox, 0, NULL, return_value, 0 };
+		MVM64_STATUS status = call_guarded(context, (void (*)(void*))execute_sandboxed_guarded, &execution);
+
+		if (status != MVM64_OK)
+		{
+			sandbox->status = status;
 			return_value->u = 0;
 			return 0;
 		}
 
+		return execution.result;
+	}
+
+	bounds.sandbox = sandbox;
+	bounds.code = (U64)code;
+	bounds.code_size = code_size;
+	bounds.stack = CONTEXT_INFO(context)->stack_base;
+	bounds.stack_size = CONTEXT_INFO(context)->stack_size;
+	bounds.context = context;
+
+	context->s.I.u = (U64)code;
+	return_value->u = 0;
+
+	while (1)
+	{
+		if (!sandbox->fuel)
+		{
+			sandbox->status = MVM64_ERROR_FUEL;
+			return 0;
+		}
+
+		sandbox->fuel--;
+
+		U64 instruction_size = exec_instruction(context, &bounds);
+
+		if (instruction_size == 0)
+			return 0;
+
 		if (instruction_size == U64_MAX)
 		{
+			sandbox->status = MVM64_OK;
 			*return_value = context->s.R;
 			return bytes_executed + sizeof(U8);
 		}
@@ -300,20 +853,68 @@ U64 execute(const void* code, MVM64_REGISTERS* context, INT64* return_value)
 	}
 }
 
+// contexts are allocated as one block holding the registers followed by the stack, aligned to
+// and padded out to whole cache lines so that contexts used by different threads share none
+#ifdef _MSC_VER
+#define aligned_block_alloc(size) _aligned_malloc(size, CACHE_LINE_SIZE)
+#define aligned_block_free(block) _aligned_free(block)
+#else
+#define aligned_block_alloc(size) aligned_alloc(CACHE_LINE_SIZE, size)
+#define aligned_block_free(block) free(block)
+#endif
+
+// rounds size up to a whole number of cache lines
+#define CACHE_LINES(size) (((size) + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1))
+
+// the stack info follows the registers, and the stack starts on the next cache line
+// the stack has a slot beyond its size, as PUSH writes above S and never uses the slot at Z
+#define CONTEXT_STACK_OFFSET CACHE_LINES(sizeof(MVM64_REGISTERS) + sizeof(MVM64_CONTEXT_INFO))
+#define CONTEXT_BLOCK_SIZE(stack_size) CACHE_LINES(CONTEXT_STACK_OFFSET + ((stack_size) + 1) * sizeof(INT64))
+
+// sets up the stack info of a context allocated as a block of CONTEXT_BLOCK_SIZE(stack_size)
+static void init_context(MVM64_REGISTERS* context, size_t stack_size)
+{
+	CONTEXT_INFO(context)->stack_base = (U64)context + CONTEXT_STACK_OFFSET;
+	CONTEXT_INFO(context)->stack_size = stack_size;
+	CONTEXT_INFO(context)->flags = 0;
+	CONTEXT_INFO(context)->memory = NULL;
+	CONTEXT_INFO(context)->stats = NULL;
+
+	reset_context(context);
+}
+
+// clears the registers of a context and empties its stack
+void reset_context(MVM64_REGISTERS* context)
+{
+	memset(context, 0, sizeof(MVM64_REGISTERS));
+
+	context->s.S.u = CONTEXT_INFO(context)->stack_base;
+	context->s.Z.u = CONTEXT_INFO(context)->stack_base;
+}
+
 MVM64_REGISTERS* create_context()
 {
-	MVM64_REGISTERS* reg = calloc(1, sizeof(MVM64_REGISTERS));
+	return create_context_stack(STACK_SIZE, 0);
+}
 
-	if (!reg)
+// creates a context with a stack of stack_size values
+// flags may give CONTEXT_GUARDED to map the stack between guard pages, and CONTEXT_GROW to commit
+// its pages only as they're used, when the size is rounded up to whole pages
+// returns NULL on failure
+MVM64_REGISTERS* create_context_stack(size_t stack_size, U64 flags)
+{
+	if (stack_size == 0 || stack_size > ((size_t)-1 - CONTEXT_STACK_OFFSET) / sizeof(INT64) - 2)
 		return NULL;
 
-	void* stack = malloc(STACK_SIZE * sizeof(INT64));
+	if (flags & CONTEXT_GUARDED)
+		return create_guarded_context(stack_size, flags);
+
+	MVM64_REGISTERS* reg = aligned_block_alloc(CONTEXT_BLOCK_SIZE(stack_size));
 
-	if (!stack)
+	if (!reg)
 		return NULL;
 
-	reg->s.S.u = (U64)stack;
-	reg->s.Z.u = (U64)stack;
+	init_context(reg, stack_size);
 
 	return reg;
 }
@@ -323,8 +924,86 @@ void free_context(MVM64_REGISTERS* context)
 	if (context == NULL)
 		return;
 
-	free((void*)context->s.Z.u);
-	free(context);
+	if (CONTEXT_INFO(context)->flags & CONTEXT_OWN_MEMORY)
+		free_memory(CONTEXT_INFO(context)->memory);
+
+	if (CONTEXT_INFO(context)->flags & CONTEXT_GUARDED)
+		free_guarded_context(context);
+	else
+		aligned_block_free(context);
+}
+
+// allocates num_contexts contexts in a single block, to be taken and returned without further
+// allocation
+// a pool is not thread safe, but its contexts may each be used on a different thread
+// returns NULL on allocation failure
+MVM64_CONTEXT_POOL* create_context_pool(size_t num_contexts)
+{
+	MVM64_CONTEXT_POOL* pool = calloc(1, sizeof(MVM64_CONTEXT_POOL));
+
+	if (!pool)
+		return NULL;
+
+	pool->arena = aligned_block_alloc((num_contexts ? num_contexts : 1) * CONTEXT_BLOCK_SIZE(STACK_SIZE));
+	pool->free = malloc((num_contexts ? num_contexts : 1) * sizeof(MVM64_REGISTERS*));
+
+	if (!pool->arena || !pool->free)
+	{
+		free_context_pool(pool);
+		return NULL;
+	}
+
+	pool->num_contexts = num_contexts;
+
+	// taken in address order
+	for (size_t s = 0; s < num_contexts; s++)
+	{
+		pool->free[s] = (MVM64_REGISTERS*)(pool->arena + (num_contexts - 1 - s) * CONTEXT_BLOCK_SIZE(STACK_SIZE));
+		init_context(pool->free[s], STACK_SIZE);
+	}
+
+	pool->num_free = num_contexts;
+
+	return pool;
+}
+
+// frees a pool and every context in it, whether or not they were returned
+void free_context_pool(MVM64_CONTEXT_POOL* pool)
+{
+	if (pool == NULL)
+		return;
+
+	if (pool->arena)
+		aligned_block_free(pool->arena);
+
+	free(pool->free);
+	free(pool);
+}
+
+// takes a reset context from a pool, with no memory attached and not traced
+// returns NULL if every context is in use
+MVM64_REGISTERS* acquire_context(MVM64_CONTEXT_POOL* pool)
+{
+	if (!pool->num_free)
+		return NULL;
+
+	MVM64_REGISTERS* context = pool->free[--pool->num_free];
+
+	reset_context(context);
+	attach_memory(context, NULL);
+	set_context_trace(context, 0);
+	CONTEXT_INFO(context)->stats = NULL;
+
+	return context;
+}
+
+// returns a context taken from a pool, which must not be passed to free_context()
+void release_context(MVM64_CONTEXT_POOL* pool, MVM64_REGISTERS* context)
+{
+	if (context == NULL)
+		return;
+
+	pool->free[pool->num_free++] = context;
 }
 
 void push(INT64 value, MVM64_REGISTERS* context)
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdio.h>
+
 #ifndef NULL
 #define NULL 0
 #endif
@@ -9,6 +11,10 @@
 
 typedef unsigned long long U64;
 typedef signed long long   I64;
+typedef unsigned int       U32;
+typedef signed int         I32;
+typedef unsigned short     U16;
+typedef signed short       I16;
 typedef unsigned char       U8;
 typedef signed char         I8;
 
@@ -25,7 +31,11 @@ typedef union
 } INT8;
 
 #define NUM_REGISTERS 13
+#define REGISTER_R 8 // index of return value register
+#define REGISTER_Z 10 // index of stack base pointer register
+#define REGISTER_I 11 // index of instruction pointer register
 #define STACK_SIZE 128 // in INT64
+#define CACHE_LINE_SIZE 64 // in bytes, which contexts are aligned to
 
 typedef struct
 {
@@ -50,7 +60,49 @@ typedef union
 	INT64 a[NUM_REGISTERS];
 } MVM64_REGISTERS;
 
-typedef INT64 MVM64_THREAD;
+// a guest linear memory, which DREF, LADR, STORE, LOADB and STOREB address in place of host
+// memory on contexts it's attached to (see memory.c)
+typedef struct
+{
+	U8* base; // host address of guest address 0
+	U64 mask; // guest addresses wrap at the size, a power of 2
+	U64 size; // in bytes
+	U64 mapping_size; // in bytes, including slack past the end for accesses that straddle it
+	U64 flags; // MEMORY_* flags
+} MVM64_MEMORY;
+
+#define MEMORY_SLACK sizeof(INT64) // mapped past the end, for an access at the last guest addresses
+
+// the memory is a copy-on-write mapping of a snapshot or checkpoint (see snapshot.c)
+#define MEMORY_VIEW (1<<0)
+
+// host address of a guest address, which may be accessed for up to 8 bytes
+#define GUEST_POINTER(memory, address) ((memory)->base + ((address) & (memory)->mask))
+// host address of data at an address that is a guest address if memory isn't NULL
+#define DATA_POINTER(memory, address) ((memory) ? GUEST_POINTER(memory, address) : (U8*)(address))
+
+// describes the stack and memory of a context, and is stored directly after its registers
+typedef struct
+{
+	U64 stack_base; // value of S and Z with the stack empty, PUSH writes from the slot above it
+	U64 stack_size; // number of slots above the base, in INT64
+	U64 flags; // CONTEXT_* flags
+	MVM64_MEMORY* memory; // guest memory, or NULL to address host memory
+	struct MVM64_STATS* stats; // counters to update, or NULL, only with MVM64_WITH_STATS
+} MVM64_CONTEXT_INFO;
+
+#define CONTEXT_INFO(context) ((MVM64_CONTEXT_INFO*)((MVM64_REGISTERS*)(context) + 1))
+
+// the stack is mapped between inaccessible guard pages, so that overflow and underflow fault
+// rather than being checked, and the fault is turned into an error by execute() (see stack.c)
+#define CONTEXT_GUARDED (1<<0)
+// with CONTEXT_GUARDED, stack pages are only committed as the stack grows into them
+#define CONTEXT_GROW (1<<1)
+// free_context() also frees the attached memory, as on contexts made by fork_context()
+#define CONTEXT_OWN_MEMORY (1<<2)
+// instructions are recorded in the trace set on the running thread, if any (see trace.c)
+#define CONTEXT_TRACE (1<<3)
+
 
 typedef enum
 {
@@ -70,26 +122,422 @@ typedef enum
 	PUSH,
 	POP,
 	RET,
+	STORE,
+	LOADB,
+	STOREB,
 	NUM_INSTRUCTIONS
 } INSTRUCTION;
 
+// handlers for decoded instructions beyond the base instructions (see image.c)
+// superinstructions run a fixed sequence of consecutive instructions in one dispatch
+typedef enum
+{
+	DECODED_INVALID = NUM_INSTRUCTIONS, // undecodable instruction or end of code
+	FUSED_JZR_JMP, // JZR, JMP
+	FUSED_SUB_JZR, // SUB, JZR (decrement and branch if zero)
+	FUSED_SUB_JZR_JMP, // SUB, JZR, JMP
+	FUSED_XOR_JZR, // XOR, JZR (compare and branch if equal)
+	FUSED_XOR_JZR_JMP, // XOR, JZR, JMP
+	FUSED_MOV_XOR_JZR, // MOV, XOR, JZR (compare a copy and branch if equal)
+	FUSED_MOV_XOR_JZR_JMP, // MOV, XOR, JZR, JMP
+	NUM_HANDLERS
+} HANDLER;
+
 #define VALA_FLAG (1<<5)
 #define VALB_FLAG (1<<6)
 #define SMALL_FLAG (1<<7)
 #define SIGN_FLAG_8 (1<<7)
 #define SIGN_FLAG_64 (1<<63)
 
-#define INSTRUCTION_BASE(i) i&0xF
+#define INSTRUCTION_BASE(i) i&0x1F
 #define INSTRUCTION_VALA(i) i&(1<<5)
 #define INSTRUCTION_VALB(i) i&(1<<6)
 #define INSTRUCTION_SMALL(i) i&(1<<7)
 
+// encoding v1 has 8-bit or 64-bit values, with one width for both operands
+// encoding v2 adds the extended form, marked by SMALL_FLAG without VALA_FLAG or VALB_FLAG on an
+// instruction with operands, where a form byte follows the instruction byte giving the
+// OPERAND_FORM of each operand, so that each value takes only the width it needs
+#define ENCODING_V1 1
+#define ENCODING_V2 2
+
+#define INSTRUCTION_EXTENDED(i) (((i) & (VALA_FLAG | VALB_FLAG | SMALL_FLAG)) == SMALL_FLAG)
+
+typedef enum
+{
+	FORM_REGISTER = 0, // register index
+	FORM_U8, // zero-extended 8-bit value
+	FORM_I8, // sign-extended 8-bit value
+	FORM_U16, // zero-extended 16-bit value
+	FORM_I16, // sign-extended 16-bit value
+	FORM_U32, // zero-extended 32-bit value
+	FORM_I32, // sign-extended 32-bit value
+	FORM_64, // 64-bit value
+	NUM_FORMS
+} OPERAND_FORM;
+
+// operand A is in bits 0-2 of the form byte and operand B in bits 3-5, the rest must be clear,
+// as must the form of an operand that the instruction doesn't have
+#define FORM_A(f) ((f) & 0x7)
+#define FORM_B(f) (((f) >> 3) & 0x7)
+#define MAKE_FORM(a, b) ((U8)((a) | ((b) << 3)))
+#define FORM_RESERVED 0xC0
+
+// names of each INSTRUCTION, for printing
+extern const char* INSTRUCTIONS[NUM_INSTRUCTIONS];
+
+// size in bytes of an operand of each OPERAND_FORM
+extern const U8 FORM_SIZES[NUM_FORMS];
+
+// execution statistics, which the instruction at a time engines (execute(), execute_slice(),
+// step() and execute_sandboxed()) add to on contexts with stats set in their info
+// counting is only compiled in when the library is built with MVM64_WITH_STATS defined, and costs
+// nothing otherwise
+typedef struct MVM64_STATS
+{
+	U64 instructions[NUM_INSTRUCTIONS]; // dispatches of each INSTRUCTION
+	U64 flags[8]; // dispatches with each combination of VALA, VALB and SMALL, by instruction byte >> 5
+	U64 jzr_taken;
+	U64 jzr_not_taken;
+	U64 stack_high_water; // greatest stack depth pushed to or popped from, in INT64
+} MVM64_STATS;
+
+// an instruction decoded ahead of time into fixed-width form (see image.c)
+typedef struct
+{
+	U8 op; // INSTRUCTION, or DECODED_INVALID
+	U8 handler; // op, or a HANDLER covering this and the following instructions
+	U8 fused; // number of instructions covered by handler
+	U8 flags; // DECODED_* flags
+	U8 reg_a; // register index for operand A, or NUM_REGISTERS if A is a value
+	U8 reg_b; // register index for operand B, or NUM_REGISTERS if B is a value
+	U8 size; // size of the encoded instruction in bytes
+	INT64 val_a; // value of operand A if it is not a register
+	INT64 val_b; // value of operand B if it is not a register
+	U64 offset; // code offset of the encoded instruction
+	U64 next; // index of the following instruction
+	U64 target; // index of the jump target for JMP/JZR with a value operand
+} MVM64_DECODED;
+
+#define DECODED_SYNC_I (1<<0) // I must hold this instruction's address before it executes
+#define DECODED_WRITES_I (1<<1) // instruction may write to I
+
+// a code image decoded once, which may be executed many times
+typedef struct
+{
+	const U8* code;
+	size_t code_size;
+	U64 flags; // IMAGE_VERIFIED if verify_image() accepted the code
+	MVM64_DECODED* instructions; // sorted by offset, last entry is an invalid sentinel
+	size_t num_instructions; // including the sentinel
+	U64* index; // code offset to instruction index, U64_MAX if not an instruction
+} MVM64_IMAGE;
+
+// a decoded image translated to native x86-64 code (see jit.c)
+typedef struct
+{
+	void* code; // executable mapping
+	size_t code_size;
+	void** targets; // native address of each decoded instruction, for run-time jump targets
+	const MVM64_IMAGE* image;
+	U64 (*entry)(MVM64_REGISTERS* context); // returns bytes executed, or 0 on error
+} MVM64_JIT;
+
+// contexts allocated together, which can be taken and returned without allocation
+typedef struct
+{
+	U8* arena; // every context in the pool
+	size_t num_contexts;
+	MVM64_REGISTERS** free; // contexts not in use
+	size_t num_free;
+} MVM64_CONTEXT_POOL;
+
+// code shared, immutable, by any number of VMs (see program.c)
+typedef struct
+{
+	U8* code; // copy owned by the program
+	size_t code_size;
+	volatile I64 references;
+} MVM64_PROGRAM;
+
+// a VM holding no more state than its registers and the stack it has used
+typedef struct
+{
+	MVM64_REGISTERS registers;
+	MVM64_CONTEXT_INFO info; // stack size 0 until the first push, and the allocation is one slot above the base
+	MVM64_PROGRAM* program;
+} MVM64_VM;
+
+// result of sandboxed or sliced execution (see execute_sandboxed and execute_slice)
+typedef enum
+{
+	MVM64_OK = 0, // returned with RET
+	MVM64_ERROR_INSTRUCTION, // invalid register operand, LADR of an 8-bit value or write to Z
+	MVM64_ERROR_CODE_BOUNDS, // I or an operand of the instruction at I is outside the code
+	MVM64_ERROR_DATA_BOUNDS, // a load outside the context, its stack, the code and the data region, a
+		// store outside the stack, or LADR of an operand outside guest memory
+	MVM64_ERROR_STACK_OVERFLOW, // PUSH with the stack full, or S outside the stack
+	MVM64_ERROR_STACK_UNDERFLOW, // POP with the stack empty
+	MVM64_ERROR_DIVIDE, // DIV by zero, or of the most negative value by -1
+	MVM64_ERROR_FUEL, // the instruction budget ran out
+	MVM64_YIELDED, // a slice of execution ended before RET, and may be continued from I
+	NUM_STATUSES
+} MVM64_STATUS;
+
+// limits for executing untrusted code
+typedef struct
+{
+	U64 fuel; // number of instructions that may execute, decremented as they do
+	const void* data; // optional region that DREF and LOADB may also read, or NULL
+	size_t data_size;
+	U64 flags; // SANDBOX_* flags
+	MVM64_STATUS status; // set when execution stops
+} MVM64_SANDBOX;
+
+// the code is known to decode within its bounds with valid operands, and to only jump to
+// instruction boundaries, so those checks are skipped; run-time checks on data, the stack,
+// DIV and fuel still apply
+#define SANDBOX_VERIFIED (1<<0)
+
+// a VM thread, running code on a context in slices on a scheduler (see scheduler.c)
+typedef struct
+{
+	MVM64_REGISTERS* context;
+	MVM64_STATUS status; // MVM64_YIELDED until the VM thread finishes, then as execute_slice()
+	U64 bytes_executed;
+	INT64 return_value; // valid once status is MVM64_OK
+} MVM64_THREAD;
+
+// the state a context starts from for one run of a batch (see batch.c)
+typedef struct
+{
+	MVM64_REGISTERS registers; // S and Z are replaced by the context's own stack, and I by the code
+	const INT64* stack; // values pushed in order before the run, or NULL
+	size_t stack_size; // number of values, at most the stack size of the context
+} MVM64_BATCH_INPUT;
+
+// samples of I taken over some code, counted at each offset into it (see profile.c)
+typedef struct
+{
+	const U8* code;
+	size_t code_size; // in bytes
+	U64* hits; // samples at each offset into the code
+	U64 samples; // in all, including those outside the code
+	U64 outside; // samples with I outside the code
+} MVM64_PROFILE;
+
+#define LINE_TABLE_NAME_SIZE 256
+
+// the first byte of code generated for a line of assembler source
+typedef struct
+{
+	U64 offset;
+	U64 line; // from 1
+} MVM64_LINE;
+
+typedef struct
+{
+	U64 offset;
+	char name[LINE_TABLE_NAME_SIZE];
+} MVM64_LINE_SYMBOL;
+
+// maps offsets into code back to the assembler source it came from, sorted by offset
+typedef struct
+{
+	char source[LINE_TABLE_NAME_SIZE]; // file name
+	MVM64_LINE* lines;
+	size_t num_lines;
+	MVM64_LINE_SYMBOL* symbols;
+	size_t num_symbols;
+} MVM64_LINE_TABLE;
+
+// an instruction as it was about to run, recorded by contexts with CONTEXT_TRACE (see trace.c)
+typedef struct
+{
+	U64 address; // I in the low 56 bits, and the instruction byte in the high 8
+	INT64 a; // value of operand A, or 0 if it has none
+	INT64 b; // value of operand B, or 0 if it has none
+	INT64 r; // value of R
+} MVM64_TRACE_RECORD;
+
+#define TRACE_ADDRESS(record) ((record)->address & 0x00FFFFFFFFFFFFFFull)
+#define TRACE_INSTRUCTION(record) ((U8)((record)->address >> 56))
+
+// a ring of the most recent records, written by one thread only
+typedef struct
+{
+	MVM64_TRACE_RECORD* records;
+	U64 mask; // capacity - 1, where the capacity is a power of 2
+	U64 next; // records written in all, of which the last capacity are kept
+} MVM64_TRACE;
+
+#define TRACE_MAGIC "MVM64TRC"
+#define TRACE_VERSION 1
+
+// the start of a trace written by write_trace(), which is followed by the records oldest first,
+// with addresses made relative to code_base
+typedef struct
+{
+	char magic[8]; // TRACE_MAGIC
+	U32 version; // TRACE_VERSION
+	U32 record_size; // sizeof(MVM64_TRACE_RECORD)
+	U64 code_base;
+	U64 num_records;
+	U64 dropped; // records overwritten before the trace was written
+} MVM64_TRACE_HEADER;
+
+// a pool of host worker threads that VM threads are scheduled on
+typedef struct MVM64_SCHEDULER MVM64_SCHEDULER;
+
+// the saved state of a context, which new contexts can be forked from (see snapshot.c)
+typedef struct MVM64_SNAPSHOT MVM64_SNAPSHOT;
+
 size_t operand_count(U8 command);
 
+int writes_operand_a(U8 command);
+
+MVM64_STATUS check_instruction(const void* code, size_t code_size, U64 offset);
+
 MVM64_REGISTERS* create_context();
 
+MVM64_REGISTERS* create_context_stack(size_t stack_size, U64 flags);
+
 void free_context(MVM64_REGISTERS* context);
 
+void reset_context(MVM64_REGISTERS* context);
+
+MVM64_CONTEXT_POOL* create_context_pool(size_t num_contexts);
+
+void free_context_pool(MVM64_CONTEXT_POOL* pool);
+
+MVM64_REGISTERS* acquire_context(MVM64_CONTEXT_POOL* pool);
+
+void release_context(MVM64_CONTEXT_POOL* pool, MVM64_REGISTERS* context);
+
 U64 execute(const void* code, MVM64_REGISTERS* context, INT64* return_value);
 
-void push(INT64 value, MVM64_REGISTERS* context);
\ No newline at end of file
+U64 execute_resume(MVM64_REGISTERS* context, INT64* return_value);
+
+U64 step(MVM64_REGISTERS* context);
+
+MVM64_STATUS execute_slice(MVM64_REGISTERS* context, U64 max_instructions, U64* bytes_executed,
+	INT64* return_value);
+
+MVM64_STATUS call_guarded(MVM64_REGISTERS* context, void (*function)(void*), void* argument);
+
+int guarding_context(const MVM64_REGISTERS* context);
+
+MVM64_REGISTERS* create_guarded_context(size_t stack_size, U64 flags);
+
+void free_guarded_context(MVM64_REGISTERS* context);
+
+MVM64_MEMORY* create_memory(U64 size);
+
+void free_memory(MVM64_MEMORY* memory);
+
+void attach_memory(MVM64_REGISTERS* context, MVM64_MEMORY* memory);
+
+int write_memory(MVM64_MEMORY* memory, U64 address, const void* data, size_t size);
+
+int read_memory(const MVM64_MEMORY* memory, U64 address, void* data, size_t size);
+
+MVM64_SNAPSHOT* snapshot_context(const MVM64_REGISTERS* context);
+
+void free_snapshot(MVM64_SNAPSHOT* snapshot);
+
+MVM64_REGISTERS* fork_context(const MVM64_SNAPSHOT* snapshot);
+
+int write_checkpoint(FILE* file, const MVM64_REGISTERS* context, const void* code, size_t code_size);
+
+MVM64_REGISTERS* read_checkpoint(FILE* file, const void* code, size_t code_size);
+
+MVM64_PROFILE* create_profile(const void* code, size_t code_size);
+
+void free_profile(MVM64_PROFILE* profile);
+
+void profile_sample(MVM64_PROFILE* profile, U64 address);
+
+U64 execute_profiled(MVM64_REGISTERS* context, MVM64_PROFILE* profile, U64 interval, INT64* return_value);
+
+U64 execute_profiled_timer(MVM64_REGISTERS* context, MVM64_PROFILE* profile, U64 period,
+	INT64* return_value);
+
+MVM64_LINE_TABLE* read_line_table(FILE* file);
+
+void free_line_table(MVM64_LINE_TABLE* table);
+
+int write_profile_report(FILE* file, const MVM64_PROFILE* profile, const MVM64_LINE_TABLE* table);
+
+int write_folded_stacks(FILE* file, const MVM64_PROFILE* profile, const MVM64_LINE_TABLE* table);
+
+MVM64_TRACE* create_trace(size_t capacity);
+
+void free_trace(MVM64_TRACE* trace);
+
+MVM64_TRACE* set_thread_trace(MVM64_TRACE* trace);
+
+void set_context_trace(MVM64_REGISTERS* context, int enabled);
+
+void trace_instruction(const MVM64_REGISTERS* context, U8 instruction, const INT64* a, const INT64* b);
+
+int write_trace(FILE* file, const MVM64_TRACE* trace, U64 code_base);
+
+MVM64_STATUS run_vm(MVM64_VM* vm, U64 max_instructions, U64* bytes_executed, INT64* return_value);
+
+U64 execute_sandboxed(const void* code, size_t code_size, MVM64_REGISTERS* context,
+	MVM64_SANDBOX* sandbox, INT64* return_value);
+
+void push(INT64 value, MVM64_REGISTERS* context);
+
+#define IMAGE_FUSE (1<<0) // form superinstructions when decoding
+#define IMAGE_VERIFIED (1<<1) // set by verify_image(), sandboxed execution of the image may skip static checks
+
+MVM64_IMAGE* create_image(const void* code, size_t code_size, U64 flags);
+
+void free_image(MVM64_IMAGE* image);
+
+U64 execute_image(const MVM64_IMAGE* image, MVM64_REGISTERS* context, INT64* return_value);
+
+U64 execute_threaded(const MVM64_IMAGE* image, MVM64_REGISTERS* context, INT64* return_value);
+
+U64 execute_batch(const MVM64_IMAGE* image, const MVM64_BATCH_INPUT* inputs, size_t num_inputs,
+	INT64* return_values, size_t num_threads);
+
+MVM64_STATUS verify_image(MVM64_IMAGE* image, U64* error_offset);
+
+U64 execute_image_sandboxed(const MVM64_IMAGE* image, MVM64_REGISTERS* context,
+	MVM64_SANDBOX* sandbox, INT64* return_value);
+
+MVM64_JIT* create_jit(const MVM64_IMAGE* image);
+
+void free_jit(MVM64_JIT* jit);
+
+U64 execute_jit(const MVM64_JIT* jit, MVM64_REGISTERS* context, INT64* return_value);
+
+size_t count_processors();
+
+MVM64_SCHEDULER* create_scheduler(size_t num_workers, U64 slice_instructions);
+
+void free_scheduler(MVM64_SCHEDULER* scheduler);
+
+void init_thread(MVM64_THREAD* thread, MVM64_REGISTERS* context, const void* code);
+
+int schedule_threads(MVM64_SCHEDULER* scheduler, MVM64_THREAD* threads, size_t num_threads);
+
+void wait_scheduler(MVM64_SCHEDULER* scheduler);
+
+MVM64_PROGRAM* create_program(const void* code, size_t code_size);
+
+MVM64_PROGRAM* retain_program(MVM64_PROGRAM* program);
+
+void release_program(MVM64_PROGRAM* program);
+
+MVM64_VM* create_vm(MVM64_PROGRAM* program);
+
+void free_vm(MVM64_VM* vm);
+
+int grow_vm_stack(MVM64_VM* vm);
+
+int push_vm(MVM64_VM* vm, INT64 value);
+
+size_t vm_footprint(const MVM64_VM* vm);
\ No newline at end of file
@@ -1,13 +1,19 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <ctype.h>
 #include <malloc.h>
 #include <string.h>
-#include <climits>
 #include "vm.h"
 #include "assembler.h"
 #pragma comment(lib,"mvm64.lib")
 
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 const extern char* INSTRUCTIONS[NUM_INSTRUCTIONS]; // mvm64.lib
 
 const char* OP_TYPES[OP_TYPE_SIZE] =
@@ -16,6 +22,10 @@ const char* OP_TYPES[OP_TYPE_SIZE] =
     "Register",
     "Unsigned 8-bit Integer",
     "Signed 8-bit Integer",
+    "Unsigned 16-bit Integer",
+    "Signed 16-bit Integer",
+    "Unsigned 32-bit Integer",
+    "Signed 32-bit Integer",
     "Unsigned 64-bit Integer",
     "Signed 64-bit Integer",
     "Symbol",
@@ -38,16 +48,38 @@ const char* REGISTERS[NUM_REGISTERS] = {
     "L"
 };
 
-char* lines[MAX_LINES] = { 0 };
-size_t num_lines = 0;
-char* lines_trimmed[MAX_LINES] = { 0 };
-size_t num_lines_trimmed = 0;
+// instruction, register and directive names, found through a perfect hash table of them
+KEYWORD keywords[NUM_KEYWORDS];
+const KEYWORD* keyword_table[KEYWORD_TABLE_SIZE];
+U64 keyword_multiplier; // of the hash that places each keyword in its own slot
 
-BYTE code[MAX_BYTES] = { 0 };
+int encoding = ENCODING_V2; // of the code written, ENCODING_V1 for VMs without the extended form
+
+BYTE* code = NULL;
 size_t code_size = 0;
+size_t code_capacity = 0;
 
-SYMBOL symbols[MAX_SYMBOLS];
+SYMBOL* symbols = NULL; // in order of creation
 size_t num_symbols = 0;
+size_t symbols_capacity = 0;
+
+// open addressing hash table of symbols, each slot holding an index into symbols + 1, or 0 if empty
+size_t* symbol_table = NULL;
+size_t symbol_table_size = 0; // a power of 2, kept at least twice num_symbols
+
+ARENA arena = { 0 }; // symbol names and references
+
+LINE_ENTRY* line_entries = NULL;
+size_t num_line_entries = 0;
+size_t line_entries_capacity = 0;
+
+JUMP_SITE* jump_sites = NULL; // in code order
+size_t num_jump_sites = 0;
+size_t jump_sites_capacity = 0;
+
+NUMERIC_JUMP* numeric_jumps = NULL;
+size_t num_numeric_jumps = 0;
+size_t numeric_jumps_capacity = 0;
 
 void print_file_line(const char* file, size_t line)
 {
@@ -55,21 +87,298 @@ void print_file_line(const char* file, size_t line)
     printf("  In file: '%s', line %llu\n", file, line + 1);
 }
 
-// finds a matching symbol by name
-SYMBOL* get_symbol(const char* name)
+// allocates size bytes from an arena, aligned for any of its contents
+// returns NULL if allocation fails
+void* arena_alloc(ARENA* arena, size_t size)
 {
-    if (name == NULL)
+    size = (size + sizeof(U64) - 1) / sizeof(U64) * sizeof(U64);
+
+    if (!arena->current || arena->current->size - arena->current->used < size)
+    {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        ARENA_BLOCK* block = malloc(sizeof(ARENA_BLOCK) + block_size);
+
+        if (block == NULL)
+            return NULL;
+
+        block->previous = arena->current;
+        block->size = block_size;
+        block->used = 0;
+        arena->current = block;
+    }
+
+    void* allocation = (BYTE*)(arena->current + 1) + arena->current->used;
+    arena->current->used += size;
+
+    return allocation;
+}
+
+void free_arena(ARENA* arena)
+{
+    while (arena->current)
+    {
+        ARENA_BLOCK* previous = arena->current->previous;
+
+        free(arena->current);
+        arena->current = previous;
+    }
+}
+
+// changes a lowercase letter to uppercase, and leaves anything else as it is
+BYTE fold_case(char c)
+{
+    return c >= 'a' && c <= 'z' ? (BYTE)(c - 'a' + 'A') : (BYTE)c;
+}
+
+// returns nonzero if a token matches an uppercase name without regard to case
+int equal_folded(const char* token, const char* name, size_t length)
+{
+    for (size_t s = 0; s < length; s++)
+    {
+        if (fold_case(token[s]) != (BYTE)name[s])
+            return 0;
+    }
+
+    return 1;
+}
+
+// FNV-1a, without regard to case, as symbol names aren't case sensitive
+U64 hash_name(const char* name, size_t length)
+{
+    U64 hash = 0xCBF29CE484222325;
+
+    for (size_t s = 0; s < length; s++)
+    {
+        hash ^= fold_case(name[s]);
+        hash *= 0x100000001B3;
+    }
+
+    return hash;
+}
+
+// finds a matching symbol by name, which needn't be null-terminated, without regard to case
+SYMBOL* get_symbol(const char* name, size_t length)
+{
+    if (name == NULL || symbol_table_size == 0)
         return NULL;
 
-    for (size_t s = 0; s < num_symbols; s++)
+    U64 hash = hash_name(name, length);
+
+    for (size_t slot = hash & (symbol_table_size - 1); symbol_table[slot];
+        slot = (slot + 1) & (symbol_table_size - 1))
     {
-        if (!strcmp(symbols[s].name, name))
-            return &(symbols[s]);
+        SYMBOL* sym = &(symbols[symbol_table[slot] - 1]);
+
+        if (sym->hash == hash && sym->name_length == length && equal_folded(name, sym->name, length))
+            return sym;
     }
 
     return NULL;
 }
 
+// inserts the symbol at index into the hash table, which must have a free slot
+void insert_symbol(size_t index)
+{
+    size_t slot = symbols[index].hash & (symbol_table_size - 1);
+
+    while (symbol_table[slot])
+        slot = (slot + 1) & (symbol_table_size - 1);
+
+    symbol_table[slot] = index + 1;
+}
+
+// creates an undefined, unreferenced symbol with a name that isn't yet in use, which is kept in
+// uppercase
+// note: moves existing symbols, so pointers to them are no longer valid
+// returns NULL if allocation fails
+SYMBOL* add_symbol(const char* name, size_t length)
+{
+    if ((num_symbols + 1) * 2 > symbol_table_size)
+    {
+        size_t size = symbol_table_size ? symbol_table_size * 2 : SYMBOL_TABLE_MIN;
+        size_t* table = calloc(size, sizeof(size_t));
+
+        if (table == NULL)
+            return NULL;
+
+        free(symbol_table);
+        symbol_table = table;
+        symbol_table_size = size;
+
+        for (size_t s = 0; s < num_symbols; s++)
+            insert_symbol(s);
+    }
+
+    if (num_symbols == symbols_capacity)
+    {
+        size_t capacity = symbols_capacity ? symbols_capacity * 2 : SYMBOL_TABLE_MIN / 2;
+        SYMBOL* grown = realloc(symbols, capacity * sizeof(SYMBOL));
+
+        if (grown == NULL)
+            return NULL;
+
+        symbols = grown;
+        symbols_capacity = capacity;
+    }
+
+    char* interned = arena_alloc(&arena, length + 1);
+
+    if (interned == NULL)
+        return NULL;
+
+    for (size_t s = 0; s < length; s++)
+        interned[s] = fold_case(name[s]);
+
+    interned[length] = 0;
+
+    SYMBOL* sym = &(symbols[num_symbols]);
+
+    memset(sym, 0, sizeof(SYMBOL));
+    sym->hash = hash_name(name, length);
+    sym->name = interned;
+    sym->name_length = length;
+
+    insert_symbol(num_symbols);
+    num_symbols++;
+
+    return sym;
+}
+
+// records a 64-bit reference to a symbol ending at the current code location
+// returns NULL if allocation fails
+SYMBOL_REFERENCE* add_reference(SYMBOL* sym, int is_jump, size_t line_num)
+{
+    SYMBOL_REFERENCE* reference = arena_alloc(&arena, sizeof(SYMBOL_REFERENCE));
+
+    if (reference == NULL)
+        return NULL;
+
+    reference->offset = code_size;
+    reference->size = sizeof(U64);
+    reference->is_jump = is_jump;
+    reference->next = NULL;
+
+    if (sym->last_reference)
+        sym->last_reference->next = reference;
+    else
+    {
+        sym->references = reference;
+        sym->line_first_referenced = line_num;
+    }
+
+    sym->last_reference = reference;
+    sym->reference_count++;
+
+    return reference;
+}
+
+// records a jump to the symbol at index, whose 64-bit reference ends at the current code location
+// returns 0 if allocation fails
+int add_jump_site(SYMBOL_REFERENCE* reference, size_t symbol)
+{
+    if (num_jump_sites == jump_sites_capacity)
+    {
+        size_t capacity = jump_sites_capacity ? jump_sites_capacity * 2 : JUMP_SITES_MIN;
+        JUMP_SITE* grown = realloc(jump_sites, capacity * sizeof(JUMP_SITE));
+
+        if (grown == NULL)
+            return 0;
+
+        jump_sites = grown;
+        jump_sites_capacity = capacity;
+    }
+
+    JUMP_SITE* site = &jump_sites[num_jump_sites];
+
+    memset(site, 0, sizeof(JUMP_SITE));
+    site->reference = reference;
+    site->symbol = symbol;
+    site->start = code_size - sizeof(I64) - sizeof(U8);
+    num_jump_sites++;
+
+    return 1;
+}
+
+// records a jump by displacement about to be written at the current code location
+// returns 0 if allocation fails
+int add_numeric_jump(I64 displacement)
+{
+    if (num_numeric_jumps == numeric_jumps_capacity)
+    {
+        size_t capacity = numeric_jumps_capacity ? numeric_jumps_capacity * 2 : NUMERIC_JUMPS_MIN;
+        NUMERIC_JUMP* grown = realloc(numeric_jumps, capacity * sizeof(NUMERIC_JUMP));
+
+        if (grown == NULL)
+            return 0;
+
+        numeric_jumps = grown;
+        numeric_jumps_capacity = capacity;
+    }
+
+    numeric_jumps[num_numeric_jumps].start = code_size;
+    numeric_jumps[num_numeric_jumps].displacement = displacement;
+    num_numeric_jumps++;
+
+    return 1;
+}
+
+void free_symbols()
+{
+    free(symbols);
+    free(symbol_table);
+    free_arena(&arena);
+
+    symbols = NULL;
+    num_symbols = symbols_capacity = 0;
+    symbol_table = NULL;
+    symbol_table_size = 0;
+}
+
+// makes room for at least size more bytes of code, which the write_code functions assume
+// returns 0 if allocation fails
+int reserve_code(size_t size)
+{
+    if (code_capacity - code_size >= size)
+        return 1;
+
+    size_t capacity = code_capacity ? code_capacity : CODE_BUFFER_MIN;
+
+    while (capacity - code_size < size)
+        capacity *= 2;
+
+    BYTE* grown = realloc(code, capacity);
+
+    if (grown == NULL)
+        return 0;
+
+    code = grown;
+    code_capacity = capacity;
+
+    return 1;
+}
+
+// returns 0 if allocation fails
+int add_line_entry(U64 offset, size_t line)
+{
+    if (num_line_entries == line_entries_capacity)
+    {
+        size_t capacity = line_entries_capacity ? line_entries_capacity * 2 : LINE_ENTRIES_MIN;
+        LINE_ENTRY* grown = realloc(line_entries, capacity * sizeof(LINE_ENTRY));
+
+        if (grown == NULL)
+            return 0;
+
+        line_entries = grown;
+        line_entries_capacity = capacity;
+    }
+
+    line_entries[num_line_entries].offset = offset;
+    line_entries[num_line_entries].line = line;
+    num_line_entries++;
+
+    return 1;
+}
+
 void write_code_u8(U8 u8)
 {
     code[code_size] = u8;
@@ -82,6 +391,18 @@ void write_code_i8(I8 i8)
     code_size += sizeof(I8);
 }
 
+void write_code_u16(U16 u16)
+{
+    *(U16*)(&(code[code_size])) = u16;
+    code_size += sizeof(U16);
+}
+
+void write_code_u32(U32 u32)
+{
+    *(U32*)(&(code[code_size])) = u32;
+    code_size += sizeof(U32);
+}
+
 void write_code_u64(U64 u64)
 {
     *(U64*)(&(code[code_size])) = u64;
@@ -94,102 +415,191 @@ void write_code_i64(I64 i64)
     code_size += sizeof(I64);
 }
 
-// implementation of POSIX C getline for Windows
-// credit: Will Hartung on Stack Overflow
-size_t getline(char** lineptr, size_t* n, FILE* stream)
+// hashes a token without regard to case, into a slot of the keyword table
+size_t hash_keyword(const char* token, size_t length, U64 multiplier)
 {
-    char* bufptr = NULL;
-    char* p = bufptr;
-    size_t size;
-    int c;
+    U64 hash = length;
 
-    if (lineptr == NULL || stream == NULL || n == NULL)
-        return -1;
+    for (size_t s = 0; s < length; s++)
+        hash = (hash ^ fold_case(token[s])) * multiplier;
 
-    bufptr = *lineptr;
-    size = *n;
+    return (size_t)(hash >> (64 - KEYWORD_TABLE_BITS));
+}
 
-    c = fgetc(stream);
+// fills the keyword table, searching for a hash multiplier that gives each keyword its own slot,
+// so a lookup is one hash and one comparison
+// returns 0 if none is found
+int build_keyword_table()
+{
+    size_t num_keywords = 0;
 
-    if (c == EOF)
+    for (U8 s = 0; s < NUM_INSTRUCTIONS; s++)
     {
-        return -1;
+        keywords[num_keywords].name = INSTRUCTIONS[s];
+        keywords[num_keywords].kind = KEYWORD_INSTRUCTION;
+        keywords[num_keywords++].value = s;
     }
 
-    if (bufptr == NULL)
+    for (U8 s = 0; s < NUM_REGISTERS; s++)
+    {
+        keywords[num_keywords].name = REGISTERS[s];
+        keywords[num_keywords].kind = KEYWORD_REGISTER;
+        keywords[num_keywords++].value = s;
+    }
+
+    keywords[num_keywords].name = DATA;
+    keywords[num_keywords].kind = KEYWORD_DATA;
+    keywords[num_keywords++].value = 0;
+
+    for (U64 multiplier = 0x9E3779B97F4A7C15, attempt = 0; attempt < KEYWORD_SEARCH_LIMIT;
+        multiplier += 2, attempt++)
     {
-        bufptr = malloc(STR_BUF_SIZE);
+        size_t s;
+
+        memset(keyword_table, 0, sizeof(keyword_table));
 
-        if (bufptr == NULL)
+        for (s = 0; s < num_keywords; s++)
         {
-            return -1;
+            size_t slot = hash_keyword(keywords[s].name, strlen(keywords[s].name), multiplier);
+
+            if (keyword_table[slot])
+                break;
+
+            keyword_table[slot] = &(keywords[s]);
         }
 
-        size = 128;
+        if (s == num_keywords)
+        {
+            keyword_multiplier = multiplier;
+            return 1;
+        }
     }
 
-    p = bufptr;
+    return 0;
+}
 
-    while (c != EOF)
+// finds the keyword a token names, without regard to case, or returns NULL if it isn't one
+const KEYWORD* get_keyword(SPAN token)
+{
+    if (token.length == 0 || token.length > KEYWORD_MAX_LENGTH)
+        return NULL;
+
+    const KEYWORD* keyword = keyword_table[hash_keyword(token.start, token.length, keyword_multiplier)];
+
+    if (keyword && strlen(keyword->name) == token.length &&
+        equal_folded(token.start, keyword->name, token.length))
+        return keyword;
+
+    return NULL;
+}
+
+// gets the code for a register, or returns U8_MAX if it is invalid
+U8 get_register_by_token(SPAN token)
+{
+    const KEYWORD* keyword = get_keyword(token);
+
+    return keyword && keyword->kind == KEYWORD_REGISTER ? keyword->value : U8_MAX;
+}
+
+// maps the whole of a source file for reading, or if it can't be mapped (such as a pipe), reads
+// it into a single buffer
+// returns NULL on failure, or for an empty file
+const char* map_source(FILE* input, size_t* size, int* mapped)
+{
+    *size = 0;
+    *mapped = 0;
+
+#ifdef _WIN32
+    HANDLE file = (HANDLE)_get_osfhandle(_fileno(input));
+    LARGE_INTEGER file_size;
+
+    if (file != INVALID_HANDLE_VALUE && GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0)
     {
-        if ((size_t)(p - bufptr) > (size - 1))
+        HANDLE mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+
+        if (mapping)
         {
-            size = size + STR_BUF_SIZE;
-            bufptr = realloc(bufptr, size);
+            const char* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+
+            CloseHandle(mapping);
 
-            if (bufptr == NULL)
+            if (view)
             {
-                return -1;
+                *size = (size_t)file_size.QuadPart;
+                *mapped = 1;
+                return view;
             }
         }
+    }
+#else
+    struct stat info;
 
-        *p++ = c;
+    if (!fstat(fileno(input), &info) && S_ISREG(info.st_mode) && info.st_size > 0)
+    {
+        void* view = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fileno(input), 0);
 
-        if (c == '\n')
+        if (view != MAP_FAILED)
         {
-            break;
+            *size = (size_t)info.st_size;
+            *mapped = 1;
+            return view;
         }
-
-        c = fgetc(stream);
     }
+#endif
 
-    *p++ = '\0';
-    *lineptr = bufptr;
-    *n = size;
+    size_t capacity = 0;
+    char* buffer = NULL;
 
-    return p - bufptr - 1;
-}
+    while (1)
+    {
+        if (*size == capacity)
+        {
+            capacity = capacity ? capacity * 2 : SOURCE_BUFFER_SIZE;
 
-// gets the code for a command by name, or returns U8_MAX if it is invalid
-// note: token must be uppercase
-U8 get_command(const char* token)
-{
-    if (token == NULL)
-        return U8_MAX;
+            char* grown = realloc(buffer, capacity);
 
-    for (U8 s = 0; s < NUM_INSTRUCTIONS; s++)
+            if (grown == NULL)
+            {
+                free(buffer);
+                return NULL;
+            }
+
+            buffer = grown;
+        }
+
+        size_t read = fread(buffer + *size, sizeof(char), capacity - *size, input);
+
+        if (read == 0)
+            break;
+
+        *size += read;
+    }
+
+    if (*size == 0)
     {
-        if (!strcmp(INSTRUCTIONS[s], token))
-            return s;
+        free(buffer);
+        return NULL;
     }
 
-    return U8_MAX;
+    return buffer;
 }
 
-// gets the code for a register by name, or returns U8_MAX if it is invalid
-// note: token must be uppercase
-U8 get_register_by_token(const char* token)
+void unmap_source(const char* source, size_t size, int mapped)
 {
-    if (token == NULL)
-        return U8_MAX;
+    if (source == NULL)
+        return;
 
-    for (U8 s = 0; s < NUM_REGISTERS; s++)
+    if (!mapped)
     {
-        if (!strcmp(REGISTERS[s], token))
-            return s;
+        free((char*)source);
+        return;
     }
 
-    return U8_MAX;
+#ifdef _WIN32
+    UnmapViewOfFile(source);
+#else
+    munmap((void*)source, size);
+#endif
 }
 
 void write_instruction(INSTRUCTION base, OP_TYPE op_a, OP_TYPE op_b)
@@ -215,66 +625,51 @@ void write_instruction(INSTRUCTION base, OP_TYPE op_a, OP_TYPE op_b)
     write_code_u8(ins);
 }
 
-// op must be one of the specified types (not none or invalid)
-// returns 0 on success, -1 on invalid operand, -2 on too many symbols
-int write_operand(INSTRUCTION ins, OP_TYPE op, const char* token)
+// op must be one of the specified types (not none or invalid), with its value parsed
+// returns 0 on success, -1 on invalid operand, -2 if symbols couldn't be allocated
+int write_operand(INSTRUCTION ins, OP_TYPE type, const OPERAND* op, size_t line_num)
 {
-    if (token == NULL)
-        return -1;
-
-    switch (op)
+    switch (type)
     {
     case OP_REGISTER:
-        write_code_u8(get_register_by_token(token));
+        write_code_u8((U8)op->value);
         return 0;
     case OP_SMALL_VAL_U:
-        write_code_u8((U8)strtoul(token, NULL, 0));
+        write_code_u8((U8)op->value);
         return 0;
     case OP_SMALL_VAL_S:
-        write_code_i8((I8)strtol(token, NULL, 0));
+        write_code_i8((I8)op->value);
+        return 0;
+    case OP_VAL16_U:
+    case OP_VAL16_S:
+        write_code_u16((U16)op->value);
+        return 0;
+    case OP_VAL32_U:
+    case OP_VAL32_S:
+        write_code_u32((U32)op->value);
         return 0;
     case OP_LARGE_VAL_U:
-        write_code_u64(strtoull(token, NULL, 0));
+        write_code_u64(op->value);
         return 0;
     case OP_LARGE_VAL_S:
-        write_code_i64(strtoll(token, NULL, 0));
+        write_code_i64((I64)op->value);
         return 0;
     case OP_SYMBOL:
         write_code_i64(0);
-        token++;
 
-        // add symbol reference
-        SYMBOL* sym = get_symbol(token);
+        // add symbol reference, creating the symbol if this is its first
+        SYMBOL* sym = get_symbol(op->token.start + 1, op->token.length - 1);
 
-        if (sym)
-        {
-            sym->references[sym->reference_count].offset = code_size;
-
-            if (ins == JMP || ins == JZR)
-                sym->references[sym->reference_count].is_jump = 1;
-
-            sym->reference_count++;
-        }
-        else
-        {
-            if (num_symbols >= (MAX_SYMBOLS - 1))
-                return -2;
+        if (!sym)
+            sym = add_symbol(op->token.start + 1, op->token.length - 1);
 
-            sym = &(symbols[num_symbols]);
-            strcpy_s(sym->name, SYMBOL_NAME_SIZE, token);
-            sym->line_defined = 0;
-            sym->offset = 0;
-            sym->is_defined = 0;
-            sym->references[sym->reference_count].offset
-                = code_size;
-
-            if (ins == JMP || ins == JZR)
-                sym->references[sym->reference_count].is_jump = 1;
+        if (!sym)
+            return -2;
 
-            sym->reference_count++;
+        SYMBOL_REFERENCE* reference = add_reference(sym, ins == JMP || ins == JZR, line_num);
 
-            num_symbols++;
-        }
+        if (!reference || (reference->is_jump && !add_jump_site(reference, sym - symbols)))
+            return -2;
 
         return 0;
     }
@@ -282,332 +677,400 @@ int write_operand(INSTRUCTION ins, OP_TYPE op, const char* token)
     return -1;
 }
 
-// trims delimiters from string tokens
-// note: memory must be freed if return value is valid
-// returns NULL if string is effectively empty or allocation fails
-char* trim_token(char* token)
+// gets the 64-bit type of a narrower value operand type, or op if it is not one
+OP_TYPE widen_operand(OP_TYPE op)
 {
-    size_t len = strlen(token);
+    if (op == OP_SMALL_VAL_U || op == OP_VAL16_U || op == OP_VAL32_U)
+        return OP_LARGE_VAL_U;
 
-    // copy string to new buffer
-    char* newstring = calloc(len + 1, sizeof(char));
+    if (op == OP_SMALL_VAL_S || op == OP_VAL16_S || op == OP_VAL32_S)
+        return OP_LARGE_VAL_S;
 
-    if (newstring == NULL)
-        return NULL;
+    return op;
+}
 
-    strcpy_s(newstring, len + 1, token);
+// gets the narrowest value operand type that holds op's value, zero-extended if possible, or type
+// if it is not a value
+OP_TYPE narrow_operand(const OPERAND* op, OP_TYPE type)
+{
+    if (type == OP_NONE || type == OP_REGISTER || type == OP_SYMBOL || type == OP_INVALID)
+        return type;
 
-    for (size_t s = 0; s < len; s++)
-    {
-        // trim
-        if (newstring[s] == ',' || isspace(newstring[s]))
-        {
-            newstring[s] = 0;
-        }
-    }
+    // values are held two's complement, so small negative values are near the top
+    if (op->value <= U8_MAX)
+        return OP_SMALL_VAL_U;
+
+    if (op->value >= (U64)0 - 0x80)
+        return OP_SMALL_VAL_S;
+
+    if (op->value <= 0xFFFF)
+        return OP_VAL16_U;
+
+    if (op->value >= (U64)0 - 0x8000)
+        return OP_VAL16_S;
+
+    if (op->value <= 0xFFFFFFFF)
+        return OP_VAL32_U;
 
-    // if token was only space, free it and return null
-    if (!strlen(newstring))
+    if (op->value >= (U64)0 - 0x80000000)
+        return OP_VAL32_S;
+
+    return type;
+}
+
+// gets the number of bytes taken by an operand of a type
+size_t operand_size(OP_TYPE op)
+{
+    switch (op)
     {
-        free(newstring);
-        return NULL;
+    case OP_REGISTER:
+    case OP_SMALL_VAL_U:
+    case OP_SMALL_VAL_S:
+        return sizeof(U8);
+    case OP_VAL16_U:
+    case OP_VAL16_S:
+        return sizeof(U16);
+    case OP_VAL32_U:
+    case OP_VAL32_S:
+        return sizeof(U32);
+    case OP_LARGE_VAL_U:
+    case OP_LARGE_VAL_S:
+    case OP_SYMBOL:
+        return sizeof(U64);
     }
 
-    return newstring;
+    return 0;
 }
 
-// trims leading whitespace, trailing whitespace and trailing comments prefixed by ;
-// from a string. also shortens runs of space characters to a single space
-// note: memory must be freed
-// returns NULL if string is effectively empty or allocation fails
-char* trim_line(char* string)
+// gets the OPERAND_FORM of an operand type in the extended form, in which a missing operand is 0
+U8 operand_form(OP_TYPE op)
 {
-    // first trim leading whitespace by modifying pointer to original string
-    while (isspace(*string))
+    switch (op)
     {
-        string++;
+    case OP_SMALL_VAL_U:
+        return FORM_U8;
+    case OP_SMALL_VAL_S:
+        return FORM_I8;
+    case OP_VAL16_U:
+        return FORM_U16;
+    case OP_VAL16_S:
+        return FORM_I16;
+    case OP_VAL32_U:
+        return FORM_U32;
+    case OP_VAL32_S:
+        return FORM_I32;
+    case OP_LARGE_VAL_U:
+    case OP_LARGE_VAL_S:
+        return FORM_64;
     }
 
-    size_t len = strlen(string);
+    return FORM_REGISTER;
+}
 
-    if (len == 0) // line was all whitespace
-        return NULL;
+// gets the type an operand is written as in the v1 form, where the small flag zero-extends
+// values, apart from jump offsets which it sign-extends, and other values are 64-bit
+OP_TYPE legalize_operand(INSTRUCTION ins, const OPERAND* op, OP_TYPE type)
+{
+    if (type != OP_SMALL_VAL_U && type != OP_SMALL_VAL_S)
+        return widen_operand(type);
 
-    // copy string to new buffer
-    char* newstring = calloc(len + 1, sizeof(char));
+    if (ins == JMP || ins == JZR)
+        return (I64)op->value >= I8_MIN && (I64)op->value <= I8_MAX ? type : widen_operand(type);
 
-    if (newstring == NULL)
-        return NULL;
+    return op->value <= U8_MAX ? type : widen_operand(type);
+}
 
-    strcpy_s(newstring, len + 1, string);
+// chooses how to write an instruction's operands, which have been checked for it, changing their
+// types to those they're written as
+// returns nonzero, with the form byte in form, if the extended form is smaller than the v1 form
+int choose_form(INSTRUCTION ins, const OPERAND* op_a, OP_TYPE* op_a_type, const OPERAND* op_b,
+    OP_TYPE* op_b_type, U8* form)
+{
+    OP_TYPE a = legalize_operand(ins, op_a, *op_a_type);
+    OP_TYPE b = legalize_operand(ins, op_b, *op_b_type);
 
-    // trim trailing whitespace
-    while (isspace(newstring[len - 1]))
+    // two values share the small flag, so a small value beside a large one is written large
+    if (operand_size(a) == sizeof(U64) || operand_size(b) == sizeof(U64))
     {
-        newstring[len - 1] = 0;
-        len--;
+        a = widen_operand(a);
+        b = widen_operand(b);
     }
 
-    // truncate runs of spaces to a single space
-    for (size_t s = 0; s < len; s++)
+    // DREF and LADR values must be 64-bit, which the v1 form holds most compactly
+    if (encoding == ENCODING_V2 && ins != DREF && ins != LADR)
     {
-        // trim comments
-        if (newstring[s] == ';')
-        {
-            newstring[s] = 0;
-            len = s;
+        OP_TYPE narrow_a = narrow_operand(op_a, *op_a_type);
+        OP_TYPE narrow_b = narrow_operand(op_b, *op_b_type);
 
-            break;
+        if (sizeof(U8) + operand_size(narrow_a) + operand_size(narrow_b) <
+            operand_size(a) + operand_size(b))
+        {
+            *op_a_type = narrow_a;
+            *op_b_type = narrow_b;
+            *form = MAKE_FORM(operand_form(narrow_a), operand_form(narrow_b));
+            return 1;
         }
+    }
 
-        if (newstring[s] == SPACE)
-        {
-            size_t run = 1;
+    *op_a_type = a;
+    *op_b_type = b;
 
-            // count run of spaces
-            while (s + run < len && newstring[s + run] == SPACE)
-            {
-                run++;
-            }
+    return 0;
+}
 
-            // move content after spaces forwards
-            if (run > 1)
-            {
-                memmove(&(newstring[s + 1]), &(newstring[s + run]), len - s - run + 1);
-                // null terminate
-                newstring[len - run + 2] = 0;
-                len -= run;
-            }
-        }
-    }
+// writes an instruction with its operands, which have been checked for it, in whichever form is
+// smallest
+// returns 0 on success, or the error of write_operand()
+int write_command(INSTRUCTION ins, const OPERAND* op_a, OP_TYPE op_a_type, const OPERAND* op_b,
+    OP_TYPE op_b_type, size_t line_num)
+{
+    U8 form;
 
-    if (len)
+    if (choose_form(ins, op_a, &op_a_type, op_b, &op_b_type, &form))
     {
-        // trim subsequent whitespace
-        size_t end = len - 1;
-
-        while (isspace(newstring[end]))
-        {
-            newstring[end] = 0;
-            end--;
-            len--;
-        }
+        write_code_u8(ins | SMALL_FLAG);
+        write_code_u8(form);
     }
-
-    // if line was devoid of useful tokens, free it and return null
-    if (!strlen(newstring))
+    else
     {
-        free(newstring);
-        return NULL;
+        write_instruction(ins, op_a_type, op_b_type);
     }
 
-    return newstring;
+    int error = op_a_type != OP_NONE ? write_operand(ins, op_a_type, op_a, line_num) : 0;
+
+    if (!error && op_b_type != OP_NONE)
+        error = write_operand(ins, op_b_type, op_b, line_num);
+
+    return error;
 }
 
-// changes all lowercase letters in a string to uppercase (overwrites)
-void to_upper(char* string)
+// parses the digits of an unsigned number, in hex after 0x, octal after 0, or decimal
+// returns 0 if the token isn't entirely a number, or it doesn't fit in 64 bits
+int parse_number(const char* digits, size_t length, U64* value, int* hex)
 {
-    if (string == NULL)
-        return;
+    U64 base = 10;
 
-    size_t len = strlen(string);
+    *value = 0;
+    *hex = 0;
 
-    for (size_t s = 0; s < len; s++)
+    if (length > 2 && digits[0] == '0' && (digits[1] == 'x' || digits[1] == 'X'))
     {
-        if (string[s] >= 'a' && string[s] <= 'z')
-        {
-            string[s] = toupper(string[s]);
-        }
+        base = 16;
+        *hex = 1;
+        digits += 2;
+        length -= 2;
+    }
+    else if (length > 1 && digits[0] == '0')
+    {
+        base = 8;
     }
-}
 
+    if (length == 0)
+        return 0;
 
+    for (size_t s = 0; s < length; s++)
+    {
+        U64 digit;
+
+        if (digits[s] >= '0' && digits[s] <= '9')
+            digit = digits[s] - '0';
+        else if (fold_case(digits[s]) >= 'A' && fold_case(digits[s]) <= 'F')
+            digit = fold_case(digits[s]) - 'A' + 10;
+        else
+            return 0;
+
+        if (digit >= base || *value > (U64_MAX - digit) / base)
+            return 0;
+
+        *value = *value * base + digit;
+    }
 
-// gets the type of an operand token
+    return 1;
+}
+
+// classifies an operand token, and parses its value
 // OP_REGISTER for a register
-// OP_SMALL_VAL_U for an 8-bit unsigned value
+// OP_SMALL_VAL_U for an 8-bit unsigned value (hex up to 0xFF)
 // OP_SMALL_VAL_S for an 8-bit value
-// OP_LARGE_VAL_U for a 64-bit unsigned value
+// OP_LARGE_VAL_U for a 64-bit unsigned value (hex, or decimal beyond the signed range)
 // OP_LARGE_VAL_S for a 64-bit signed value
 // OP_SYMBOL for a symbol reference
 // OP_INVALID if the operand is invalid
-OP_TYPE operand_type(const char* operand)
+void classify_operand(SPAN token, OPERAND* op)
 {
-    if (operand == NULL)
-        return OP_INVALID;
+    op->token = token;
+    op->type = OP_INVALID;
+    op->value = 0;
 
-    if (operand[0] == SYM_PREFIX)
-        return OP_SYMBOL;
-
-    if (get_register_by_token(operand) != U8_MAX)
-        return OP_REGISTER;
+    if (token.length == 0)
+        return;
 
-    if (operand[0] == '0')
+    if (token.start[0] == SYM_PREFIX)
     {
-        if (strlen(operand) > 2 && operand[1] == 'x' && isxdigit(operand[2]))
-        {
-            U64 ull = strtoull(operand, NULL, 0);
+        if (token.length > 1)
+            op->type = OP_SYMBOL;
 
-                if (ull > U8_MAX)
-                    return OP_LARGE_VAL_U;
-                else
-                    return OP_SMALL_VAL_U;
-        }
+        return;
     }
 
-    if (operand[0] == '-')
-    {
-        if (strlen(operand) > 1 && isdigit(operand[1]))
-        {
-            I64 ill = strtoll(operand, NULL, 0);
+    U8 reg = get_register_by_token(token);
 
-            if (ill > I8_MAX || ill < I8_MIN)
-                return OP_LARGE_VAL_S;
-            else
-                return OP_SMALL_VAL_S;
-        }
-        else
-        {
-            return OP_INVALID;
-        }
+    if (reg != U8_MAX)
+    {
+        op->type = OP_REGISTER;
+        op->value = reg;
+        return;
     }
 
-    if (isdigit(operand[0]))
+    int negative = token.start[0] == '-', hex;
+    U64 value;
+
+    if (!parse_number(token.start + negative, token.length - negative, &value, &hex))
+        return;
+
+    if (negative)
     {
-        I64 ill = strtoll(operand, NULL, 0);
+        if (value > (U64)1 << 63)
+            return;
 
-        if (ill == LONG_MAX)
-        {
-            U64 ull = strtoull(operand, NULL, 0);
+        op->value = (U64)0 - value;
+        op->type = value > (U64)-I8_MIN ? OP_LARGE_VAL_S : OP_SMALL_VAL_S;
+    }
+    else if (hex)
+    {
+        op->value = value;
+        op->type = value > U8_MAX ? OP_LARGE_VAL_U : OP_SMALL_VAL_U;
+    }
+    else
+    {
+        op->value = value;
 
-            if (ull == ULONG_MAX)
-                return OP_INVALID;
-            else
-                return OP_LARGE_VAL_U;
-        }
-        else if (ill == LONG_MIN)
-            return OP_INVALID;
-        else if (ill > I8_MAX)
-            return OP_LARGE_VAL_S;
+        if (value > (U64)I8_MAX)
+            op->type = value >= (U64)1 << 63 ? OP_LARGE_VAL_U : OP_LARGE_VAL_S;
         else
-            return OP_SMALL_VAL_S;
+            op->type = OP_SMALL_VAL_S;
     }
-
-    return OP_INVALID;
 }
 
 // returns 0 on success, nonzero on failure
-int parse_line(char** tokens, size_t num_tokens, const char* input_filename, 
+int parse_line(const SPAN* tokens, size_t num_tokens, const char* input_filename, 
     size_t line_num)
 {
     if (tokens == NULL || num_tokens == 0)
         return -1;
 
     // first token must be a command or a symbol
-    if (tokens[0] == NULL)
+    if (tokens[0].length == 0)
         return -1;
 
-    // force uppercase
-    for (size_t s = 0; s < num_tokens; s++)
-        to_upper(tokens[s]);
+    const KEYWORD* keyword = get_keyword(tokens[0]);
+    size_t len = tokens[0].length;
+
+    // operands are classified and their values parsed once, here
+    OPERAND op_a = { 0 }, op_b = { 0 };
 
-    size_t len = strlen(tokens[0]);
+    if (num_tokens > 1)
+        classify_operand(tokens[1], &op_a);
+
+    if (num_tokens > 2)
+        classify_operand(tokens[2], &op_b);
 
     // check if token defines data
-    if (!strcmp(tokens[0], DATA))
+    if (keyword && keyword->kind == KEYWORD_DATA)
     {
         if (num_tokens != 2)
         {
-            printf("Error: Too many tokens for %s, expecting a single value\n",
-                tokens[0]);
+            printf("Error: Too many tokens for %.*s, expecting a single value\n",
+                SPAN_FORMAT(tokens[0]));
             print_file_line(input_filename, line_num);
             return -7;
         }
 
-        OP_TYPE op_type = operand_type(tokens[1]);
+        OP_TYPE op_type = op_a.type;
 
         if (op_type == OP_NONE || op_type == OP_INVALID || op_type == OP_SYMBOL)
         {
-            printf("Error: Invalid operand type for %s (%s)\n",
-                tokens[0], OP_TYPES[op_type]);
+            printf("Error: Invalid operand type for %.*s (%s)\n",
+                SPAN_FORMAT(tokens[0]), OP_TYPES[op_type]);
             print_file_line(input_filename, line_num);
             return -7;
         }
 
-        write_operand(0, op_type, tokens[1]);
+        write_operand(0, op_type, &op_a, line_num);
     }
     // check if token defines a symbol (label)
-    else if (len > 1 && tokens[0][len - 1] == SYM_SUFFIX)
+    else if (len > 1 && tokens[0].start[len - 1] == SYM_SUFFIX)
     {
-        // null-terminate symbol name, removing suffix
-        tokens[0][len - 1] = 0;
+        // symbol name, without the suffix
+        SPAN name = { tokens[0].start, len - 1 };
 
         // check if symbol has already been defined
-        SYMBOL* sym = get_symbol(tokens[0]);
+        SYMBOL* sym = get_symbol(name.start, name.length);
 
         if (sym)
         {
             if (sym->is_defined)
             {
-                printf("Error: Symbol %s was already defined at line %llu\n", 
-                    tokens[0], sym->line_defined);
+                printf("Error: Symbol %.*s was already defined at line %llu\n", 
+                    SPAN_FORMAT(name), sym->line_defined);
                 print_file_line(input_filename, line_num);
                 return -1;
             }
             else
             {
 #ifdef _DEBUG
-                printf("    DEBUG: Defining already referenced symbol %s at code offset %llu\n", 
-                    tokens[0], code_size);
+                printf("    DEBUG: Defining already referenced symbol %.*s at code offset %llu\n", 
+                    SPAN_FORMAT(name), code_size);
 #endif
                 // define symbol
                 sym->line_defined = line_num;
                 sym->offset = code_size;
+                sym->jumps_before = num_jump_sites;
                 sym->is_defined = 1;
             }
         }
         else // create symbol
         {
-            if (num_symbols >= (MAX_SYMBOLS - 1))
+            sym = add_symbol(name.start, name.length);
+
+            if (!sym)
             {
-                printf("Error: Exceeded maximum number of symbols (%u)\n", MAX_SYMBOLS);
+                printf("Error: Couldn't allocate symbol %.*s\n", SPAN_FORMAT(name));
                 print_file_line(input_filename, line_num);
                 return -2;
             }
 
 #ifdef _DEBUG
-            printf("    DEBUG: Created symbol %s at code offset %llu\n", tokens[0], code_size);
+            printf("    DEBUG: Created symbol %.*s at code offset %llu\n", SPAN_FORMAT(name), code_size);
 #endif
 
-            strcpy_s(symbols[num_symbols].name, SYMBOL_NAME_SIZE, tokens[0]);
-            symbols[num_symbols].line_defined = line_num;
-            symbols[num_symbols].offset = code_size;
-            symbols[num_symbols].is_defined = 1;
-
-            num_symbols++;
+            sym->line_defined = line_num;
+            sym->offset = code_size;
+            sym->jumps_before = num_jump_sites;
+            sym->is_defined = 1;
         }
     }
     else // otherwise try to find a matching command
     {
-        U8 command = get_command(tokens[0]);
+        U8 command = keyword && keyword->kind == KEYWORD_INSTRUCTION ? keyword->value : U8_MAX;
 
         if (command == U8_MAX)
         {
-            printf("Error: %s is not a valid command or symbol\n", tokens[0]);
+            printf("Error: %.*s is not a valid command or symbol\n", SPAN_FORMAT(tokens[0]));
             print_file_line(input_filename, line_num);
             return -2;
         }
 
 #ifdef _DEBUG
-        printf("    DEBUG: Interpreted command %s as %u\n", tokens[0], command);
+        printf("    DEBUG: Interpreted command %.*s as %u\n", SPAN_FORMAT(tokens[0]), command);
 #endif
 
         size_t ops = operand_count(command);
 
         if (ops != (num_tokens - 1))
         {
-            printf("Error: Expected %llu operands for command %s, got %llu\n",
-                ops, tokens[0], (num_tokens - 1));
+            printf("Error: Expected %llu operands for command %.*s, got %llu\n",
+                ops, SPAN_FORMAT(tokens[0]), (num_tokens - 1));
             print_file_line(input_filename, line_num);
             return -4;
         }
@@ -616,11 +1079,11 @@ int parse_line(char** tokens, size_t num_tokens, const char* input_filename,
 
         if (num_tokens > 1)
         {
-            op_a_type = operand_type(tokens[1]);
+            op_a_type = op_a.type;
 
             if (num_tokens > 2)
             {
-                op_b_type = operand_type(tokens[2]);
+                op_b_type = op_b.type;
             }
         }
 
@@ -628,8 +1091,8 @@ int parse_line(char** tokens, size_t num_tokens, const char* input_filename,
         {
             if (op_a_type == OP_NONE || op_a_type == OP_INVALID)
             {
-                printf("Error: %s expects %llu operands but A is invalid (%s)\n",
-                    tokens[0], ops, tokens[1]);
+                printf("Error: %.*s expects %llu operands but A is invalid (%.*s)\n",
+                    SPAN_FORMAT(tokens[0]), ops, SPAN_FORMAT(tokens[1]));
                 print_file_line(input_filename, line_num);
                 return -5;
             }
@@ -639,8 +1102,8 @@ int parse_line(char** tokens, size_t num_tokens, const char* input_filename,
         {
             if (op_b_type == OP_NONE || op_b_type == OP_INVALID)
             {
-                printf("Error: %s expects 2 operands but B is invalid (%s)\n",
-                    tokens[0], tokens[1]);
+                printf("Error: %.*s expects 2 operands but B is invalid (%.*s)\n",
+                    SPAN_FORMAT(tokens[0]), SPAN_FORMAT(tokens[2]));
                 print_file_line(input_filename, line_num);
                 return -5;
             }
@@ -664,25 +1127,22 @@ int parse_line(char** tokens, size_t num_tokens, const char* input_filename,
         case MOV:
             if (op_a_type != OP_REGISTER)
             {
-                printf("Error: %s expects Register as operand A, not %s\n", 
-                    tokens[0], OP_TYPES[op_a_type]);
+                printf("Error: %.*s expects Register as operand A, not %s\n", 
+                    SPAN_FORMAT(tokens[0]), OP_TYPES[op_a_type]);
                 print_file_line(input_filename, line_num);
                 return -6;
             }
 
             if (op_b_type == OP_SYMBOL)
             {
-                printf("Error: Symbol operand for %s is invalid\n", tokens[0]);
+                printf("Error: Symbol operand for %.*s is invalid\n", SPAN_FORMAT(tokens[0]));
                 print_file_line(input_filename, line_num);
                 return -6;
             }
 
-            write_instruction(command, op_a_type, op_b_type);
-
-            if (write_operand(command, op_a_type, tokens[1]) ||
-                write_operand(command, op_b_type, tokens[2]))
+            if (write_command(command, &op_a, op_a_type, &op_b, op_b_type, line_num))
             {
-                printf("Error: Invalid operands for %s (generic)\n", tokens[0]);
+                printf("Error: Invalid operands for %.*s (generic)\n", SPAN_FORMAT(tokens[0]));
                 print_file_line(input_filename, line_num);
                 return -6;
             }
@@ -692,11 +1152,16 @@ int parse_line(char** tokens, size_t num_tokens, const char* input_filename,
         // class: jump commands with op A register, symbol or value
         case JMP:
         case JZR:
-            write_instruction(command, op_a_type, op_b_type);
+            if (op_a_type != OP_REGISTER && op_a_type != OP_SYMBOL && !add_numeric_jump((I64)op_a.value))
+            {
+                printf("Error: Couldn't allocate numeric jump\n");
+                print_file_line(input_filename, line_num);
+                return -2;
+            }
 
-            if (write_operand(command, op_a_type, tokens[1]))
+            if (write_command(command, &op_a, op_a_type, &op_b, op_b_type, line_num))
             {
-                printf("Error: Invalid operand/s for %s (generic)\n", tokens[0]);
+                printf("Error: Invalid operand/s for %.*s (generic)\n", SPAN_FORMAT(tokens[0]));
                 print_file_line(input_filename, line_num);
                 return -6;
             }
@@ -707,8 +1172,8 @@ int parse_line(char** tokens, size_t num_tokens, const char* input_filename,
         case LADR:
             if (op_a_type != OP_REGISTER)
             {
-                printf("Error: %s expects Register as operand A, not %s\n",
-                    tokens[0], OP_TYPES[op_a_type]);
+                printf("Error: %.*s expects Register as operand A, not %s\n",
+                    SPAN_FORMAT(tokens[0]), OP_TYPES[op_a_type]);
                 print_file_line(input_filename, line_num);
                 return -6;
             }
@@ -716,47 +1181,70 @@ int parse_line(char** tokens, size_t num_tokens, const char* input_filename,
             if (op_b_type == OP_SYMBOL || op_b_type == OP_SMALL_VAL_S 
                 || op_b_type == OP_SMALL_VAL_U)
             {
-                printf("Error: Symbol operand for %s is invalid\n", tokens[0]);
+                printf("Error: Symbol operand for %.*s is invalid\n", SPAN_FORMAT(tokens[0]));
                 print_file_line(input_filename, line_num);
                 return -6;
             }
 
-            write_instruction(command, op_a_type, op_b_type);
-
-            if (write_operand(command, op_a_type, tokens[1]) ||
-                write_operand(command, op_b_type, tokens[2]))
+            if (write_command(command, &op_a, op_a_type, &op_b, op_b_type, line_num))
             {
-                printf("Error: Invalid operands for %s (generic)\n", tokens[0]);
+                printf("Error: Invalid operands for %.*s (generic)\n", SPAN_FORMAT(tokens[0]));
                 print_file_line(input_filename, line_num);
                 return -6;
             }
             
             return 0;
 
+        // loadb takes register as A, stores take register or value as A, and all take register or
+        // value as B
+        case STORE:
+        case LOADB:
+        case STOREB:
+            if (op_a_type == OP_SYMBOL || (command == LOADB && op_a_type != OP_REGISTER))
+            {
+                printf("Error: %.*s expects %s as operand A, not %s\n", SPAN_FORMAT(tokens[0]),
+                    command == LOADB ? "Register" : "Register or Value", OP_TYPES[op_a_type]);
+                print_file_line(input_filename, line_num);
+                return -6;
+            }
+
+            if (op_b_type == OP_SYMBOL)
+            {
+                printf("Error: Symbol operand for %.*s is invalid\n", SPAN_FORMAT(tokens[0]));
+                print_file_line(input_filename, line_num);
+                return -6;
+            }
+
+            if (write_command(command, &op_a, op_a_type, &op_b, op_b_type, line_num))
+            {
+                printf("Error: Invalid operands for %.*s (generic)\n", SPAN_FORMAT(tokens[0]));
+                print_file_line(input_filename, line_num);
+                return -6;
+            }
+
+            return 0;
+
         // comp will only take 2 registers
         case COMP:
             if (op_a_type != OP_REGISTER)
             {
-                printf("Error: %s expects Register as operand A, not %s\n",
-                    tokens[0], OP_TYPES[op_a_type]);
+                printf("Error: %.*s expects Register as operand A, not %s\n",
+                    SPAN_FORMAT(tokens[0]), OP_TYPES[op_a_type]);
                 print_file_line(input_filename, line_num);
                 return -6;
             }
 
             if (op_b_type != OP_REGISTER)
             {
-                printf("Error: %s expects Register as operand B, not %s\n",
-                    tokens[0], OP_TYPES[op_b_type]);
+                printf("Error: %.*s expects Register as operand B, not %s\n",
+                    SPAN_FORMAT(tokens[0]), OP_TYPES[op_b_type]);
                 print_file_line(input_filename, line_num);
                 return -6;
             }
 
-            write_instruction(command, op_a_type, op_b_type);
-
-            if (write_operand(command, op_a_type, tokens[1]) ||
-                write_operand(command, op_b_type, tokens[2]))
+            if (write_command(command, &op_a, op_a_type, &op_b, op_b_type, line_num))
             {
-                printf("Error: Invalid operands for %s (generic)\n", tokens[0]);
+                printf("Error: Invalid operands for %.*s (generic)\n", SPAN_FORMAT(tokens[0]));
                 print_file_line(input_filename, line_num);
                 return -6;
             }
@@ -767,17 +1255,15 @@ int parse_line(char** tokens, size_t num_tokens, const char* input_filename,
         case PUSH:
             if (op_a_type == OP_SYMBOL)
             {
-                printf("Error: %s expects Register or Value as operand A, not %s\n",
-                    tokens[0], OP_TYPES[op_a_type]);
+                printf("Error: %.*s expects Register or Value as operand A, not %s\n",
+                    SPAN_FORMAT(tokens[0]), OP_TYPES[op_a_type]);
                 print_file_line(input_filename, line_num);
                 return -6;
             }
 
-            write_instruction(command, op_a_type, op_b_type);
-
-            if (write_operand(command, op_a_type, tokens[1]))
+            if (write_command(command, &op_a, op_a_type, &op_b, op_b_type, line_num))
             {
-                printf("Error: Invalid operands for %s (generic)\n", tokens[0]);
+                printf("Error: Invalid operands for %.*s (generic)\n", SPAN_FORMAT(tokens[0]));
                 print_file_line(input_filename, line_num);
                 return -6;
             }
@@ -788,17 +1274,15 @@ int parse_line(char** tokens, size_t num_tokens, const char* input_filename,
         case POP:
             if (op_a_type != OP_REGISTER)
             {
-                printf("Error: %s expects Register as operand A, not %s\n",
-                    tokens[0], OP_TYPES[op_a_type]);
+                printf("Error: %.*s expects Register as operand A, not %s\n",
+                    SPAN_FORMAT(tokens[0]), OP_TYPES[op_a_type]);
                 print_file_line(input_filename, line_num);
                 return -6;
             }
 
-            write_instruction(command, op_a_type, op_b_type);
-
-            if (write_operand(command, op_a_type, tokens[1]))
+            if (write_command(command, &op_a, op_a_type, &op_b, op_b_type, line_num))
             {
-                printf("Error: Invalid operands for %s (generic)\n", tokens[0]);
+                printf("Error: Invalid operands for %.*s (generic)\n", SPAN_FORMAT(tokens[0]));
                 print_file_line(input_filename, line_num);
                 return -6;
             }
@@ -811,7 +1295,7 @@ int parse_line(char** tokens, size_t num_tokens, const char* input_filename,
             return 0;
 
         default:
-            printf("Error: %s is an unknown command\n", tokens[0]);
+            printf("Error: %.*s is an unknown command\n", SPAN_FORMAT(tokens[0]));
             print_file_line(input_filename, line_num);
             return -3;
         }
@@ -820,9 +1304,216 @@ int parse_line(char** tokens, size_t num_tokens, const char* input_filename,
     return 0;
 }
 
+// gets the number of jumps to symbols that start before a code location, as first written
+size_t count_jumps_before(U64 offset)
+{
+    size_t low = 0, high = num_jump_sites;
+
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+
+        if (jump_sites[mid].start < offset)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+// gets the bytes taken by a jump with an operand of size bytes, which is in the extended form if
+// 16-bit or 32-bit
+size_t jump_length(size_t size)
+{
+    return sizeof(U8) + size + (size == sizeof(I16) || size == sizeof(I32) ? sizeof(U8) : 0);
+}
+
+// gets the next wider jump operand size than size in the encoding being written
+size_t widen_jump(size_t size)
+{
+    if (encoding == ENCODING_V1 || size == sizeof(I32))
+        return sizeof(I64);
+
+    return size * 2;
+}
+
+// returns nonzero if a displacement fits a jump operand of size bytes
+int jump_fits(I64 displacement, size_t size)
+{
+    switch (size)
+    {
+    case sizeof(I8):
+        return displacement >= I8_MIN && displacement <= I8_MAX;
+    case sizeof(I16):
+        return displacement >= -0x8000 && displacement <= 0x7FFF;
+    case sizeof(I32):
+        return displacement >= -0x80000000LL && displacement <= 0x7FFFFFFF;
+    }
+
+    return 1;
+}
+
+// gets the bytes removed by shrinking any of the first count jumps to symbols
+U64 removed_by_jumps(size_t count)
+{
+    if (count == 0)
+        return 0;
+
+    const JUMP_SITE* site = &jump_sites[count - 1];
+
+    return site->removed + LARGE_JUMP_LENGTH - jump_length(site->reference->size);
+}
+
+// branch relaxation: shrinks each jump to a symbol to the narrowest operand its displacement fits,
+// 8-bit, or in encoding v2 also 16-bit or 32-bit, and moves the code, symbols, references and line
+// entries that follow it
+// every jump starts out 8-bit, and those found out of range are widened until none are, which
+// settles because a jump is never shrunk once widened
+// jumps within reach of a numeric jump are left 64-bit, as shrinking them would move its target
+// returns the number of jumps shrunk
+size_t relax_jumps()
+{
+    // mark where the jumps reached across by each numeric jump begin and end
+    for (size_t n = 0; n < num_numeric_jumps; n++)
+    {
+        I64 start = (I64)numeric_jumps[n].start, target = start + numeric_jumps[n].displacement;
+        U64 low = target < start ? (target < 0 ? 0 : (U64)target) : (U64)start;
+        U64 high = target < start ? (U64)start : (U64)target;
+        size_t first = count_jumps_before(low), last = count_jumps_before(high);
+
+        if (first == last)
+            continue;
+
+        jump_sites[first].spans++;
+
+        if (last < num_jump_sites)
+            jump_sites[last].spans--;
+    }
+
+    I64 spans = 0;
+
+    // an undefined target is reported when resolving symbols
+    for (size_t j = 0; j < num_jump_sites; j++)
+    {
+        spans += jump_sites[j].spans;
+
+        if (symbols[jump_sites[j].symbol].is_defined && !spans)
+            jump_sites[j].reference->size = sizeof(I8);
+    }
+
+    int widened;
+
+    do
+    {
+        U64 removed = 0;
+
+        for (size_t j = 0; j < num_jump_sites; j++)
+        {
+            jump_sites[j].removed = removed;
+            removed += LARGE_JUMP_LENGTH - jump_length(jump_sites[j].reference->size);
+        }
+
+        // widening a jump only lengthens the displacements across it, so one widened against
+        // stale removed counts would be widened anyway
+        widened = 0;
+
+        for (size_t j = 0; j < num_jump_sites; j++)
+        {
+            JUMP_SITE* site = &jump_sites[j];
+            const SYMBOL* sym = &(symbols[site->symbol]);
+
+            if (site->reference->size == sizeof(I64))
+                continue;
+
+            I64 displacement = (I64)(sym->offset - removed_by_jumps(sym->jumps_before)) -
+                (I64)(site->start - site->removed);
+
+            if (!jump_fits(displacement, site->reference->size))
+            {
+                site->reference->size = widen_jump(site->reference->size);
+                widened = 1;
+            }
+        }
+    } while (widened);
+
+    // move the code between shrunk jumps down over the bytes they no longer use
+    U64 from = 0, to = 0;
+    size_t shrunk = 0;
+
+    for (size_t j = 0; j < num_jump_sites; j++)
+    {
+        JUMP_SITE* site = &jump_sites[j];
+
+        size_t size = site->reference->size;
+
+        site->reference->offset = site->start - site->removed + jump_length(size);
+
+        if (size == sizeof(I64))
+            continue;
+
+        U8 ins = code[site->start];
+
+        memmove(code + to, code + from, site->start - from);
+        to += site->start - from;
+
+        // the displacement is emplaced when resolving symbols
+        if (size == sizeof(I8))
+        {
+            code[to] = ins | SMALL_FLAG;
+        }
+        else
+        {
+            code[to] = (INSTRUCTION_BASE(ins)) | SMALL_FLAG;
+            code[to + 1] = MAKE_FORM(size == sizeof(I16) ? FORM_I16 : FORM_I32, FORM_REGISTER);
+        }
+
+        to += jump_length(size);
+
+        from = site->start + LARGE_JUMP_LENGTH;
+        shrunk++;
+    }
+
+    memmove(code + to, code + from, code_size - from);
+    code_size = to + (code_size - from);
+
+    for (size_t s = 0; s < num_symbols; s++)
+    {
+        if (symbols[s].is_defined)
+            symbols[s].offset -= removed_by_jumps(symbols[s].jumps_before);
+
+        for (SYMBOL_REFERENCE* reference = symbols[s].references; reference;
+            reference = reference->next)
+        {
+            if (!reference->is_jump)
+                reference->offset -= removed_by_jumps(count_jumps_before(reference->offset));
+        }
+    }
+
+    // line entries are in code order, as are the jumps
+    for (size_t s = 0, j = 0; s < num_line_entries; s++)
+    {
+        while (j < num_jump_sites && jump_sites[j].start < line_entries[s].offset)
+            j++;
+
+        line_entries[s].offset -= removed_by_jumps(j);
+    }
+
+    return shrunk;
+}
+
 int resolve_symbols(const char* input_filename)
 {
-    for (size_t s = 0; s < num_symbols && s < MAX_SYMBOLS; s++)
+    // a symbol referenced as a value is read for 8 bytes, which past the end of the code are 0
+    if (!reserve_code(sizeof(U64)))
+    {
+        printf("Error: Couldn't allocate %llu bytes of code\n", (U64)code_size + sizeof(U64));
+        return -1;
+    }
+
+    memset(code + code_size, 0, sizeof(U64));
+
+    for (size_t s = 0; s < num_symbols; s++)
     {
         if (!symbols[s].is_defined)
         {
@@ -836,21 +1527,28 @@ int resolve_symbols(const char* input_filename)
             print_file_line(input_filename, symbols[s].line_defined);
         }
 
-        for (size_t t = 0; t < symbols[s].reference_count
-            && t < MAX_SYMBOL_REFERENCES; t++)
+        for (SYMBOL_REFERENCE* reference = symbols[s].references; reference;
+            reference = reference->next)
         {
-            if (symbols[s].references[t].is_jump)
+            if (reference->is_jump)
             {
-                // get relative offset of symbol location + size of jump instruction
+                // get relative offset of symbol location from the start of the jump instruction
                 I64 offset = (I64)symbols[s].offset - 
-                    (I64)symbols[s].references[t].offset + sizeof(I64) + sizeof(U8);
-
-                *(I64*)(code + symbols[s].references[t].offset - sizeof(I64)) = offset;
+                    (I64)(reference->offset - jump_length(reference->size));
+
+                if (reference->size == sizeof(I8))
+                    *(I8*)(code + reference->offset - sizeof(I8)) = (I8)offset;
+                else if (reference->size == sizeof(I16))
+                    *(I16*)(code + reference->offset - sizeof(I16)) = (I16)offset;
+                else if (reference->size == sizeof(I32))
+                    *(I32*)(code + reference->offset - sizeof(I32)) = (I32)offset;
+                else
+                    *(I64*)(code + reference->offset - sizeof(I64)) = offset;
             }
             else
             {
                 // copy U64 from symbol location to reference location
-                *(U64*)(code + symbols[s].references[t].offset - sizeof(U64)) =
+                *(U64*)(code + reference->offset - sizeof(U64)) =
                     *(U64*)(code + symbols[s].offset);
             }
         }
@@ -859,120 +1557,121 @@ int resolve_symbols(const char* input_filename)
     return 0;
 }
 
-void assemble(FILE* input, FILE* output, const char* input_filename)
+// writes the code offset of each symbol and of the first byte generated by each line, for
+// mapping code offsets back to source (see profile.c)
+void write_line_table(FILE* output, const char* input_filename)
 {
-    char* line = NULL;
-    size_t linesize = 0, n = 0;
+    fprintf(output, "%s\n", LINE_TABLE_HEADER);
+    fprintf(output, "SOURCE %s\n", input_filename);
 
-    // initialise symbol list
-    for (size_t s = 0; s < MAX_SYMBOLS; s++)
+    for (size_t s = 0; s < num_symbols; s++)
     {
-        symbols[s].name[0] = 0;
-        symbols[s].offset = 0;
-        symbols[s].reference_count = 0;
-        symbols[s].line_defined = 0;
-        symbols[s].is_defined = 0;
-
-        for (size_t t = 0; t < MAX_SYMBOL_REFERENCES; t++)
-            symbols[s].references[t].is_jump = 0;
+        if (symbols[s].is_defined)
+            fprintf(output, "SYMBOL %llu %s\n", symbols[s].offset, symbols[s].name);
     }
 
-    linesize = getline(&line, &n, input);
-
-    // code cleaning logic
-    while (linesize != -1 && num_lines < (MAX_LINES - 1) && line != NULL)
-    {
-        lines[num_lines] = line;
-
-        char* trimmedline = trim_line(line);
-
-        lines_trimmed[num_lines] = trimmedline; // may be NULL
-
-        num_lines++;
-
-        n = 0;
-        line = NULL;
-        linesize = getline(&line, &n, input);
-    }
+    // converts internal line numbering (0-index) to normal line numbering (1-index)
+    for (size_t s = 0; s < num_line_entries; s++)
+        fprintf(output, "LINE %llu %llu\n", line_entries[s].offset, (U64)line_entries[s].line + 1);
+}
 
-#ifdef _DEBUG
-    printf("    DEBUG: Raw source code:\n");
+// returns nonzero for characters that separate tokens within a line
+int is_separator(char c)
+{
+    return c == SPACE || c == '\t' || c == '\r' || c == '\v' || c == '\f' || c == ',';
+}
 
-    for (size_t s = 0; s < num_lines; s++)
-    {
-        if (lines[s])
-            printf("    %4llu: %s", s, lines[s]);
-    }
+// lines_output may be NULL, or a file for the line table
+void assemble(FILE* input, FILE* output, FILE* lines_output, const char* input_filename)
+{
+    size_t source_size;
+    int mapped;
 
-    printf("\n    DEBUG: Processed and cleaned source code:\n");
+    // the source is tokenized in place, each token a span of it, so lines aren't copied
+    const char* source = map_source(input, &source_size, &mapped);
+    const char* p = source;
+    const char* end = source + source_size;
 
-    for (size_t s = 0; s < num_lines; s++)
+    if (!build_keyword_table())
     {
-        if (lines_trimmed[s])
-            printf("    %4llu: %s (length %llu)\n", s, lines_trimmed[s], 
-                strlen(lines_trimmed[s]));
+        printf("Error: Couldn't build the keyword table\n");
+        goto CLEANUP;
     }
-#endif
 
     // assembler logic
-    for (size_t s = 0; s < num_lines; s++)
+    for (size_t s = 0; p < end; s++)
     {
-        if (lines_trimmed[s])
-        {
-            char* token, * tok_context = NULL;
-            token = strtok_s(lines_trimmed[s], " ", &tok_context);
+        SPAN tokens[MAX_TOKENS_LINE];
+        size_t num_tokens = 0;
 
-            char* tokens[MAX_TOKENS_LINE];
-            size_t num_tokens = 0;
+        // tokens are separated by whitespace and commas, up to a comment or the end of the line
+        while (p < end && *p != '\n' && *p != ';')
+        {
+            if (is_separator(*p))
+            {
+                p++;
+                continue;
+            }
 
-            while (token)
+            if (num_tokens == MAX_TOKENS_LINE)
             {
-                char* token_trimmed = trim_token(token);
+                printf("Error: Too many tokens in a single line (max %d)\n", MAX_TOKENS_LINE);
+                print_file_line(input_filename, s);
+                goto CLEANUP;
+            }
+
+            tokens[num_tokens].start = p;
 
-                if (token_trimmed)
-                {
-                    // add to array
-                    tokens[num_tokens] = token_trimmed;
-                    num_tokens++;
+            while (p < end && !is_separator(*p) && *p != '\n' && *p != ';')
+                p++;
+
+            tokens[num_tokens].length = p - tokens[num_tokens].start;
 
 #ifdef _DEBUG
-                    printf("    DEBUG: Token %s\n", token_trimmed);
+            printf("    DEBUG: Token %.*s\n", SPAN_FORMAT(tokens[num_tokens]));
 #endif
-                }
-
-                if (num_tokens == MAX_TOKENS_LINE)
-                {
-                    printf("Error: Too many tokens in a single line (max %d)\n", MAX_TOKENS_LINE);
-                    print_file_line(input_filename, s);
-                    goto CLEANUP;
-                }
-                
-                token = strtok_s(NULL, " ", &tok_context);
-            }
 
-            // parse line
-            if (num_tokens)
+            num_tokens++;
+        }
+
+        // skip any comment, and the end of the line
+        while (p < end && *p != '\n')
+            p++;
+
+        if (p < end)
+            p++;
+
+        // parse line
+        if (num_tokens)
+        {
+            size_t line_start = code_size;
+
+            // a line generates at most one instruction, so this is the only check the code
+            // buffer needs
+            if (!reserve_code(MAX_INSTRUCTION_SIZE))
             {
-                if (parse_line(tokens, num_tokens, input_filename, s))
-                {
-                    for (size_t s = 0; s < num_tokens; s++)
-                    {
-                        if (tokens[s])
-                            free(tokens[s]);
-                    }
-
-                    goto CLEANUP;
-                }
+                printf("Error: Couldn't allocate %llu bytes of code\n", (U64)code_size + MAX_INSTRUCTION_SIZE);
+                print_file_line(input_filename, s);
+                goto CLEANUP;
             }
 
-            for (size_t s = 0; s < num_tokens; s++)
+            if (parse_line(tokens, num_tokens, input_filename, s))
+                goto CLEANUP;
+
+            if (code_size > line_start && !add_line_entry(line_start, s))
             {
-                if (tokens[s])
-                    free(tokens[s]);
+                printf("Error: Couldn't allocate the line table\n");
+                print_file_line(input_filename, s);
+                goto CLEANUP;
             }
         }
     }
 
+    size_t shrunk = relax_jumps();
+
+    if (num_jump_sites)
+        printf("%llu of %llu jumps to symbols shortened.\n", (U64)shrunk, (U64)num_jump_sites);
+
     if (resolve_symbols(input_filename))
         goto CLEANUP;
 
@@ -985,17 +1684,26 @@ void assemble(FILE* input, FILE* output, const char* input_filename)
     else
         printf("%llu bytes written.\n", bytes_written);
 
+    if (lines_output)
+    {
+        write_line_table(lines_output, input_filename);
+        printf("Line table written, %llu lines.\n", num_line_entries);
+    }
+
 CLEANUP:
+    unmap_source(source, source_size, mapped);
+
     fclose(input);
     fclose(output);
 
-    for (size_t s = 0; s < num_lines; s++)
-    {
-        free(lines[s]);
+    if (lines_output)
+        fclose(lines_output);
 
-        if (lines_trimmed[s])
-            free(lines_trimmed[s]);
-    }
+    free_symbols();
+    free(code);
+    free(line_entries);
+    free(jump_sites);
+    free(numeric_jumps);
 
     printf("Exiting...\n");
 }
@@ -1011,6 +1719,14 @@ int main(int argc, char* argv[])
     printf("    DEBUG: image %s\n", argv[0]);
 #endif
 
+    // -v1 writes encoding v1, for VMs without the extended form
+    if (argc > 1 && strcmp(argv[1], "-v1") == 0)
+    {
+        encoding = ENCODING_V1;
+        argv++;
+        argc--;
+    }
+
     if (argc < 3)
     {
         printf("Error: Insufficient arguments (%d): expected 2\n", argc - 1);
@@ -1032,13 +1748,23 @@ int main(int argc, char* argv[])
         goto INVALID_ARGS;
     }
 
-    printf("Assembling source file %s, output to binary %s\n\n", argv[1], argv[2]);
+    FILE* lines = NULL;
+
+    if (argc > 3 && fopen_s(&lines, argv[3], "w"))
+    {
+        printf("Error: Couldn't open line table file %s\n", argv[3]);
+        fclose(source);
+        fclose(bin);
+        goto INVALID_ARGS;
+    }
+
+    printf("Assembling source file %s, output to binary %s (encoding v%d)\n\n", argv[1], argv[2], encoding);
 
-    assemble(source, bin, argv[1]);
+    assemble(source, bin, lines, argv[1]);
 
     return 0;
 
 INVALID_ARGS:
-    printf("Usage: mvm64asm [input file name] [output file name]\n");
+    printf("Usage: mvm64asm [-v1] [input file name] [output file name] [line table file name (optional)]\n");
     return -1;
 }
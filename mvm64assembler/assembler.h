@@ -3,12 +3,14 @@
 #define VER_MAJ 0
 #define VER_MIN "01c"
 #define MAX_TOKENS_LINE 5 // meximum number of tokens in a single line
-#define MAX_LINES 4096 // maximum lines of code
-#define MAX_BYTES MAX_LINES // maximum bytes of binary output (most is 1 byte per line for now)
-#define MAX_SYMBOLS 128 // maximum number of defined symbols
-#define MAX_SYMBOL_REFERENCES 32 // maximum number of times a symbol may be referred to
-#define SYMBOL_NAME_SIZE 32
-#define STR_BUF_SIZE 128
+#define CODE_BUFFER_MIN 0x1000 // initial size of the code buffer, in bytes, which doubles as needed
+#define LINE_ENTRIES_MIN 256 // initial capacity of the line table, which doubles as needed
+#define JUMP_SITES_MIN 256 // initial capacity of the symbol jumps, which doubles as needed
+#define NUMERIC_JUMPS_MIN 64 // initial capacity of the numeric jumps, which doubles as needed
+#define LARGE_JUMP_LENGTH (sizeof(U8) + sizeof(I64)) // bytes of a jump with a 64-bit operand
+#define SYMBOL_TABLE_MIN 64 // initial capacity of the symbol hash table, a power of 2
+#define ARENA_BLOCK_SIZE 0x10000 // bytes allocated at once for symbol names and references
+#define SOURCE_BUFFER_SIZE 0x10000 // initial size of the buffer for source that can't be mapped
 #define SPACE ' '
 #define SYM_PREFIX '@' // prefix for referencing a token
 #define SYM_SUFFIX ':' // suffix for a label/symbol token
@@ -17,34 +19,121 @@
 #define I8_MAX 127
 #define I8_MIN -128
 #define DATA "DATA" // data emplacement command
-#define MAX_INSTRUCTION_SIZE 10 // in bytes, 8 bit instruction + 8bit op a + 64bit op b
+#define NUM_KEYWORDS (NUM_INSTRUCTIONS + NUM_REGISTERS + 1) // instructions, registers and DATA
+#define KEYWORD_TABLE_BITS 7
+#define KEYWORD_TABLE_SIZE (1 << KEYWORD_TABLE_BITS) // slots in the keyword hash table
+#define KEYWORD_MAX_LENGTH 6 // longest keyword, in characters
+#define KEYWORD_SEARCH_LIMIT 0x100000 // hash multipliers tried for one that places keywords perfectly
+#define MAX_INSTRUCTION_SIZE 17 // in bytes, 8 bit instruction + 64 bit op a + 64 bit op b (STORE)
 
+// a run of characters within the source, which isn't null-terminated
 typedef struct
 {
-    U64 offset; // code location of empty reference (always 64-bit)
+    const char* start;
+    size_t length;
+} SPAN;
+
+#define SPAN_FORMAT(span) (int)(span).length, (span).start // arguments for printing with %.*s
+
+typedef enum
+{
+    KEYWORD_INSTRUCTION,
+    KEYWORD_REGISTER,
+    KEYWORD_DATA
+} KEYWORD_KIND;
+
+typedef struct
+{
+    const char* name; // uppercase
+    U8 kind; // KEYWORD_KIND
+    U8 value; // INSTRUCTION or register code
+} KEYWORD;
+
+// allocations that are only freed all at once, carved out of large blocks
+typedef struct ARENA_BLOCK
+{
+    struct ARENA_BLOCK* previous;
+    size_t size; // usable bytes following the header
+    size_t used;
+} ARENA_BLOCK;
+
+typedef struct
+{
+    ARENA_BLOCK* current; // most recent block, which allocations are made from
+} ARENA;
+
+typedef struct SYMBOL_REFERENCE
+{
+    U64 offset; // code location following the empty reference
+    size_t size; // of the reference, 64-bit unless branch relaxation shrinks a jump
     int is_jump; // indicates that a signed relative offset should be emplaced
+    struct SYMBOL_REFERENCE* next; // in order of reference
 } SYMBOL_REFERENCE;
 
 typedef struct
 {
     U64 offset;
-    SYMBOL_REFERENCE references[MAX_SYMBOL_REFERENCES];
+    SYMBOL_REFERENCE* references; // first reference, held in the arena
+    SYMBOL_REFERENCE* last_reference;
     size_t reference_count;
     int is_defined;
+    size_t jumps_before; // number of jumps to symbols written before the definition
     size_t line_defined;
     size_t line_first_referenced;
-    char name[SYMBOL_NAME_SIZE];
+    U64 hash;
+    const char* name; // interned in the arena
+    size_t name_length;
 } SYMBOL;
 
+// a jump to a symbol, which is written with a 64-bit operand, then shrunk to the narrowest one
+// its target is in range of by branch relaxation
+typedef struct
+{
+    SYMBOL_REFERENCE* reference;
+    size_t symbol; // index into symbols of the target
+    U64 start; // code location of the jump instruction, as first written
+    U64 removed; // bytes removed before the jump by shrinking the jumps before it
+    I64 spans; // change in the number of numeric jumps reaching across, from the jump before
+} JUMP_SITE;
+
+// a jump by a numeric displacement, which is written as given, so the jumps to symbols it reaches
+// across must keep their length
+typedef struct
+{
+    U64 start; // code location of the jump instruction, as first written
+    I64 displacement;
+} NUMERIC_JUMP;
+
+#define LINE_TABLE_HEADER "MVM64 LINES 1" // first line of a line table (see profile.c)
+
+// the code generated for a line of source, for the line table
+typedef struct
+{
+    U64 offset; // code location of the first byte generated
+    size_t line; // internal line numbering (0-index)
+} LINE_ENTRY;
+
 typedef enum
 {
     OP_NONE = 0,
     OP_REGISTER,
     OP_SMALL_VAL_U,
     OP_SMALL_VAL_S,
+    OP_VAL16_U,
+    OP_VAL16_S,
+    OP_VAL32_U,
+    OP_VAL32_S,
     OP_LARGE_VAL_U,
     OP_LARGE_VAL_S,
     OP_SYMBOL,
     OP_INVALID,
     OP_TYPE_SIZE
 } OP_TYPE;
+
+// an operand token, classified with its value parsed
+typedef struct
+{
+    SPAN token;
+    OP_TYPE type;
+    U64 value; // register code or value, two's complement if negative, or unused for a symbol
+} OPERAND;
@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <string.h>
+#include "vm.h"
+#pragma comment(lib,"mvm64.lib")
+
+// decodes a trace written by write_trace() into one line per record, oldest first
+
+// describes an operand of an instruction byte, as "reg", "val8" or "val64", or "ext" for the
+// extended form, whose form byte isn't recorded
+static const char* operand_kind(U8 ins, int value)
+{
+    if (INSTRUCTION_EXTENDED(ins))
+        return "ext";
+
+    if (!value)
+        return "reg";
+
+    return INSTRUCTION_SMALL(ins) ? "val8" : "val64";
+}
+
+static void print_record(U64 index, const MVM64_TRACE_RECORD* record)
+{
+    U8 ins = TRACE_INSTRUCTION(record);
+    U8 op = INSTRUCTION_BASE(ins);
+    char form[32] = "";
+
+    if (op >= NUM_INSTRUCTIONS)
+    {
+        printf("%10llu  0x%08llx  ??? (0x%02x)\n", index, TRACE_ADDRESS(record), ins);
+        return;
+    }
+
+    size_t num_ops = operand_count(op);
+
+    if (num_ops > 1)
+        snprintf(form, sizeof(form), "%s, %s", operand_kind(ins, INSTRUCTION_VALA(ins)),
+            operand_kind(ins, INSTRUCTION_VALB(ins)));
+    else if (num_ops > 0)
+        snprintf(form, sizeof(form), "%s", operand_kind(ins, INSTRUCTION_VALA(ins)));
+
+    printf("%10llu  0x%08llx  %-6s %-12s", index, TRACE_ADDRESS(record), INSTRUCTIONS[op], form);
+
+    if (num_ops > 0)
+        printf("  A=0x%016llx", record->a.u);
+    else
+        printf("  %20s", "");
+
+    if (num_ops > 1)
+        printf("  B=0x%016llx", record->b.u);
+    else
+        printf("  %20s", "");
+
+    printf("  R=0x%016llx\n", record->r.u);
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2)
+    {
+        printf("Usage: mvm64trace <trace file>\n");
+        return -1;
+    }
+
+    FILE* file;
+
+    if (fopen_s(&file, argv[1], "rb"))
+    {
+        printf("Error: Couldn't open trace file %s\n", argv[1]);
+        return -1;
+    }
+
+    MVM64_TRACE_HEADER header;
+
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)))
+    {
+        printf("Error: %s isn't a trace\n", argv[1]);
+        fclose(file);
+        return -1;
+    }
+
+    if (header.version != TRACE_VERSION || header.record_size != sizeof(MVM64_TRACE_RECORD))
+    {
+        printf("Error: Unsupported trace version %u (record size %u)\n", header.version, header.record_size);
+        fclose(file);
+        return -1;
+    }
+
+    printf("%llu records, %llu dropped before them, addresses relative to 0x%llx\n\n",
+        header.num_records, header.dropped, header.code_base);
+
+    // records are numbered from the first instruction traced, counting those dropped
+    for (U64 n = 0; n < header.num_records; n++)
+    {
+        MVM64_TRACE_RECORD record;
+
+        if (fread(&record, sizeof(record), 1, file) != 1)
+        {
+            printf("Error: Trace ends after %llu of %llu records\n", n, header.num_records);
+            fclose(file);
+            return -1;
+        }
+
+        print_record(header.dropped + n, &record);
+    }
+
+    fclose(file);
+
+    return 0;
+}
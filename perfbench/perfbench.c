@@ -0,0 +1,512 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include "vm.h"
+#pragma comment(lib,"mvm64.lib")
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+// measures the engines with hardware performance counters, reporting cycles, host instructions,
+// branch misses and L1i misses per guest instruction retired, for judging changes to dispatch
+// counters are read with perf_event_open on Linux, and where they can't be opened (other hosts,
+// no PMU in a VM, or perf_event_paranoid) only the time per guest instruction is reported
+
+// counts down from n, popped off of the stack, which is little but dispatch
+U8 countdowncode[] = {
+    POP, // pop into register
+    8, // register R
+    SUB | VALB_FLAG | SMALL_FLAG, // loop: subtract 8-bit value from register
+    8, // register R
+    1, // 8-bit value
+    JZR | VALA_FLAG | SMALL_FLAG, // jump if R is zero
+    11, // past the following JMP
+    JMP | VALA_FLAG, // jump back to loop
+    0xFB, // 64bit -5
+    0xFF,
+    0xFF,
+    0xFF,
+    0xFF,
+    0xFF,
+    0xFF,
+    0xFF,
+    RET // return
+};
+
+// branches n times on a high bit of a linear congruential generator, which no predictor can
+// learn, and returns the number of branches not taken
+U8 branchcode[] = {
+    POP, // pop into register
+    2, // register C (loop counter)
+    MUL | VALB_FLAG, // loop: multiply register by 64-bit value
+    0, // register A (generator state)
+    0x2D, // 64bit 0x5851F42D4C957F2D
+    0x7F,
+    0x95,
+    0x4C,
+    0x2D,
+    0xF4,
+    0x51,
+    0x58,
+    ADD | VALB_FLAG | SMALL_FLAG, // add 8-bit value to register
+    0, // register A
+    1, // 8-bit value
+    MOV, // move register to register
+    8, // dest register R
+    0, // source register A
+    AND | VALB_FLAG, // and register with 64-bit value
+    8, // register R
+    0x00, // 64bit 1 << 40
+    0x00,
+    0x00,
+    0x00,
+    0x00,
+    0x01,
+    0x00,
+    0x00,
+    JZR | VALA_FLAG | SMALL_FLAG, // jump if R is zero
+    5, // past the following ADD
+    ADD | VALB_FLAG | SMALL_FLAG, // add 8-bit value to register
+    1, // register B (bits set)
+    1, // 8-bit value
+    SUB | VALB_FLAG | SMALL_FLAG, // subtract 8-bit value from register
+    2, // register C
+    1, // 8-bit value
+    MOV, // move register to register
+    8, // dest register R
+    2, // source register C
+    JZR | VALA_FLAG | SMALL_FLAG, // jump if R is zero
+    11, // past the following JMP
+    JMP | VALA_FLAG, // jump back to loop
+    0xD9, // 64bit -39
+    0xFF,
+    0xFF,
+    0xFF,
+    0xFF,
+    0xFF,
+    0xFF,
+    0xFF,
+    MOV, // move register to register
+    8, // dest register R
+    1, // source register B
+    RET // return
+};
+
+// stores n down to 1 through guest memory a page and a line apart, loading each back, and
+// returns their sum
+U8 memorycode[] = {
+    POP, // pop into register
+    2, // register C (loop counter)
+    STORE, // loop: store register at address in register
+    0, // register A (address)
+    2, // register C
+    DREF, // load register from address in register
+    3, // register D
+    0, // register A
+    ADD, // add register to register
+    1, // register B (sum)
+    3, // register D
+    ADD | VALB_FLAG, // add 64-bit value to register
+    0, // register A
+    0x08, // 64bit 4104
+    0x10,
+    0x00,
+    0x00,
+    0x00,
+    0x00,
+    0x00,
+    0x00,
+    SUB | VALB_FLAG | SMALL_FLAG, // subtract 8-bit value from register
+    2, // register C
+    1, // 8-bit value
+    MOV, // move register to register
+    8, // dest register R
+    2, // source register C
+    JZR | VALA_FLAG | SMALL_FLAG, // jump if R is zero
+    11, // past the following JMP
+    JMP | VALA_FLAG, // jump back to loop
+    0xE5, // 64bit -27
+    0xFF,
+    0xFF,
+    0xFF,
+    0xFF,
+    0xFF,
+    0xFF,
+    0xFF,
+    MOV, // move register to register
+    8, // dest register R
+    1, // source register B
+    RET // return
+};
+
+#define WORKLOAD_MEMORY 0x1000000 // guest memory of workloads that use it, in bytes
+
+typedef struct
+{
+    const char* name;
+    const U8* code;
+    size_t code_size;
+    U64 arg; // pushed before each run
+    U64 runs;
+    U64 memory_size; // guest memory to attach, or 0 to address host memory
+} WORKLOAD;
+
+typedef struct
+{
+    const char* name;
+    U64 (*engine)(const MVM64_IMAGE*, MVM64_REGISTERS*, INT64*); // NULL for execute()
+    int fused; // run on the image decoded with IMAGE_FUSE
+} ENGINE;
+
+MVM64_JIT* jit; // translation of the current workload, NULL if unsupported
+
+// runs the translation of the current workload, which was made from image
+U64 jit_engine(const MVM64_IMAGE* image, MVM64_REGISTERS* context, INT64* return_value)
+{
+    (void)image;
+
+    return execute_jit(jit, context, return_value);
+}
+
+ENGINE engines[] = {
+    { "execute", NULL, 0 },
+    { "execute_threaded", execute_threaded, 0 },
+    { "execute_threaded+fuse", execute_threaded, 1 },
+    { "execute_jit", jit_engine, 0 }
+};
+
+#define NUM_ENGINES (sizeof(engines) / sizeof(ENGINE))
+
+typedef enum
+{
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_BRANCH_MISSES,
+    COUNTER_L1I_MISSES,
+    NUM_COUNTERS
+} COUNTER;
+
+const char* COUNTERS[NUM_COUNTERS] = {
+    "cycles",
+    "instrs",
+    "br-miss",
+    "L1i-miss"
+};
+
+// a group of counters, read together, of which any may have failed to open
+typedef struct
+{
+    int fds[NUM_COUNTERS]; // -1 for counters that couldn't be opened
+    int leader; // index of the fd the group is enabled through, or -1 if none opened
+} COUNTER_GROUP;
+
+typedef struct
+{
+    U64 values[NUM_COUNTERS];
+    int valid[NUM_COUNTERS];
+    double seconds;
+} MEASUREMENT;
+
+double now()
+{
+    struct timespec ts;
+
+#ifdef _WIN32
+    timespec_get(&ts, TIME_UTC);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+#ifdef __linux__
+static int open_counter(U32 type, U64 config, int group)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = group < 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID | PERF_FORMAT_TOTAL_TIME_ENABLED |
+        PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+#endif
+
+// opens the counters on the calling thread, disabled
+// returns 0 if none could be opened
+int open_counters(COUNTER_GROUP* group)
+{
+    group->leader = -1;
+
+    for (size_t c = 0; c < NUM_COUNTERS; c++)
+        group->fds[c] = -1;
+
+#ifdef __linux__
+    static const U32 types[NUM_COUNTERS] = {
+        PERF_TYPE_HARDWARE,
+        PERF_TYPE_HARDWARE,
+        PERF_TYPE_HARDWARE,
+        PERF_TYPE_HW_CACHE
+    };
+    static const U64 configs[NUM_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_BRANCH_MISSES,
+        PERF_COUNT_HW_CACHE_L1I | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+    };
+
+    for (size_t c = 0; c < NUM_COUNTERS; c++)
+    {
+        group->fds[c] = open_counter(types[c], configs[c],
+            group->leader < 0 ? -1 : group->fds[group->leader]);
+
+        if (group->fds[c] >= 0 && group->leader < 0)
+            group->leader = (int)c;
+    }
+#endif
+
+    return group->leader >= 0;
+}
+
+void close_counters(COUNTER_GROUP* group)
+{
+#ifdef __linux__
+    for (size_t c = 0; c < NUM_COUNTERS; c++)
+    {
+        if (group->fds[c] >= 0)
+            close(group->fds[c]);
+    }
+#endif
+}
+
+void start_counters(COUNTER_GROUP* group)
+{
+#ifdef __linux__
+    if (group->leader >= 0)
+    {
+        ioctl(group->fds[group->leader], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(group->fds[group->leader], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+#endif
+}
+
+// stops the counters and reads them into measurement, scaled up if they were multiplexed
+void stop_counters(COUNTER_GROUP* group, MEASUREMENT* measurement)
+{
+    for (size_t c = 0; c < NUM_COUNTERS; c++)
+        measurement->valid[c] = 0;
+
+#ifdef __linux__
+    if (group->leader < 0)
+        return;
+
+    // nr, time enabled, time running, then a value and id for each counter in the group
+    U64 data[3 + 2 * NUM_COUNTERS];
+    U64 ids[NUM_COUNTERS];
+
+    ioctl(group->fds[group->leader], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+    for (size_t c = 0; c < NUM_COUNTERS; c++)
+    {
+        if (group->fds[c] < 0 || ioctl(group->fds[c], PERF_EVENT_IOC_ID, &ids[c]))
+            ids[c] = U64_MAX;
+    }
+
+    ssize_t bytes = read(group->fds[group->leader], data, sizeof(data));
+
+    if (bytes < (ssize_t)(3 * sizeof(U64)) || !data[2])
+        return;
+
+    double scale = (double)data[1] / (double)data[2];
+
+    for (U64 n = 0; n < data[0] && 3 + 2 * n + 1 < (U64)bytes / sizeof(U64); n++)
+    {
+        for (size_t c = 0; c < NUM_COUNTERS; c++)
+        {
+            if (ids[c] == data[3 + 2 * n + 1])
+            {
+                measurement->values[c] = (U64)((double)data[3 + 2 * n] * scale);
+                measurement->valid[c] = 1;
+            }
+        }
+    }
+#endif
+}
+
+// prepares a context for another run, clearing general purpose registers and the stack
+void reset(MVM64_REGISTERS* context, U64 arg)
+{
+    INT64 value;
+    value.u = arg;
+
+    for (size_t s = 0; s <= 8; s++)
+        context->a[s].u = 0;
+
+    context->s.S.u = context->s.Z.u;
+    push(value, context);
+}
+
+// counts the instructions retired by a single run, by stepping through it
+U64 count_instructions(const WORKLOAD* workload, MVM64_REGISTERS* context)
+{
+    U64 count = 0;
+
+    reset(context, workload->arg);
+    context->s.I.u = (U64)workload->code;
+
+    while (1)
+    {
+        U64 bytes = step(context);
+
+        count++;
+
+        if (bytes == 0 || bytes == U64_MAX)
+            return count;
+    }
+}
+
+void run_workload(const WORKLOAD* workload, COUNTER_GROUP* group)
+{
+    MVM64_REGISTERS* context = create_context();
+    MVM64_IMAGE* image = create_image(workload->code, workload->code_size, 0);
+    MVM64_IMAGE* fused_image = create_image(workload->code, workload->code_size, IMAGE_FUSE);
+    MVM64_MEMORY* memory = workload->memory_size ? create_memory(workload->memory_size) : NULL;
+    INT64 expected;
+
+    assert(context && image && fused_image && (memory || !workload->memory_size));
+
+    attach_memory(context, memory);
+
+    U64 instructions = count_instructions(workload, context) * workload->runs;
+
+    printf("%s: %llu guest instructions\n", workload->name, instructions);
+    printf("  %-24s", "per guest instruction");
+
+    for (size_t c = 0; c < NUM_COUNTERS; c++)
+        printf(" %10s", COUNTERS[c]);
+
+    printf(" %10s\n", "ns");
+
+    jit = create_jit(image);
+
+    for (size_t e = 0; e < NUM_ENGINES; e++)
+    {
+        MEASUREMENT measurement;
+        INT64 retnval;
+
+        if (engines[e].engine == jit_engine && !jit)
+        {
+            printf("  %-24s unsupported on this host\n", engines[e].name);
+            continue;
+        }
+
+        double start = now();
+        start_counters(group);
+
+        for (U64 r = 0; r < workload->runs; r++)
+        {
+            reset(context, workload->arg);
+
+            if (engines[e].engine)
+                engines[e].engine(engines[e].fused ? fused_image : image, context, &retnval);
+            else
+                execute(workload->code, context, &retnval);
+        }
+
+        stop_counters(group, &measurement);
+        measurement.seconds = now() - start;
+
+        if (e == 0)
+            expected = retnval;
+
+        printf("  %-24s", engines[e].name);
+
+        for (size_t c = 0; c < NUM_COUNTERS; c++)
+        {
+            if (measurement.valid[c])
+                printf(" %10.4f", (double)measurement.values[c] / (double)instructions);
+            else
+                printf(" %10s", "n/a");
+        }
+
+        printf(" %10.4f%s\n", measurement.seconds * 1e9 / (double)instructions,
+            retnval.u == expected.u ? "" : " (MISMATCH)");
+    }
+
+    free_jit(jit);
+    free_image(fused_image);
+    free_image(image);
+    free_context(context);
+    free_memory(memory);
+}
+
+U8 fibonacci[1024];
+U8 test[1024];
+
+// reads an assembled binary into buffer
+// returns its size, or 0 on failure
+size_t load_binary(const char* name, U8* buffer, size_t size)
+{
+    FILE* bin;
+
+    if (fopen_s(&bin, name, "rb"))
+    {
+        printf("Couldn't open %s.\n", name);
+        return 0;
+    }
+
+    size_t read = fread(buffer, sizeof(U8), size, bin);
+
+    fclose(bin);
+
+    return read;
+}
+
+int main(int argc, char* argv[])
+{
+    WORKLOAD workloads[] = {
+        { "countdown", countdowncode, sizeof(countdowncode), 10000000, 1, 0 },
+        { "branches", branchcode, sizeof(branchcode), 2000000, 1, 0 },
+        { "memory", memorycode, sizeof(memorycode), 2000000, 1, WORKLOAD_MEMORY },
+        { "fibonacci", fibonacci, 0, 90, 200000, 0 },
+        { "test", test, 0, 0, 5000000, 0 }
+    };
+
+    size_t num_workloads = sizeof(workloads) / sizeof(WORKLOAD);
+    COUNTER_GROUP group;
+
+    if (argc < 3)
+    {
+        printf("Usage: perfbench <fibonacci binary> <test binary>\n");
+        return -1;
+    }
+
+    workloads[num_workloads - 2].code_size = load_binary(argv[1], fibonacci, sizeof(fibonacci));
+    workloads[num_workloads - 1].code_size = load_binary(argv[2], test, sizeof(test));
+
+    if (!workloads[num_workloads - 2].code_size || !workloads[num_workloads - 1].code_size)
+        return -1;
+
+    if (!open_counters(&group))
+        printf("Performance counters unavailable, timing only\n\n");
+
+    for (size_t s = 0; s < num_workloads; s++)
+        run_workload(&workloads[s], &group);
+
+    close_counters(&group);
+
+    return 0;
+}
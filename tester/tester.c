@@ -1,8 +1,17 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include "vm.h"
 #pragma comment(lib,"mvm64.lib")
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#endif
+
 U8 testcode[] = {
     MOV | VALB_FLAG | SMALL_FLAG, // move 8-bit value to register
     0, // register A
@@ -23,6 +32,1421 @@ U8 testcode[] = {
     RET // return
 };
 
+// sums 1..n, with n popped off of the stack
+U8 sumcode[] = {
+    POP, // pop into register
+    0, // register A
+    MOV, // move register to register
+    8, // dest register R (loop counter)
+    0, // source register A
+    MOV | VALB_FLAG | SMALL_FLAG, // move 8-bit value to register
+    1, // register B (accumulator)
+    0, // 8-bit value
+    ADD, // loop: add register to register
+    1, // register B
+    8, // register R
+    SUB | VALB_FLAG | SMALL_FLAG, // subtract 8-bit value from register
+    8, // register R
+    1, // 8-bit value
+    JZR | VALA_FLAG | SMALL_FLAG, // jump if R is zero
+    11, // past the following JMP
+    JMP | VALA_FLAG, // jump back to loop
+    0xF8, // 64bit -8
+    0xFF,
+    0xFF,
+    0xFF,
+    0xFF,
+    0xFF,
+    0xFF,
+    0xFF,
+    MOV, // move register to register
+    8, // dest register R
+    1, // source register B
+    RET // return
+};
+
+// sumcode with the 8-bit jumps the assembler shrinks them to, the backward one sign-extended
+U8 shortsumcode[] = {
+    POP, 0, // pop a
+    MOV, 8, 0, // mov r, a
+    MOV | VALB_FLAG | SMALL_FLAG, 1, 0, // mov b, 0
+    ADD, 1, 8, // loop: add b, r
+    SUB | VALB_FLAG | SMALL_FLAG, 8, 1, // sub r, 1
+    JZR | VALA_FLAG | SMALL_FLAG, 4, // jzr past the following JMP
+    JMP | VALA_FLAG | SMALL_FLAG, 0xF8, // jmp -8, back to loop
+    MOV, 8, 1, // mov r, b
+    RET
+};
+
+// jumps by a register offset and returns the value of I
+U8 dynamiccode[] = {
+    MOV | VALB_FLAG | SMALL_FLAG, // move 8-bit value to register
+    0, // register A
+    6, // 8-bit value
+    JMP, // jump by register
+    0, // register A
+    MOV | VALB_FLAG | SMALL_FLAG, // skipped
+    8, // register R
+    1, // 8-bit value
+    RET, // skipped
+    MOV, // move register to register
+    8, // dest register R
+    11, // source register I
+    RET // return
+};
+
+// exercises arithmetic, COMP, LADR/DREF of registers and code, the stack and registers
+// kept outside the JIT's host registers
+U8 mixedcode[] = {
+    MOV | VALB_FLAG | SMALL_FLAG, 0, 100, // mov a, 100
+    MOV | VALB_FLAG | SMALL_FLAG, 1, 7, // mov b, 7
+    DIV, 0, 1, // div a, b
+    MUL | VALB_FLAG | SMALL_FLAG, 0, 3, // mul a, 3
+    COMP, 2, 0, // comp c, a
+    MOV, 12, 2, // mov l, c
+    ADD | VALB_FLAG, 12, 0, 0, 0, 0, 0x10, 0, 0, 0, // add l, 0x1000000000
+    LADR, 3, 12, // ladr d, l
+    DREF, 4, 3, // dref e, d
+    PUSH, 4, // push e
+    PUSH | VALA_FLAG | SMALL_FLAG, 9, // push 9
+    POP, 5, // pop f
+    POP, 6, // pop g
+    XOR, 6, 0, // xor g, a
+    OR, 7, 6, // or h, g
+    AND, 7, 5, // and h, f
+    LADR | VALB_FLAG, 0, 0x88, 0x77, 0x66, 0x55, 0x44, 0x33, 0x22, 0x11, // ladr a, 0x1122334455667788
+    DREF, 1, 0, // dref b, a
+    ADD, 7, 1, // add h, b
+    MOV, 8, 7, // mov r, h
+    LADR, 3, 2, // ladr d, c
+    DREF, 4, 3, // dref e, d
+    ADD, 8, 4, // add r, e
+    XOR, 3, 3, // xor d, d (context address differs between contexts)
+    PUSH, 9, // push s
+    POP, 9, // pop s
+    SUB | VALB_FLAG | SMALL_FLAG, 9, 8, // sub s, 8 (restore the stack pointer)
+    RET
+};
+
+// stores a byte into a stack slot through its host address, and loads it back
+U8 stackstorecode[] = {
+    PUSH | VALA_FLAG | SMALL_FLAG, 0, // push 0
+    MOV, 0, 9, // mov a, s
+    STOREB | VALB_FLAG | SMALL_FLAG, 0, 0x7F, // storeb a, 0x7F
+    LOADB, 1, 0, // loadb b, a
+    POP, 2, // pop c
+    ADD, 2, 1, // add c, b
+    MOV, 8, 2, // mov r, c
+    XOR, 0, 0, // xor a, a (stack address differs between contexts)
+    RET
+};
+
+// extended form (encoding v2) instructions, with each value as wide as it needs and sign or
+// zero-extended, around a loop of extended jumps
+U8 widecode[] = {
+    MOV | SMALL_FLAG, MAKE_FORM(FORM_REGISTER, FORM_U16), 0, 0x34, 0x12, // mov a, 0x1234
+    ADD | SMALL_FLAG, MAKE_FORM(FORM_REGISTER, FORM_I8), 0, 0xFF, // add a, -1
+    MOV | SMALL_FLAG, MAKE_FORM(FORM_REGISTER, FORM_I32), 1, 0, 0, 0, 0x80, // mov b, -0x80000000
+    SUB | SMALL_FLAG, MAKE_FORM(FORM_REGISTER, FORM_U32), 1, 0xFF, 0xFF, 0xFF, 0xFF, // sub b, 0xFFFFFFFF
+    PUSH | SMALL_FLAG, MAKE_FORM(FORM_I16, FORM_REGISTER), 0, 0x80, // push -0x8000
+    POP | SMALL_FLAG, MAKE_FORM(FORM_REGISTER, FORM_REGISTER), 2, // pop c
+    MOV | SMALL_FLAG, MAKE_FORM(FORM_REGISTER, FORM_U8), 8, 3, // mov r, 3
+    MUL | SMALL_FLAG, MAKE_FORM(FORM_REGISTER, FORM_I16), 0, 0xFE, 0xFF, // loop: mul a, -2
+    SUB | SMALL_FLAG, MAKE_FORM(FORM_REGISTER, FORM_U8), 8, 1, // sub r, 1
+    JZR | SMALL_FLAG, MAKE_FORM(FORM_I16, FORM_REGISTER), 7, 0, // jzr past the following JMP
+    JMP | SMALL_FLAG, MAKE_FORM(FORM_I8, FORM_REGISTER), 0xF3, // jmp -13, back to loop
+    ADD, 0, 1, // add a, b
+    ADD, 0, 2, // add a, c
+    MOV, 8, 0, // mov r, a
+    RET
+};
+
+#define WIDE_RESULT 0xFFFFFFFE7FFEEE69 // (0x1233 * -8) - 0x80000000 - 0xFFFFFFFF - 0x8000
+
+// runs code with execute() and with a decoded-image engine on fresh contexts, with args pushed
+// in order
+// returns nonzero if the return values, bytes executed or registers differ
+int compare_engine(U64 (*engine)(const MVM64_IMAGE*, MVM64_REGISTERS*, INT64*), U64 flags,
+    const U8* code, size_t code_size, const INT64* args, size_t num_args)
+{
+    MVM64_IMAGE* image = create_image(code, code_size, flags);
+    MVM64_REGISTERS* expected = create_context();
+    MVM64_REGISTERS* actual = create_context();
+    INT64 expected_value, actual_value;
+    int mismatch = 0;
+
+    assert(image && expected && actual);
+
+    for (size_t s = 0; s < num_args; s++)
+    {
+        push(args[s], expected);
+        push(args[s], actual);
+    }
+
+    U64 expected_bytes = execute(code, expected, &expected_value);
+    U64 actual_bytes = engine(image, actual, &actual_value);
+
+    if (expected_bytes != actual_bytes || expected_value.u != actual_value.u)
+        mismatch = 1;
+
+    for (size_t s = 0; s < NUM_REGISTERS; s++)
+    {
+        // stack registers are compared relative to each context's own stack
+        if (s == 9 || s == 10)
+            continue;
+
+        if (expected->a[s].u != actual->a[s].u)
+            mismatch = 1;
+    }
+
+    if (expected->s.S.u - expected->s.Z.u != actual->s.S.u - actual->s.Z.u)
+        mismatch = 1;
+
+    free_context(expected);
+    free_context(actual);
+    free_image(image);
+
+    return mismatch;
+}
+
+// runs an image through the JIT, falling back to execute_image() if the host is unsupported
+U64 jit_engine(const MVM64_IMAGE* image, MVM64_REGISTERS* context, INT64* return_value)
+{
+    MVM64_JIT* jit = create_jit(image);
+
+    if (!jit)
+        return execute_image(image, context, return_value);
+
+    U64 bytes_executed = execute_jit(jit, context, return_value);
+
+    free_jit(jit);
+
+    return bytes_executed;
+}
+
+// compares every decoded-image engine against execute()
+int compare_image(const U8* code, size_t code_size, const INT64* args, size_t num_args)
+{
+    return compare_engine(execute_image, 0, code, code_size, args, num_args) +
+        compare_engine(execute_image, IMAGE_FUSE, code, code_size, args, num_args) +
+        compare_engine(execute_threaded, 0, code, code_size, args, num_args) +
+        compare_engine(execute_threaded, IMAGE_FUSE, code, code_size, args, num_args) +
+        compare_engine(jit_engine, IMAGE_FUSE, code, code_size, args, num_args);
+}
+
+// untrusted code, each expected to stop sandboxed execution with its own error
+U8 jumpoutcode[] = { JMP | VALA_FLAG | SMALL_FLAG, 0x40, RET }; // jmp 64
+U8 truncatedcode[] = { ADD | VALB_FLAG, 0, 1, 2 }; // add a, (truncated 64-bit value)
+U8 badregistercode[] = { MOV, 0, 13, RET }; // mov a, (register 13)
+U8 writezcode[] = { MOV | VALB_FLAG | SMALL_FLAG, 10, 0, RET }; // mov z, 0
+U8 smallladrcode[] = { LADR | VALB_FLAG | SMALL_FLAG, 0, 1, RET }; // ladr a, 1
+U8 badrefcode[] = { DREF | VALB_FLAG | SMALL_FLAG, 0, 0x10, RET }; // dref a, 0x10
+U8 overflowcode[] = { PUSH, 0, JMP | VALA_FLAG, 0xFE, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF }; // push a, jmp -2
+U8 underflowcode[] = { POP, 0, RET }; // pop a
+U8 badstorecode[] = { STORE | VALA_FLAG | VALB_FLAG | SMALL_FLAG, 0x10, 1, RET }; // store 0x10, 1
+U8 codestorecode[] = {
+    LADR | VALB_FLAG, 0, 0, 0, 0, 0, 0, 0, 0, 0, // ladr a, 0
+    STOREB | VALB_FLAG | SMALL_FLAG, 0, 1, // storeb a, 1 (into the code)
+    RET
+};
+U8 divzerocode[] = { DIV | VALB_FLAG | SMALL_FLAG, 0, 0, RET }; // div a, 0
+U8 loopcode[] = { JMP | VALA_FLAG | SMALL_FLAG, 0 }; // jmp 0
+U8 widetruncatedcode[] = { ADD | SMALL_FLAG, MAKE_FORM(FORM_REGISTER, FORM_U32), 0, 1, 2 }; // add a, (truncated 32-bit value)
+U8 widereservedcode[] = { MOV | SMALL_FLAG, 0xC0 | MAKE_FORM(FORM_REGISTER, FORM_U8), 0, 1, RET }; // mov a, 1 (reserved form bits)
+U8 widepushcode[] = { PUSH | SMALL_FLAG, MAKE_FORM(FORM_U8, FORM_U8), 1, RET }; // push 1 (form of a missing operand B)
+U8 wideladrcode[] = { LADR | SMALL_FLAG, MAKE_FORM(FORM_REGISTER, FORM_U16), 0, 1, 0, RET }; // ladr a, 1
+U8 badopcodecode[] = { MOV | VALB_FLAG | SMALL_FLAG, 0, 1, 0x1B, 0, RET }; // mov a, 1, (undefined opcode 27)
+U8 wideopcodecode[] = { 0x1F | SMALL_FLAG, MAKE_FORM(FORM_REGISTER, FORM_U8), 0, 1, RET }; // (undefined opcode 31, extended)
+
+typedef struct
+{
+    const U8* code;
+    size_t code_size;
+    MVM64_STATUS expected;
+    int verifies; // nonzero if verify_image() should accept the code
+} SANDBOX_TEST;
+
+// runs code in a sandbox on a fresh context with args pushed in order
+// returns the status, and the return value through return_value
+MVM64_STATUS run_sandboxed(const U8* code, size_t code_size, const INT64* args, size_t num_args,
+    U64 flags, INT64* return_value)
+{
+    MVM64_REGISTERS* context = create_context();
+    MVM64_SANDBOX sandbox = { 0 };
+
+    assert(context);
+
+    sandbox.fuel = 100000;
+    sandbox.flags = flags;
+
+    for (size_t s = 0; s < num_args; s++)
+        push(args[s], context);
+
+    execute_sandboxed(code, code_size, context, &sandbox, return_value);
+
+    free_context(context);
+
+    return sandbox.status;
+}
+
+// checks that well-behaved code runs unchanged in a sandbox, and that each kind of misbehaviour
+// is stopped with its own error
+// returns number of failures
+U64 test_sandbox()
+{
+    SANDBOX_TEST tests[] = {
+        { jumpoutcode, sizeof(jumpoutcode), MVM64_ERROR_CODE_BOUNDS, 0 },
+        { truncatedcode, sizeof(truncatedcode), MVM64_ERROR_CODE_BOUNDS, 0 },
+        { badregistercode, sizeof(badregistercode), MVM64_ERROR_INSTRUCTION, 0 },
+        { writezcode, sizeof(writezcode), MVM64_ERROR_INSTRUCTION, 0 },
+        { smallladrcode, sizeof(smallladrcode), MVM64_ERROR_INSTRUCTION, 0 },
+        { widetruncatedcode, sizeof(widetruncatedcode), MVM64_ERROR_CODE_BOUNDS, 0 },
+        { widereservedcode, sizeof(widereservedcode), MVM64_ERROR_INSTRUCTION, 0 },
+        { widepushcode, sizeof(widepushcode), MVM64_ERROR_INSTRUCTION, 0 },
+        { wideladrcode, sizeof(wideladrcode), MVM64_ERROR_INSTRUCTION, 0 },
+        { badopcodecode, sizeof(badopcodecode), MVM64_ERROR_INSTRUCTION, 0 },
+        { wideopcodecode, sizeof(wideopcodecode), MVM64_ERROR_INSTRUCTION, 0 },
+        { badrefcode, sizeof(badrefcode), MVM64_ERROR_DATA_BOUNDS, 0 },
+        { overflowcode, sizeof(overflowcode), MVM64_ERROR_STACK_OVERFLOW, 1 },
+        { underflowcode, sizeof(underflowcode), MVM64_ERROR_STACK_UNDERFLOW, 1 },
+        { divzerocode, sizeof(divzerocode), MVM64_ERROR_DIVIDE, 1 },
+        { loopcode, sizeof(loopcode), MVM64_ERROR_FUEL, 1 },
+        { badstorecode, sizeof(badstorecode), MVM64_ERROR_DATA_BOUNDS, 1 },
+        { codestorecode, sizeof(codestorecode), MVM64_ERROR_DATA_BOUNDS, 1 },
+        { mixedcode, sizeof(mixedcode), MVM64_OK, 1 },
+        { stackstorecode, sizeof(stackstorecode), MVM64_OK, 1 },
+        { widecode, sizeof(widecode), MVM64_OK, 1 },
+        { testcode, sizeof(testcode), MVM64_OK, 1 }
+    };
+
+    U64 failures = 0;
+    INT64 arg, retnval;
+
+    for (size_t s = 0; s < sizeof(tests) / sizeof(SANDBOX_TEST); s++)
+    {
+        if (run_sandboxed(tests[s].code, tests[s].code_size, NULL, 0, 0, &retnval) != tests[s].expected)
+            failures++;
+    }
+
+    // the verifier must reject everything stopped by the static checks, and accept the rest
+    for (size_t s = 0; s < sizeof(tests) / sizeof(SANDBOX_TEST); s++)
+    {
+        MVM64_IMAGE* image = create_image(tests[s].code, tests[s].code_size, 0);
+        U64 offset;
+
+        assert(image);
+
+        MVM64_STATUS status = verify_image(image, &offset);
+
+        if ((status == MVM64_OK) != tests[s].verifies || (status == MVM64_OK) != !!(image->flags & IMAGE_VERIFIED))
+            failures++;
+
+        free_image(image);
+    }
+
+    if (run_sandboxed(widecode, sizeof(widecode), NULL, 0, SANDBOX_VERIFIED, &retnval) != MVM64_OK ||
+        retnval.u != WIDE_RESULT)
+        failures++;
+
+    // trusted to be verified, an undefined opcode must still stop execution with an error
+    if (run_sandboxed(badopcodecode, sizeof(badopcodecode), NULL, 0, SANDBOX_VERIFIED, &retnval) !=
+        MVM64_ERROR_INSTRUCTION)
+        failures++;
+
+    MVM64_IMAGE* image = create_image(dynamiccode, sizeof(dynamiccode), 0);
+    assert(image);
+
+    if (verify_image(image, NULL) == MVM64_OK)
+        failures++;
+
+    free_image(image);
+
+    for (arg.u = 1; arg.u < 100; arg.u++)
+    {
+        U64 flags = arg.u & 1 ? SANDBOX_VERIFIED : 0;
+
+        if (run_sandboxed(sumcode, sizeof(sumcode), &arg, 1, flags, &retnval) != MVM64_OK ||
+            retnval.u != arg.u * (arg.u + 1) / 2)
+            failures++;
+
+        if (run_sandboxed(shortsumcode, sizeof(shortsumcode), &arg, 1, flags, &retnval) != MVM64_OK ||
+            retnval.u != arg.u * (arg.u + 1) / 2)
+            failures++;
+    }
+
+    return failures;
+}
+
+#define SLICE_CONTEXTS 16
+
+// runs several contexts round-robin on one thread in short slices, checking that each gives the
+// same result as an uninterrupted execute()
+// returns number of incorrect results
+U64 test_slices()
+{
+    MVM64_REGISTERS* contexts[SLICE_CONTEXTS];
+    U64 bytes[SLICE_CONTEXTS];
+    MVM64_STATUS status[SLICE_CONTEXTS];
+    INT64 values[SLICE_CONTEXTS];
+    U64 failures = 0;
+    size_t running = SLICE_CONTEXTS;
+
+    for (size_t s = 0; s < SLICE_CONTEXTS; s++)
+    {
+        INT64 n;
+        n.u = 1 + s * 7;
+
+        contexts[s] = create_context();
+        assert(contexts[s]);
+
+        push(n, contexts[s]);
+        contexts[s]->s.I.u = (U64)sumcode;
+        bytes[s] = 0;
+        status[s] = MVM64_YIELDED;
+    }
+
+    while (running)
+    {
+        for (size_t s = 0; s < SLICE_CONTEXTS; s++)
+        {
+            if (status[s] != MVM64_YIELDED)
+                continue;
+
+            // vary the slice length so slices end at every point in the loop
+            status[s] = execute_slice(contexts[s], 1 + s % 5, &bytes[s], &values[s]);
+
+            if (status[s] != MVM64_YIELDED)
+                running--;
+        }
+    }
+
+    for (size_t s = 0; s < SLICE_CONTEXTS; s++)
+    {
+        MVM64_REGISTERS* context = create_context();
+        INT64 n, expected;
+        n.u = 1 + s * 7;
+
+        assert(context);
+
+        push(n, context);
+
+        if (status[s] != MVM64_OK || execute(sumcode, context, &expected) != bytes[s] ||
+            expected.u != values[s].u)
+            failures++;
+
+        free_context(context);
+        free_context(contexts[s]);
+    }
+
+    return failures;
+}
+
+#define SCHEDULER_WORKERS 4
+#define SCHEDULER_THREADS 500
+
+// runs many VM threads on a scheduler in two batches, checking every result
+// with few workers, each takes more than its queue first holds, and short slices keep them stealing
+// returns number of incorrect results
+U64 test_scheduler(size_t num_workers, U64 slice_instructions)
+{
+    MVM64_SCHEDULER* scheduler = create_scheduler(num_workers, slice_instructions);
+    MVM64_THREAD threads[SCHEDULER_THREADS];
+    U64 failures = 0;
+
+    assert(scheduler);
+
+    for (size_t s = 0; s < SCHEDULER_THREADS; s++)
+    {
+        MVM64_REGISTERS* context = create_context();
+        INT64 n;
+        n.u = 1 + s % 300;
+
+        assert(context);
+
+        push(n, context);
+        init_thread(&threads[s], context, sumcode);
+    }
+
+    int scheduled = schedule_threads(scheduler, threads, SCHEDULER_THREADS / 2) &&
+        schedule_threads(scheduler, threads + SCHEDULER_THREADS / 2, SCHEDULER_THREADS - SCHEDULER_THREADS / 2);
+
+    assert(scheduled);
+
+    wait_scheduler(scheduler);
+    free_scheduler(scheduler);
+
+    for (size_t s = 0; s < SCHEDULER_THREADS; s++)
+    {
+        U64 n = 1 + s % 300;
+
+        if (threads[s].status != MVM64_OK || threads[s].return_value.u != n * (n + 1) / 2 ||
+            threads[s].context->s.S.u != threads[s].context->s.Z.u)
+            failures++;
+
+        free_context(threads[s].context);
+    }
+
+    return failures;
+}
+
+// returns A + B * 2
+U8 registercode[] = {
+    ADD, 0, 1, // add a, b
+    ADD, 0, 1, // add a, b
+    MOV, 8, 0, // mov r, a
+    RET
+};
+
+#define BATCH_RUNS 1000
+
+// runs batches of code taking arguments on the stack and in registers, on one and several threads
+// returns number of incorrect results
+U64 test_batch()
+{
+    MVM64_BATCH_INPUT* inputs = calloc(BATCH_RUNS, sizeof(MVM64_BATCH_INPUT));
+    INT64* args = malloc(BATCH_RUNS * sizeof(INT64));
+    INT64* values = malloc(BATCH_RUNS * sizeof(INT64));
+    MVM64_IMAGE* sum = create_image(sumcode, sizeof(sumcode), IMAGE_FUSE);
+    MVM64_IMAGE* registers = create_image(registercode, sizeof(registercode), IMAGE_FUSE);
+    U64 failures = 0;
+
+    assert(inputs && args && values && sum && registers);
+
+    for (size_t threads = 1; threads <= 4; threads += 3)
+    {
+        for (size_t s = 0; s < BATCH_RUNS; s++)
+        {
+            args[s].u = 1 + s % 300;
+            inputs[s].stack = &args[s];
+            inputs[s].stack_size = 1;
+        }
+
+        failures += execute_batch(sum, inputs, BATCH_RUNS, values, threads);
+
+        for (size_t s = 0; s < BATCH_RUNS; s++)
+        {
+            if (values[s].u != args[s].u * (args[s].u + 1) / 2)
+                failures++;
+        }
+
+        for (size_t s = 0; s < BATCH_RUNS; s++)
+        {
+            inputs[s].registers.s.A.u = s;
+            inputs[s].registers.s.B.u = s * 3;
+            inputs[s].stack = NULL;
+            inputs[s].stack_size = 0;
+        }
+
+        failures += execute_batch(registers, inputs, BATCH_RUNS, values, threads);
+
+        for (size_t s = 0; s < BATCH_RUNS; s++)
+        {
+            if (values[s].u != s * 7)
+                failures++;
+        }
+    }
+
+    free_image(sum);
+    free_image(registers);
+    free(values);
+    free(args);
+    free(inputs);
+
+    return failures;
+}
+
+#define POOL_CONTEXTS 32
+
+// takes every context from a pool, checking that each is reset and on cache lines of its own,
+// then runs code on contexts returned to and taken again from the pool
+// returns number of failures
+U64 test_context_pool()
+{
+    MVM64_CONTEXT_POOL* pool = create_context_pool(POOL_CONTEXTS);
+    MVM64_REGISTERS* contexts[POOL_CONTEXTS];
+    U64 failures = 0;
+
+    assert(pool);
+
+    for (size_t s = 0; s < POOL_CONTEXTS; s++)
+    {
+        contexts[s] = acquire_context(pool);
+
+        if (!contexts[s] || (U64)contexts[s] % CACHE_LINE_SIZE || contexts[s]->s.S.u != contexts[s]->s.Z.u ||
+            contexts[s]->s.R.u)
+        {
+            failures++;
+            continue;
+        }
+
+        // the stack must end before the next context's cache lines begin
+        for (size_t t = 0; t < s; t++)
+        {
+            U64 low = (U64)(contexts[s] < contexts[t] ? contexts[s] : contexts[t]);
+            U64 high = (U64)(contexts[s] < contexts[t] ? contexts[t] : contexts[s]);
+            MVM64_REGISTERS* lower = (MVM64_REGISTERS*)low;
+
+            if (lower->s.Z.u + (STACK_SIZE + 1) * sizeof(INT64) > high)
+                failures++;
+        }
+    }
+
+    if (acquire_context(pool))
+        failures++;
+
+    for (size_t s = 0; s < POOL_CONTEXTS; s++)
+        release_context(pool, contexts[s]);
+
+    for (U64 run = 1; run < 100; run++)
+    {
+        MVM64_REGISTERS* context = acquire_context(pool);
+        INT64 n, retnval;
+        n.u = run;
+
+        push(n, context);
+        execute(sumcode, context, &retnval);
+
+        // leave state behind for the next run to be reset from
+        context->s.S.u += sizeof(INT64);
+
+        if (retnval.u != n.u * (n.u + 1) / 2)
+            failures++;
+
+        release_context(pool, context);
+    }
+
+    free_context_pool(pool);
+
+    return failures;
+}
+
+// pushes n down to 1 then pops and sums them, with n popped off of the stack
+U8 deepcode[] = {
+    POP, 0, // pop a
+    MOV, 8, 0, // mov r, a
+    PUSH, 8, // push: push r
+    SUB | VALB_FLAG | SMALL_FLAG, 8, 1, // sub r, 1
+    JZR | VALA_FLAG | SMALL_FLAG, 11, // jzr pop
+    JMP | VALA_FLAG, 0xF9, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, // jmp push (-7)
+    POP, 1, // pop: pop b
+    ADD, 2, 1, // add c, b
+    SUB | VALB_FLAG | SMALL_FLAG, 0, 1, // sub a, 1
+    MOV, 8, 0, // mov r, a
+    JZR | VALA_FLAG | SMALL_FLAG, 11, // jzr done
+    JMP | VALA_FLAG, 0xF3, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, // jmp pop (-13)
+    MOV, 8, 2, // done: mov r, c
+    RET
+};
+
+#define PROGRAM_VMS 100
+
+// runs many VMs sharing one program in interleaved slices, with stacks grown as they deepen
+// returns number of incorrect results
+U64 test_program()
+{
+    MVM64_PROGRAM* program = create_program(deepcode, sizeof(deepcode));
+    MVM64_VM* vms[PROGRAM_VMS];
+    MVM64_STATUS status[PROGRAM_VMS];
+    INT64 values[PROGRAM_VMS];
+    U64 bytes[PROGRAM_VMS];
+    U64 failures = 0;
+    size_t running = PROGRAM_VMS;
+
+    assert(program);
+
+    for (size_t s = 0; s < PROGRAM_VMS; s++)
+    {
+        INT64 n;
+        n.u = 1 + s % (STACK_SIZE - 1);
+
+        vms[s] = create_vm(program);
+        assert(vms[s]);
+
+        if (!push_vm(vms[s], n))
+            failures++;
+
+        status[s] = MVM64_YIELDED;
+        bytes[s] = 0;
+    }
+
+    // the VMs keep the program alive
+    release_program(program);
+
+    while (running)
+    {
+        for (size_t s = 0; s < PROGRAM_VMS; s++)
+        {
+            if (status[s] != MVM64_YIELDED)
+                continue;
+
+            status[s] = run_vm(vms[s], 1 + s % 13, &bytes[s], &values[s]);
+
+            if (status[s] != MVM64_YIELDED)
+                running--;
+        }
+    }
+
+    for (size_t s = 0; s < PROGRAM_VMS; s++)
+    {
+        U64 n = 1 + s % (STACK_SIZE - 1);
+
+        if (status[s] != MVM64_OK || values[s].u != n * (n + 1) / 2 || vms[s]->info.stack_size < n)
+            failures++;
+
+        free_vm(vms[s]);
+    }
+
+    return failures;
+}
+
+#define GUARDED_STACK_SIZE 4096 // a whole number of pages
+#define GROWN_STACK_SIZE 50000
+
+// runs deepcode to depth n on context, from an empty stack
+// returns status of the run, with the sum in *sum
+MVM64_STATUS run_deep(MVM64_REGISTERS* context, U64 n, INT64* sum)
+{
+    U64 bytes = 0;
+    INT64 arg;
+    arg.u = n;
+
+    reset_context(context);
+    context->s.I.u = (U64)deepcode;
+
+    if (n)
+        push(arg, context);
+
+    return execute_slice(context, (U64)-1, &bytes, sum);
+}
+
+// runs deepcode on contexts with stacks of their own sizes, and on guarded stacks that fault on
+// overflow and underflow or grow as they're used
+// returns number of failures
+U64 test_stacks()
+{
+    MVM64_REGISTERS* sized = create_context_stack(1000, 0);
+    MVM64_REGISTERS* guarded = create_context_stack(GUARDED_STACK_SIZE, CONTEXT_GUARDED);
+    MVM64_REGISTERS* grown = create_context_stack(GROWN_STACK_SIZE, CONTEXT_GUARDED | CONTEXT_GROW);
+    MVM64_SANDBOX sandbox = { 0 };
+    INT64 sum, arg;
+    U64 failures = 0;
+
+    assert(sized && guarded && grown);
+
+    if (CONTEXT_INFO(sized)->stack_size != 1000 || CONTEXT_INFO(guarded)->stack_size != GUARDED_STACK_SIZE ||
+        CONTEXT_INFO(grown)->stack_size < GROWN_STACK_SIZE)
+        failures++;
+
+    if (run_deep(sized, 1000, &sum) != MVM64_OK || sum.u != 1000 * 1001 / 2)
+        failures++;
+
+    if (run_deep(guarded, GUARDED_STACK_SIZE, &sum) != MVM64_OK ||
+        sum.u != GUARDED_STACK_SIZE * (GUARDED_STACK_SIZE + 1) / 2)
+        failures++;
+
+    // one push too many writes the high guard page, and popping an empty stack reads the low one
+    if (run_deep(guarded, GUARDED_STACK_SIZE + 1, &sum) != MVM64_ERROR_STACK_OVERFLOW || sum.u)
+        failures++;
+
+    if (run_deep(guarded, 0, &sum) != MVM64_ERROR_STACK_UNDERFLOW)
+        failures++;
+
+    // the context is usable again once reset
+    reset_context(guarded);
+    arg.u = 10;
+    push(arg, guarded);
+
+    if (!execute(deepcode, guarded, &sum) || sum.u != 55)
+        failures++;
+
+    reset_context(guarded);
+    arg.u = GUARDED_STACK_SIZE + 1;
+    push(arg, guarded);
+
+    if (execute(deepcode, guarded, &sum))
+        failures++;
+
+    // the sandbox catches overflow itself, before the guard page does
+    reset_context(guarded);
+    push(arg, guarded);
+    sandbox.fuel = (U64)-1;
+
+    if (execute_sandboxed(deepcode, sizeof(deepcode), guarded, &sandbox, &sum) ||
+        sandbox.status != MVM64_ERROR_STACK_OVERFLOW)
+        failures++;
+
+    if (run_deep(grown, GROWN_STACK_SIZE, &sum) != MVM64_OK ||
+        sum.u != (U64)GROWN_STACK_SIZE * (GROWN_STACK_SIZE + 1) / 2)
+        failures++;
+
+    free_context(sized);
+    free_context(guarded);
+    free_context(grown);
+
+    return failures;
+}
+
+#define MEMORY_SIZE 0x100000
+
+// stores and loads in guest memory, with a guest address that wraps at the end of it
+U8 memorycode[] = {
+    MOV | VALB_FLAG | SMALL_FLAG, 0, 0x80, // mov a, 0x80
+    STORE | VALB_FLAG, 0, 0x88, 0x77, 0x66, 0x55, 0x44, 0x33, 0x22, 0x11, // store a, 0x1122334455667788
+    DREF, 1, 0, // dref b, a
+    STOREB | VALA_FLAG | VALB_FLAG | SMALL_FLAG, 0x88, 0xAB, // storeb 0x88, 0xAB
+    LOADB | VALB_FLAG | SMALL_FLAG, 2, 0x88, // loadb c, 0x88
+    STORE | VALA_FLAG, 0x00, 0x02, 0, 0, 0, 0, 0xFF, 0xFF, 1, // store 0xFFFF000000000200, b
+    DREF | VALB_FLAG, 4, 0x00, 0x02, 0, 0, 0, 0, 0, 0, // dref e, 0x200
+    XOR, 4, 1, // xor e, b
+    ADD, 2, 4, // add c, e
+    ADD, 1, 2, // add b, c
+    MOV, 8, 1, // mov r, b
+    RET
+};
+
+#define MEMORY_RESULT 0x1122334455667833
+
+// loads the guest address of an inline value, then the value from it, when run from guest memory
+U8 guestladrcode[] = {
+    LADR | VALB_FLAG, 0, 0xEF, 0xCD, 0xAB, 0x89, 0x67, 0x45, 0x23, 0x01, // ladr a, 0x0123456789ABCDEF
+    DREF, 1, 0, // dref b, a
+    MOV, 8, 0, // mov r, a
+    ADD, 8, 1, // add r, b
+    RET
+};
+
+#define GUEST_CODE 0x1000 // guest address guestladrcode is run from
+#define GUEST_LADR_RESULT (GUEST_CODE + 2 + 0x0123456789ABCDEF)
+
+// registers have no guest address
+U8 registerladrcode[] = { LADR, 0, 1, RET }; // ladr a, b
+
+#define MEMORY_ENGINES 6
+
+// runs code with one of the engines on a fresh context with memory attached
+// returns number of bytes executed, or 0 on error
+U64 run_on_memory(size_t engine, const U8* code, size_t code_size, MVM64_MEMORY* memory,
+    INT64* return_value)
+{
+    MVM64_REGISTERS* context = create_context();
+    MVM64_IMAGE* image = create_image(code, code_size, IMAGE_FUSE);
+    MVM64_SANDBOX sandbox = { 0 };
+    U64 bytes_executed = 0;
+
+    assert(context && image);
+
+    attach_memory(context, memory);
+    context->s.I.u = (U64)code;
+    sandbox.fuel = 100000;
+
+    switch (engine)
+    {
+    case 0:
+        bytes_executed = execute(code, context, return_value);
+        break;
+    case 1:
+        if (execute_slice(context, 3, &bytes_executed, return_value) != MVM64_YIELDED)
+            bytes_executed = 0;
+        else if (execute_slice(context, 100, &bytes_executed, return_value) != MVM64_OK)
+            bytes_executed = 0;
+        break;
+    case 2:
+        bytes_executed = execute_sandboxed(code, code_size, context, &sandbox, return_value);
+        break;
+    case 3:
+        bytes_executed = execute_image(image, context, return_value);
+        break;
+    case 4:
+        bytes_executed = execute_threaded(image, context, return_value);
+        break;
+    case 5:
+        bytes_executed = jit_engine(image, context, return_value);
+        break;
+    }
+
+    free_image(image);
+    free_context(context);
+
+    return bytes_executed;
+}
+
+// runs code that addresses guest memory on every engine, and code that runs from guest memory
+// returns number of failures
+U64 test_memory()
+{
+    U64 failures = 0;
+    INT64 retnval, value;
+
+    for (size_t engine = 0; engine < MEMORY_ENGINES; engine++)
+    {
+        MVM64_MEMORY* memory = create_memory(MEMORY_SIZE);
+
+        assert(memory && memory->size == MEMORY_SIZE);
+
+        if (!run_on_memory(engine, memorycode, sizeof(memorycode), memory, &retnval) ||
+            retnval.u != MEMORY_RESULT)
+            failures++;
+
+        if (!read_memory(memory, 0x200, &value, sizeof(value)) || value.u != 0x1122334455667788)
+            failures++;
+
+        // code loaded into guest memory has guest addresses for its inline values
+        if (!write_memory(memory, GUEST_CODE, guestladrcode, sizeof(guestladrcode)) ||
+            !run_on_memory(engine, GUEST_POINTER(memory, GUEST_CODE), sizeof(guestladrcode), memory,
+                &retnval) || retnval.u != GUEST_LADR_RESULT)
+            failures++;
+
+        if (run_on_memory(engine, registerladrcode, sizeof(registerladrcode), memory, &retnval))
+            failures++;
+
+        if (write_memory(memory, MEMORY_SIZE - 1, &value, sizeof(value)))
+            failures++;
+
+        free_memory(memory);
+    }
+
+    return failures;
+}
+
+#define FORKS 100
+#define FORK_DEPTH 1000
+
+// runs deepcode partway on a context with memory, then finishes the run on many forks of a
+// snapshot taken there, each writing its own copy of the memory, and runs code from guest memory
+// on a fork that outlives its snapshot and source
+// returns number of failures
+U64 test_snapshots()
+{
+    MVM64_REGISTERS* context = create_context_stack(FORK_DEPTH, CONTEXT_GUARDED | CONTEXT_GROW);
+    MVM64_MEMORY* memory = create_memory(MEMORY_SIZE);
+    U64 failures = 0, bytes = 0;
+    INT64 sum, arg, value;
+
+    assert(context && memory);
+
+    attach_memory(context, memory);
+    value.u = 0x1234;
+    write_memory(memory, 0x200, &value, sizeof(value));
+
+    reset_context(context);
+    context->s.I.u = (U64)deepcode;
+    arg.u = FORK_DEPTH;
+    push(arg, context);
+
+    if (execute_slice(context, FORK_DEPTH * 2, &bytes, &sum) != MVM64_YIELDED)
+        failures++;
+
+    MVM64_SNAPSHOT* snapshot = snapshot_context(context);
+    assert(snapshot);
+
+    // the source carries on without disturbing the snapshot
+    value.u = 0x5678;
+    write_memory(memory, 0x200, &value, sizeof(value));
+
+    if (execute_slice(context, (U64)-1, &bytes, &sum) != MVM64_OK || sum.u != FORK_DEPTH * (FORK_DEPTH + 1) / 2)
+        failures++;
+
+    for (U64 s = 0; s < FORKS; s++)
+    {
+        MVM64_REGISTERS* fork = fork_context(snapshot);
+
+        if (!fork)
+        {
+            failures++;
+            continue;
+        }
+
+        // no fork sees the writes of the source or of earlier forks
+        MVM64_MEMORY* forked = CONTEXT_INFO(fork)->memory;
+
+        if (!read_memory(forked, 0x200, &value, sizeof(value)) || value.u != 0x1234)
+            failures++;
+
+        value.u = s;
+        write_memory(forked, 0x200, &value, sizeof(value));
+        bytes = 0;
+
+        if (execute_slice(fork, (U64)-1, &bytes, &sum) != MVM64_OK || sum.u != FORK_DEPTH * (FORK_DEPTH + 1) / 2)
+            failures++;
+
+        free_context(fork);
+    }
+
+    free_snapshot(snapshot);
+
+    // I is moved to the same guest address in the fork's memory
+    write_memory(memory, GUEST_CODE, guestladrcode, sizeof(guestladrcode));
+    reset_context(context);
+    context->s.I.u = (U64)GUEST_POINTER(memory, GUEST_CODE);
+
+    snapshot = snapshot_context(context);
+    assert(snapshot);
+
+    free_context(context);
+    free_memory(memory);
+
+    MVM64_REGISTERS* fork = fork_context(snapshot);
+    free_snapshot(snapshot);
+
+    if (!fork || execute_slice(fork, (U64)-1, &bytes, &sum) != MVM64_OK || sum.u != GUEST_LADR_RESULT)
+        failures++;
+
+    free_context(fork);
+
+    return failures;
+}
+
+// suspends deepcode partway to a checkpoint in a file and resumes it from there with memory
+// mapped, then resumes code run from guest memory from a checkpoint after it in the same file,
+// which is read rather than mapped as it doesn't start on a page
+// returns number of failures
+#define MEMORY_SIZE_TOO_SMALL 2048
+
+U64 test_checkpoints()
+{
+    MVM64_REGISTERS* context = create_context_stack(FORK_DEPTH, CONTEXT_GUARDED | CONTEXT_GROW);
+    MVM64_MEMORY* memory = create_memory(MEMORY_SIZE);
+    FILE* file = tmpfile();
+    U64 failures = 0, bytes = 0;
+    INT64 sum, arg, value;
+
+    assert(context && memory && file);
+
+    attach_memory(context, memory);
+    value.u = 0x1234;
+    write_memory(memory, 0x200, &value, sizeof(value));
+
+    reset_context(context);
+    context->s.I.u = (U64)deepcode;
+    arg.u = FORK_DEPTH;
+    push(arg, context);
+
+    if (execute_slice(context, FORK_DEPTH * 2, &bytes, &sum) != MVM64_YIELDED ||
+        !write_checkpoint(file, context, deepcode, sizeof(deepcode)))
+        failures++;
+
+    write_memory(memory, GUEST_CODE, guestladrcode, sizeof(guestladrcode));
+    reset_context(context);
+    context->s.I.u = (U64)GUEST_POINTER(memory, GUEST_CODE);
+
+    if (!write_checkpoint(file, context, deepcode, sizeof(deepcode)))
+        failures++;
+
+    free_context(context);
+    free_memory(memory);
+    rewind(file);
+
+    // only the code the checkpoint was written on will do
+    if (read_checkpoint(file, sumcode, sizeof(sumcode)))
+        failures++;
+
+    rewind(file);
+    context = read_checkpoint(file, deepcode, sizeof(deepcode));
+
+    if (!context || !(CONTEXT_INFO(context)->memory->flags & MEMORY_VIEW) ||
+        !read_memory(CONTEXT_INFO(context)->memory, 0x200, &value, sizeof(value)) || value.u != 0x1234 ||
+        !execute_resume(context, &sum) || sum.u != FORK_DEPTH * (FORK_DEPTH + 1) / 2)
+        failures++;
+
+    free_context(context);
+    context = read_checkpoint(file, deepcode, sizeof(deepcode));
+
+    if (!context || (CONTEXT_INFO(context)->memory->flags & MEMORY_VIEW) ||
+        !execute_resume(context, &sum) || sum.u != GUEST_LADR_RESULT)
+        failures++;
+
+    free_context(context);
+
+    if (read_checkpoint(file, deepcode, sizeof(deepcode)))
+        failures++;
+
+    fclose(file);
+
+    // a memory smaller than create_memory() makes is rejected, whether it would be mapped or read
+    // memory_size follows the magic, version, header size, code hash, code size, flags, registers,
+    // stack size, context flags and depth of the version 1 header
+    long memory_size_offset = 8 + 2 * sizeof(U32) + 3 * sizeof(U64) + sizeof(MVM64_REGISTERS) + 3 * sizeof(U64);
+
+    context = create_context();
+    memory = create_memory(0);
+    file = tmpfile();
+    assert(context && memory && file);
+
+    attach_memory(context, memory);
+    context->s.I.u = (U64)deepcode;
+    value.u = MEMORY_SIZE_TOO_SMALL;
+
+    // the first is mapped from the start of the file, and the second, which isn't aligned, is read
+    long starts[2] = { 0, 0 };
+
+    if (!write_checkpoint(file, context, deepcode, sizeof(deepcode)) || (starts[1] = ftell(file)) <= 0 ||
+        !write_checkpoint(file, context, deepcode, sizeof(deepcode)))
+        failures++;
+
+    for (size_t s = 0; s < 2; s++)
+    {
+        long start = starts[s];
+
+        fseek(file, start + memory_size_offset, SEEK_SET);
+        fwrite(&value, sizeof(value), 1, file);
+        fseek(file, start, SEEK_SET);
+
+        MVM64_REGISTERS* resumed = read_checkpoint(file, deepcode, sizeof(deepcode));
+
+        if (resumed)
+        {
+            failures++;
+            free_context(resumed);
+        }
+    }
+
+    free_context(context);
+    free_memory(memory);
+    fclose(file);
+
+    return failures;
+}
+
+#define PROFILE_ARG 50
+#define PROFILE_TIMER_ARG 3000000
+
+// a line table for sumcode, as the assembler would write it
+const char* sumlines =
+    "MVM64 LINES 1\n"
+    "SOURCE sum.asm\n"
+    "SYMBOL 0 SUM\n"
+    "SYMBOL 8 LOOP\n"
+    "LINE 0 2\n" "LINE 2 3\n" "LINE 5 4\n" "LINE 8 6\n" "LINE 11 7\n"
+    "LINE 14 8\n" "LINE 16 9\n" "LINE 25 10\n" "LINE 28 11\n";
+
+#ifndef _WIN32
+#ifdef __linux__
+#define PROFILE_TIMER_THREADS 3
+#else
+#define PROFILE_TIMER_THREADS 1 // the profiling timer is for the whole process
+#endif
+#define PROFILE_TIMER_PERIOD 1000 // in microseconds
+
+typedef struct
+{
+    U64 arg;
+    U64 failures;
+} PROFILE_TIMER_JOB;
+
+// samples a run of sumcode on a timer, which must take a sample for at least every 20 periods
+// of the thread's CPU time, allowing for a coarse scheduler tick
+void* profile_timer_thread(void* param)
+{
+    PROFILE_TIMER_JOB* job = (PROFILE_TIMER_JOB*)param;
+    MVM64_REGISTERS* context = create_context();
+    MVM64_PROFILE* profile = create_profile(sumcode, sizeof(sumcode));
+    struct timespec start, end;
+    INT64 arg, retnval;
+
+    assert(context && profile);
+
+    job->failures = 0;
+    arg.u = job->arg;
+    push(arg, context);
+    context->s.I.u = (U64)sumcode;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+
+    U64 bytes_executed = execute_profiled_timer(context, profile, PROFILE_TIMER_PERIOD, &retnval);
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+
+    U64 cpu_time = (U64)(end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+
+    if (!bytes_executed || retnval.u != job->arg * (job->arg + 1) / 2 || profile->outside ||
+        profile->samples < cpu_time / (PROFILE_TIMER_PERIOD * 20))
+        job->failures++;
+
+    free_profile(profile);
+    free_context(context);
+
+    return NULL;
+}
+#endif
+
+// samples sumcode after every instruction, checking the count at each offset and the folded
+// stacks written by source line, then samples a long run on a timer
+// returns number of failures
+U64 test_profile()
+{
+    MVM64_REGISTERS* context = create_context();
+    MVM64_PROFILE* profile = create_profile(sumcode, sizeof(sumcode));
+    FILE* file = tmpfile();
+    U64 failures = 0;
+    INT64 arg, retnval;
+    char text[256];
+
+    assert(context && profile && file);
+
+    arg.u = PROFILE_ARG;
+    push(arg, context);
+    context->s.I.u = (U64)sumcode;
+
+    // I is sampled before each instruction but the first
+    if (!execute_profiled(context, profile, 1, &retnval) || retnval.u != PROFILE_ARG * (PROFILE_ARG + 1) / 2 ||
+        profile->samples != 4 * PROFILE_ARG + 3 || profile->outside || profile->hits[8] != PROFILE_ARG ||
+        profile->hits[16] != PROFILE_ARG - 1 || profile->hits[28] != 1)
+        failures++;
+
+    fputs(sumlines, file);
+    rewind(file);
+
+    MVM64_LINE_TABLE* table = read_line_table(file);
+
+    if (!table || table->num_lines != 9 || table->num_symbols != 2)
+        failures++;
+
+    // the loop is line 6, under the LOOP symbol
+    rewind(file);
+
+    if (!table || !write_folded_stacks(file, profile, table))
+        failures++;
+
+    int found = 0;
+    rewind(file);
+
+    while (fgets(text, sizeof(text), file))
+        found |= !strcmp(text, "sum.asm;LOOP;sum.asm:6 50\n");
+
+    if (!found)
+        failures++;
+
+    free_line_table(table);
+    free_profile(profile);
+    fclose(file);
+
+#ifndef _WIN32
+    // one long run is profiled beside short ones, which must neither stop its timer when they
+    // finish nor take its samples
+    PROFILE_TIMER_JOB jobs[PROFILE_TIMER_THREADS];
+    pthread_t threads[PROFILE_TIMER_THREADS];
+
+    for (size_t s = 0; s < PROFILE_TIMER_THREADS; s++)
+    {
+        jobs[s].arg = s ? PROFILE_TIMER_ARG / 8 : PROFILE_TIMER_ARG * 4;
+
+        int created = pthread_create(&threads[s], NULL, profile_timer_thread, &jobs[s]);
+        assert(created == 0);
+    }
+
+    for (size_t s = 0; s < PROFILE_TIMER_THREADS; s++)
+    {
+        pthread_join(threads[s], NULL);
+        failures += jobs[s].failures;
+    }
+#endif
+
+    free_context(context);
+
+    return failures;
+}
+
+#define TRACE_ARG 50
+#define TRACE_CAPACITY 64
+
+U64 test_trace()
+{
+    MVM64_REGISTERS* context = create_context();
+    MVM64_TRACE* trace = create_trace(TRACE_CAPACITY);
+    FILE* file = tmpfile();
+    U64 failures = 0;
+    INT64 arg, retnval;
+
+    assert(context && trace && file && !set_thread_trace(trace));
+
+    // nothing is recorded without CONTEXT_TRACE
+    arg.u = TRACE_ARG;
+    push(arg, context);
+    execute(sumcode, context, &retnval);
+
+    if (trace->next)
+        failures++;
+
+    // every instruction is recorded, and the ring keeps the last TRACE_CAPACITY of them
+    reset_context(context);
+    set_context_trace(context, 1);
+    push(arg, context);
+    execute(sumcode, context, &retnval);
+
+    const MVM64_TRACE_RECORD* last = &trace->records[(trace->next - 1) & trace->mask];
+    const MVM64_TRACE_RECORD* move = &trace->records[(trace->next - 2) & trace->mask];
+
+    if (retnval.u != TRACE_ARG * (TRACE_ARG + 1) / 2 || trace->next != 4 * TRACE_ARG + 4 ||
+        trace->mask + 1 != TRACE_CAPACITY || TRACE_ADDRESS(last) != (U64)sumcode + 28 ||
+        TRACE_INSTRUCTION(last) != RET || last->r.u != retnval.u || TRACE_ADDRESS(move) != (U64)sumcode + 25 ||
+        move->a.u != 0 || move->b.u != retnval.u)
+        failures++;
+
+    MVM64_TRACE_HEADER header;
+    MVM64_TRACE_RECORD record;
+
+    if (!write_trace(file, trace, (U64)sumcode))
+        failures++;
+
+    rewind(file);
+
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) ||
+        header.num_records != TRACE_CAPACITY || header.dropped != 4 * TRACE_ARG + 4 - TRACE_CAPACITY)
+        failures++;
+
+    // records are written oldest first, ending with the RET
+    for (U64 n = 0; n < header.num_records && fread(&record, sizeof(record), 1, file) == 1; n++)
+    {
+        if (n == header.num_records - 1 && (TRACE_ADDRESS(&record) != 28 || TRACE_INSTRUCTION(&record) != RET))
+            failures++;
+    }
+
+    // a traced context returned to a pool isn't traced for its next user
+    MVM64_CONTEXT_POOL* pool = create_context_pool(1);
+    U64 recorded = trace->next;
+
+    assert(pool);
+
+    MVM64_REGISTERS* pooled = acquire_context(pool);
+    set_context_trace(pooled, 1);
+    release_context(pool, pooled);
+
+    pooled = acquire_context(pool);
+    push(arg, pooled);
+    execute(sumcode, pooled, &retnval);
+
+    if (trace->next != recorded)
+        failures++;
+
+    release_context(pool, pooled);
+    free_context_pool(pool);
+
+    set_thread_trace(NULL);
+    free_trace(trace);
+    free_context(context);
+    fclose(file);
+
+    return failures;
+}
+
+#define STRESS_THREADS 8
+#define STRESS_RUNS 2000
+
+typedef struct
+{
+    U64 seed;
+    U64 failures;
+} STRESS_JOB;
+
+// runs many short-lived contexts on the calling thread, checking every result
+U64 stress_worker(STRESS_JOB* job)
+{
+    for (U64 s = 0; s < STRESS_RUNS; s++)
+    {
+        MVM64_REGISTERS* context = create_context();
+
+        if (!context)
+        {
+            job->failures++;
+            continue;
+        }
+
+        INT64 n, retnval;
+        n.u = 1 + ((job->seed + s) % 200);
+        push(n, context);
+
+        execute(sumcode, context, &retnval);
+
+        if (retnval.u != n.u * (n.u + 1) / 2 || context->s.S.u != context->s.Z.u)
+            job->failures++;
+
+        free_context(context);
+    }
+
+    return job->failures;
+}
+
+#ifdef _WIN32
+DWORD WINAPI stress_thread(LPVOID param)
+{
+    stress_worker((STRESS_JOB*)param);
+    return 0;
+}
+#else
+void* stress_thread(void* param)
+{
+    stress_worker((STRESS_JOB*)param);
+    return NULL;
+}
+#endif
+
+// executes separate contexts concurrently on several threads
+// returns number of incorrect results
+U64 stress_test_threads()
+{
+    STRESS_JOB jobs[STRESS_THREADS];
+    U64 failures = 0;
+
+#ifdef _WIN32
+    HANDLE threads[STRESS_THREADS];
+#else
+    pthread_t threads[STRESS_THREADS];
+#endif
+
+    for (size_t s = 0; s < STRESS_THREADS; s++)
+    {
+        jobs[s].seed = s * 37;
+        jobs[s].failures = 0;
+
+#ifdef _WIN32
+        threads[s] = CreateThread(NULL, 0, stress_thread, &jobs[s], 0, NULL);
+        assert(threads[s]);
+#else
+        int created = pthread_create(&threads[s], NULL, stress_thread, &jobs[s]);
+        assert(created == 0);
+#endif
+    }
+
+    for (size_t s = 0; s < STRESS_THREADS; s++)
+    {
+#ifdef _WIN32
+        WaitForSingleObject(threads[s], INFINITE);
+        CloseHandle(threads[s]);
+#else
+        pthread_join(threads[s], NULL);
+#endif
+        failures += jobs[s].failures;
+    }
+
+    return failures;
+}
+
+#ifdef MVM64_WITH_STATS
+// prints the statistics of a run, leaving out instructions and flag combinations never dispatched
+void print_stats(const MVM64_STATS* stats)
+{
+    static const char* flag_names[8] = {
+        "reg, reg", "val, reg", "reg, val", "val, val",
+        "extended", "val, reg small", "reg, val small", "val, val small"
+    };
+
+    for (size_t s = 0; s < NUM_INSTRUCTIONS; s++)
+    {
+        if (stats->instructions[s])
+            printf("  %-16s %10llu\n", INSTRUCTIONS[s], stats->instructions[s]);
+    }
+
+    for (size_t s = 0; s < 8; s++)
+    {
+        if (stats->flags[s])
+            printf("  %-16s %10llu\n", flag_names[s], stats->flags[s]);
+    }
+
+    printf("  JZR taken %llu, not taken %llu, stack high water %llu\n", stats->jzr_taken,
+        stats->jzr_not_taken, stats->stack_high_water);
+}
+#endif
+
 U8 buffer[1024];
 
 int main(int argc, char* argv[])
@@ -46,6 +1470,62 @@ int main(int argc, char* argv[])
 
     free_context(context);
 
+    U64 failures = stress_test_threads();
+
+    MVM64_IMAGE* image = create_image(testcode, sizeof(testcode), 0);
+    MVM64_JIT* jit = create_jit(image);
+
+    printf("Test JIT: %s\n", jit ? "native x86-64 translation" : "unsupported host, skipped");
+
+    free_jit(jit);
+    free_image(image);
+
+    printf("Test threads: %d threads x %d runs, %llu failures\n", STRESS_THREADS, STRESS_RUNS, failures);
+
+    INT64 arg;
+    failures = compare_image(testcode, sizeof(testcode), NULL, 0);
+    failures += compare_image(dynamiccode, sizeof(dynamiccode), NULL, 0);
+    failures += compare_image(mixedcode, sizeof(mixedcode), NULL, 0);
+    failures += compare_image(stackstorecode, sizeof(stackstorecode), NULL, 0);
+    failures += compare_image(widecode, sizeof(widecode), NULL, 0);
+    failures += compare_image(badopcodecode, sizeof(badopcodecode), NULL, 0);
+
+    for (arg.u = 1; arg.u < 100; arg.u++)
+    {
+        failures += compare_image(sumcode, sizeof(sumcode), &arg, 1);
+        failures += compare_image(shortsumcode, sizeof(shortsumcode), &arg, 1);
+    }
+
+    printf("Test image: decoded and JIT execution, %llu mismatches\n", failures);
+
+    printf("Test sandbox: %llu failures\n", test_sandbox());
+
+    printf("Test slices: %d contexts interleaved, %llu failures\n", SLICE_CONTEXTS, test_slices());
+
+    printf("Test context pool: %d contexts, %llu failures\n", POOL_CONTEXTS, test_context_pool());
+
+    printf("Test programs: %d VMs sharing a program, %llu failures\n", PROGRAM_VMS, test_program());
+
+    printf("Test stacks: sized, guarded and grown, %llu failures\n", test_stacks());
+
+    printf("Test memory: guest loads and stores on %d engines, %llu failures\n", MEMORY_ENGINES,
+        test_memory());
+
+    printf("Test snapshots: %d forks of a snapshot, %llu failures\n", FORKS, test_snapshots());
+
+    printf("Test checkpoints: suspended and resumed through a file, %llu failures\n", test_checkpoints());
+
+    printf("Test profile: sampled by instruction and timer, %llu failures\n", test_profile());
+
+    printf("Test trace: %d records kept of a traced run, %llu failures\n", TRACE_CAPACITY, test_trace());
+
+    printf("Test batch: %d runs on 1 and 4 threads, %llu failures\n", BATCH_RUNS, test_batch());
+
+    printf("Test scheduler: %d VM threads on %d workers, %llu failures\n", SCHEDULER_THREADS,
+        SCHEDULER_WORKERS, test_scheduler(SCHEDULER_WORKERS, 16));
+    printf("Test scheduler: %d VM threads on 2 workers, 1 instruction slices, %llu failures\n",
+        SCHEDULER_THREADS, test_scheduler(2, 1));
+
     FILE* bin;
     fopen_s(&bin, binary, "r");
 
@@ -75,9 +1555,89 @@ int main(int argc, char* argv[])
     twenty.u = 20;
     push(twenty, context);
 
+#ifdef MVM64_WITH_STATS
+    MVM64_STATS stats = { 0 };
+    CONTEXT_INFO(context)->stats = &stats;
+#endif
+
     code_executed = execute(buffer, context, &retnval);
 
     printf("Test binary: Executed 0x%llx bytes, return value 0x%llx\n", code_executed, retnval.u);
 
+#ifdef MVM64_WITH_STATS
+    print_stats(&stats);
+#endif
+
     free_context(context);
+
+    // given the binary's line table, report where the run spends its time by source line
+    if (argc > 2)
+    {
+        FILE* lines;
+        fopen_s(&lines, argv[2], "r");
+
+        MVM64_LINE_TABLE* table = lines ? read_line_table(lines) : NULL;
+        MVM64_PROFILE* profile = create_profile(buffer, read);
+
+        context = create_context();
+        assert(context && profile);
+
+        push(twenty, context);
+        context->s.I.u = (U64)buffer;
+        execute_profiled(context, profile, 1, &retnval);
+
+        printf("Test binary profile: by line of %s\n", table ? table->source : "(no line table)");
+        write_profile_report(stdout, profile, table);
+
+        free_context(context);
+        free_profile(profile);
+        free_line_table(table);
+
+        if (lines)
+            fclose(lines);
+    }
+
+    failures = 0;
+
+    for (arg.u = 1; arg.u < 50; arg.u++)
+        failures += compare_image(buffer, read, &arg, 1);
+
+    printf("Test binary image: decoded and JIT execution, %llu mismatches\n", failures);
+
+    image = create_image(buffer, read, 0);
+    assert(image);
+
+    failures = verify_image(image, NULL) != MVM64_OK;
+
+    for (arg.u = 1; arg.u < 50; arg.u++)
+    {
+        INT64 expected_value;
+
+        context = create_context();
+        assert(context);
+
+        push(arg, context);
+        execute(buffer, context, &expected_value);
+        free_context(context);
+
+        if (run_sandboxed(buffer, read, &arg, 1, 0, &retnval) != MVM64_OK || retnval.u != expected_value.u)
+            failures++;
+
+        MVM64_SANDBOX sandbox = { 0 };
+        sandbox.fuel = 100000;
+
+        context = create_context();
+        assert(context);
+
+        push(arg, context);
+        execute_image_sandboxed(image, context, &sandbox, &retnval);
+        free_context(context);
+
+        if (sandbox.status != MVM64_OK || retnval.u != expected_value.u)
+            failures++;
+    }
+
+    free_image(image);
+
+    printf("Test binary sandbox: verified and checked execution, %llu failures\n", failures);
 }